@@ -1,15 +1,18 @@
 #include <set>
 #include <array>
+#include <deque>
 #include <atomic>
 #include <vector>
 #include <cstdio>
 #include <thread>
 #include <cstdlib>
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <functional>
 
 #include <poll.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -19,66 +22,110 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #include "common.h"
 
 class FDList {
+protected:
+    // index in fds by fd, built on first close_fd
+    std::vector<int> pos;
+
+    void set_pos(int fd, int idx) {
+        if ((size_t)fd >= pos.size())
+            pos.resize(fd + 1, -1);
+        pos[fd] = idx;
+    }
+
 public:
     std::vector<int> fds;
     ~FDList() {
         for(int fd: fds)
             close(fd);
     }
+
+    void add(int fd) {
+        if (not pos.empty())
+            set_pos(fd, fds.size());
+        fds.push_back(fd);
+    }
+
+    // churn closes connections all the time, so it's O(1) and fds order isn't kept.
+    // fds shouldn't be changed directly after first call
+    void close_fd(int fd) {
+        if (pos.empty())
+            for(size_t idx = 0; idx < fds.size(); ++idx)
+                set_pos(fds[idx], idx);
+
+        if ((size_t)fd < pos.size() and -1 != pos[fd]) {
+            int idx = pos[fd];
+            set_pos(fds.back(), idx);
+            fds[idx] = fds.back();
+            fds.pop_back();
+            pos[fd] = -1;
+        }
+        close(fd);
+    }
 };
 
 class FDCloser {
 public:
     int fd;
     FDCloser(int _fd): fd(_fd) {}
-    ~FDCloser() { close(fd); }
+    ~FDCloser() {
+        if (-1 != fd)
+            close(fd);
+    }
 };
 
 class PollRSelector: public RSelector {
 protected:
     std::vector<pollfd> fds;
-    std::vector<pollfd>::iterator current_free;
-    std::vector<pollfd>::iterator current_ready;
+    // slots of removed fds, reused by add_fd
+    std::vector<size_t> free_slots;
+    size_t current_ready;
+
+    bool add(int sockfd, short events) {
+        pollfd pfd{sockfd, events, 0};
+        if (free_slots.empty()) {
+            fds.push_back(pfd);
+        } else {
+            fds[free_slots.back()] = pfd;
+            free_slots.pop_back();
+        }
+        return true;
+    }
 
 public:
-    PollRSelector(int fd_count) {
-        fds.resize(fd_count);
-        current_free = fds.begin();
-        current_ready = current_free;
-        std::memset(&fds[0], 0, sizeof(fds[0]) * fd_count);
+    PollRSelector(int fd_count): current_ready(0) {
+        fds.reserve(fd_count);
     }
 
     bool add_fd(int sockfd) {
-        if (current_free == fds.end()) {
-            std::cerr << "no space left in fd pool\n";
-            return false;
-        }
-        current_free->fd = sockfd;
-        current_free->events = POLLIN;
-        ++current_free;
-        return true;
+        return add(sockfd, POLLIN);
+    }
+
+    bool add_listener(int sockfd) {
+        return add(sockfd, POLLIN);
     }
 
     bool wait(long int=-1) {
-        int rv = poll(&fds[0], current_free - fds.begin(), -1);
+        int rv = poll(&fds[0], fds.size(), -1);
         if (-1 == rv) {
             std::perror("poll(fds, ..., -1) fails");
             return false;
         }
-        current_ready = fds.begin();
+        current_ready = 0;
         return true;
     }
 
     bool next(int & sockfd, uint32_t & flags) {
-        for(;fds.end() != current_ready; ++current_ready) {
-            if (0 == current_ready->revents or current_ready->fd == -1)
+        for(;fds.size() != current_ready; ++current_ready) {
+            if (0 == fds[current_ready].revents or fds[current_ready].fd == -1)
                 continue;
-            sockfd = current_ready->fd;
-            flags = current_ready->revents;
+            sockfd = fds[current_ready].fd;
+            flags = fds[current_ready].revents;
             ++current_ready;
             return true;
         }
@@ -86,7 +133,13 @@ public:
     }
 
     void remove_current_ready() {
-        (current_ready - 1)->fd = -1;
+        fds[current_ready - 1].fd = -1;
+        free_slots.push_back(current_ready - 1);
+    }
+
+    bool set_write_interest(bool enable) {
+        fds[current_ready - 1].events = enable ? POLLIN | POLLOUT : POLLIN;
+        return true;
     }
 };
 
@@ -98,6 +151,80 @@ unsigned long time_ns() {
 }
 
 
+// MSG_ZEROCOPY echo for th/poll/epoll/epoll_mt engines, set by set_zerocopy
+bool echo_zerocopy = false;
+
+extern "C"
+void set_zerocopy(int enable) {
+    echo_zerocopy = (0 != enable);
+}
+
+// TCP_FASTOPEN queue for tcp listeners, 0 - disabled. Set by set_fastopen,
+// kernel needs net.ipv4.tcp_fastopen server bit (2) as well
+int echo_fastopen = 0;
+
+extern "C"
+void set_fastopen(int qlen) {
+    echo_fastopen = qlen;
+}
+
+void enable_fastopen(int listen_sock) {
+    if (0 != echo_fastopen and
+            0 > setsockopt(listen_sock, IPPROTO_TCP, TCP_FASTOPEN, &echo_fastopen, sizeof(echo_fastopen)))
+        perror("setsockopt(TCP_FASTOPEN) failed");
+}
+
+// loader closes and reopens connections during the test, so engines keep
+// accepting till all connections are closed. Set by set_churn
+bool echo_churn = false;
+
+extern "C"
+void set_churn(int enable) {
+    echo_churn = (0 != enable);
+}
+
+// tcp engines, accepting with wait_for_conn, listen on that many consecutive
+// ports from given one. Each destination port gives loader own ephemeral port
+// range per client address. Set by set_listen_ports
+int echo_listen_ports = 1;
+
+extern "C"
+void set_listen_ports(int count) {
+    echo_listen_ports = std::max(count, 1);
+}
+
+// connections, accepted per listener wakeup, so reconnect burst can't
+// hold back echo for established connections
+const int ACCEPT_BATCH = 64;
+
+// accepts up to ACCEPT_BATCH connections from nonblocking listener. Listener
+// should be level triggered, as some connections may be left in queue
+bool accept_batch(int listen_sock, std::vector<int> & accepted, int flags=SOCK_NONBLOCK) {
+    accepted.clear();
+    for(int i = 0; i < ACCEPT_BATCH; ++i) {
+        int client_sock = accept4(listen_sock, nullptr, nullptr, flags);
+        if (client_sock < 0) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno)
+                break;
+            // client gave up before accept
+            if (ECONNABORTED == errno)
+                continue;
+            perror("accept4 failed");
+            return false;
+        }
+
+        if (echo_zerocopy and not enable_zerocopy(client_sock)) {
+            close(client_sock);
+            return false;
+        }
+        accepted.push_back(client_sock);
+    }
+    return true;
+}
+
+// accepts sock_count connections on echo_listen_ports listeners. listener - if
+// not null, gets nonblocking listening socket to accept more, otherwise it's closed.
+// Only single listener can be passed out
 bool wait_for_conn(int sock_count,
                    std::vector<int> & sockets,
                    const char * ip,
@@ -105,39 +232,71 @@ bool wait_for_conn(int sock_count,
                    const int listen_queue,
                    void (*ready_for_connect)(),
                    std::function<void(int)> * on_sock_cb,
-                   bool async=false)
+                   bool async=false,
+                   int * listener=nullptr)
 {
     (void)ip;
 
-    sockaddr_in server, client;
-    int master_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (-1 == master_sock){
-        perror("Could not create socket");
+    if (nullptr != listener and 1 != echo_listen_ports) {
+        std::cerr << "Accepting during the test needs single listen port\n";
         return false;
     }
 
-    FDCloser _master_sock(master_sock);
-    int enable = 1;
-    if (setsockopt(master_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-        perror("setsockopt(SO_REUSEADDR) failed");
+    FDList listeners;
+    std::vector<pollfd> pfds;
+    for(int i = 0; i < echo_listen_ports; ++i) {
+        int master_sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (-1 == master_sock){
+            perror("Could not create socket");
+            return false;
+        }
+        listeners.add(master_sock);
+        pfds.push_back(pollfd{master_sock, POLLIN, 0});
 
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(port);
+        int enable = 1;
+        if (setsockopt(master_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+            perror("setsockopt(SO_REUSEADDR) failed");
 
-    if( 0 > bind(master_sock, (sockaddr *)&server , sizeof(server))) {
-        perror("bind failed. Error");
-        return 1;
-    }
+        enable_fastopen(master_sock);
+
+        sockaddr_in server;
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = INADDR_ANY;
+        server.sin_port = htons(port + i);
+
+        if( 0 > bind(master_sock, (sockaddr *)&server , sizeof(server))) {
+            perror("bind failed. Error");
+            return false;
+        }
 
-    listen(master_sock, listen_queue);
-    socklen_t sock_data_len = sizeof(client);
+        listen(master_sock, listen_queue);
+    }
+    int master_sock = pfds[0].fd;
 
     if (nullptr != ready_for_connect)
         ready_for_connect();
 
+    // blocking accept on the single listener, poll over several
+    size_t next_ready = 0;
     for(int i = 0; i < sock_count; ++i){
-        int client_sock = accept(master_sock, (sockaddr *)&client, &sock_data_len);
+        if (pfds.size() > 1) {
+            while(next_ready == pfds.size() or 0 == (pfds[next_ready].revents & POLLIN)) {
+                if (next_ready == pfds.size()) {
+                    if (0 > poll(&pfds[0], pfds.size(), -1)) {
+                        if (EINTR == errno)
+                            continue;
+                        perror("poll(listeners) failed");
+                        return false;
+                    }
+                    next_ready = 0;
+                } else {
+                    ++next_ready;
+                }
+            }
+            master_sock = pfds[next_ready++].fd;
+        }
+
+        int client_sock = accept(master_sock, nullptr, nullptr);
         if (client_sock < 0) {
             perror("accept failed");
             return false;
@@ -155,38 +314,148 @@ bool wait_for_conn(int sock_count,
                 return false;
             }
         }
+        if (echo_zerocopy and not enable_zerocopy(client_sock)) {
+            close(client_sock);
+            return false;
+        }
+
         sockets.push_back(client_sock);
         if (nullptr != on_sock_cb) {
             (*on_sock_cb)(client_sock);
         }
     }
+
+    if (nullptr != listener) {
+        if (0 > fcntl(master_sock, F_SETFL, fcntl(master_sock, F_GETFL, 0) | O_NONBLOCK)) {
+            std::perror("fcntl(master_sock, F_SETFL, O_NONBLOCK)");
+            return false;
+        }
+        *listener = master_sock;
+        listeners.fds.clear();
+    }
     return true;
 }
 
-bool process_message(int sockfd, const char * message, int message_len) {
-    char buffer[message_len];
-    int bc = recv(sockfd, buffer, message_len, 0);
-    if (0 > bc) {
-        if (ECONNRESET != errno)
-            std::perror("recv(sockfd, buffer.begin(), buffer.size(), 0)");
-        return false;
-    } else if (0 == bc) {
-        return false;
-    } else if (message_len != bc){
-        std::perror("partial message");
-        return false;
+void add_zerocopy_stats(ZeroCopyStats & total, const ZeroCopyStats & stats) {
+    total.sends += stats.sends;
+    total.completed += stats.completed;
+    total.copied += stats.copied;
+    total.fallbacks += stats.fallbacks;
+}
+
+void print_zerocopy_stats(const ZeroCopyStats & stats) {
+    std::cout << "Zerocopy sends " << stats.sends << ", completed " << stats.completed;
+    std::cout << ", copied by kernel " << stats.copied << ", fallbacks to copy " << stats.fallbacks << "\n";
+}
+
+// blocking echo of one message, tcp may deliver and accept it in parts.
+// buffer - scratch space for received data, message content is never checked.
+// zc - if not null, message is send with MSG_ZEROCOPY. message should stay unchanged
+// till all sends are completed
+bool process_message(int sockfd, std::vector<char> & buffer,
+                     const char * message, int message_len, ZeroCopyStats * zc=nullptr) {
+    for(int received = 0; received < message_len;) {
+        size_t chunk = std::min(buffer.size(), (size_t)(message_len - received));
+        int bc = recv(sockfd, &buffer[0], chunk, 0);
+        if (0 > bc) {
+            if (ECONNRESET != errno)
+                std::perror("recv(sockfd, &buffer[0], chunk, 0)");
+            return false;
+        } else if (0 == bc) {
+            return false;
+        }
+        received += bc;
     }
 
-    if (message_len != write(sockfd, message, message_len)) {
-        std::perror("write(sockfd, message, std::strlen(message))");
-        return false;
+    for(int sent = 0; sent < message_len;) {
+        long bc;
+        if (nullptr != zc)
+            bc = send_zerocopy(sockfd, message + sent, message_len - sent, *zc);
+        else
+            bc = write(sockfd, message + sent, message_len - sent);
+
+        if (0 > bc) {
+            std::perror("write(sockfd, message, message_len)");
+            return false;
+        }
+        sent += bc;
     }
 
     return true;
 }
 
-void th_func(int sockfd, const char * message, int msize) {
-    while(process_message(sockfd, message, msize));
+// echo progress of nonblocking tcp connection. Replies are
+// send from constant message, so byte counters are enough
+struct EchoConn {
+    int received;           // bytes of not completed request
+    bool want_write;        // subscribed for writability in selector
+    unsigned long unsent;   // reply bytes, not accepted by socket yet
+};
+
+// sends queued replies till socket buffer is full
+bool flush_replies(int sockfd, EchoConn & conn, const char * message, int message_len,
+                   ZeroCopyStats * zc) {
+    while(0 != conn.unsent) {
+        size_t chunk = std::min(conn.unsent, (unsigned long)message_len);
+        long bc;
+        if (nullptr != zc)
+            bc = send_zerocopy(sockfd, message, chunk, *zc);
+        else
+            bc = send(sockfd, message, chunk, MSG_DONTWAIT);
+
+        if (0 > bc) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno)
+                return true;
+            if (ECONNRESET != errno and EPIPE != errno)
+                std::perror("send(sockfd, message, chunk, ...)");
+            return false;
+        }
+        conn.unsent -= bc;
+    }
+    return true;
+}
+
+// nonblocking echo: reads all available data, queues reply for every complete
+// request and sends as much, as socket accepts. Rest is send on next writability.
+// Returns false, if connection should be closed
+bool process_stream(int sockfd, EchoConn & conn, std::vector<char> & buffer,
+                    const char * message, int message_len, ZeroCopyStats * zc=nullptr) {
+    for(;;) {
+        int bc = recv(sockfd, &buffer[0], buffer.size(), MSG_DONTWAIT);
+        if (0 > bc) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno)
+                break;
+            if (ECONNRESET != errno)
+                std::perror("recv(sockfd, &buffer[0], buffer.size(), MSG_DONTWAIT)");
+            return false;
+        } else if (0 == bc) {
+            return false;
+        }
+
+        conn.received += bc;
+        conn.unsent += (unsigned long)(conn.received / message_len) * message_len;
+        conn.received %= message_len;
+    }
+
+    return flush_replies(sockfd, conn, message, message_len, zc);
+}
+
+// completions are read in batches, as blocking socket has no poll loop
+const int TH_ZEROCOPY_BATCH = 64;
+
+void th_func(int sockfd, const char * message, int msize, ZeroCopyStats * zc) {
+    std::vector<char> buffer(std::min(msize, MAX_RECV_CHUNK));
+
+    if (nullptr == zc) {
+        while(process_message(sockfd, buffer, message, msize));
+        return;
+    }
+
+    for(unsigned long count = 1; process_message(sockfd, buffer, message, msize, zc); ++count)
+        if (0 == count % TH_ZEROCOPY_BATCH and 0 > read_zerocopy_completions(sockfd, *zc))
+            break;
+
+    wait_zerocopy_completions(std::vector<int>(1, sockfd), *zc, BILLION);
 }
 
 extern "C"
@@ -199,15 +468,47 @@ int run_test_th(const char * ip,
                 void (*preparation_done)(),
                 void (*test_done)())
 {
-    char message[msize];
-    std::memset(message, 'X', msize);
+    std::vector<char> message(msize, 'X');
 
     FDList sockets;
     std::vector<std::thread> threads;
+    // deque, as threads keep pointers to own stats
+    std::deque<ZeroCopyStats> zc_stats;
+    ZeroCopyStats zc_total;
+    std::memset(&zc_total, 0, sizeof(zc_total));
+    ZeroCopyBufferKeeper<std::vector<char>> keep_message(zc_total, message);
+    // threads, which still serve connection
+    std::atomic_int live(0);
+
+    // threads for churn connections are detached and close own socket,
+    // so finished ones don't pile up till the end of the test
+    auto start_thread = [&](int sock, bool churn_conn){
+        ZeroCopyStats * zc = nullptr;
+        if (echo_zerocopy) {
+            zc_stats.emplace_back();
+            zc = &zc_stats.back();
+            std::memset(zc, 0, sizeof(*zc));
+        }
+
+        ++live;
+        std::thread th([&, sock, churn_conn, zc](){
+            th_func(sock, &message[0], msize, zc);
+            if (churn_conn)
+                close(sock);
+            --live;
+        });
+
+        if (churn_conn)
+            th.detach();
+        else
+            threads.push_back(std::move(th));
+    };
+
     std::function<void(int)> cb = [&](int sock){
-        threads.emplace_back(th_func, sock, &message[0], msize);
+        start_thread(sock, false);
     };
 
+    int listen_sock = -1;
     if (not wait_for_conn(th_count,
                           sockets.fds,
                           ip,
@@ -215,15 +516,61 @@ int run_test_th(const char * ip,
                           listen_queue,
                           ready_for_connect,
                           &cb,
-                          false))
+                          false,
+                          echo_churn ? &listen_sock : nullptr))
         return 1;
+    FDCloser listener(listen_sock);
 
     if (nullptr != preparation_done)
         preparation_done();
 
+    bool failed = false;
+    if (-1 != listen_sock) {
+        std::vector<int> accepted;
+        pollfd pfd = {listen_sock, POLLIN, 0};
+
+        // accept till all connections are closed, replacement may come after last close
+        for(;;) {
+            bool last = (0 == live.load());
+            int ready = poll(&pfd, 1, last ? 0 : 100);
+            if (0 > ready and EINTR != errno) {
+                perror("poll(listener) failed");
+                failed = true;
+                break;
+            }
+
+            if (0 >= ready) {
+                if (last)
+                    break;
+                continue;
+            }
+
+            if (not accept_batch(listen_sock, accepted, 0)) {
+                failed = true;
+                break;
+            }
+
+            for(int sock: accepted)
+                start_thread(sock, true);
+        }
+
+        // detached threads use message and counters
+        while(0 != live.load())
+            usleep(1000);
+    }
+
     for(auto & th: threads)
         th.join();
 
+    for(const auto & stats: zc_stats)
+        add_zerocopy_stats(zc_total, stats);
+
+    if (failed)
+        return 1;
+
+    if (echo_zerocopy)
+        print_zerocopy_stats(zc_total);
+
     if (nullptr != test_done)
         test_done();
 
@@ -241,37 +588,102 @@ int run_test(RSelector & selector,
              void (*test_done)())
 {
     int fd_left = th_count;
-    char message[msize];
-    std::memset(message, 'X', msize);
+    std::vector<char> message(msize, 'X');
+    std::vector<char> buffer(std::min(msize, MAX_RECV_CHUNK));
     FDList sockets;
 
-    if (not wait_for_conn(th_count, sockets.fds, ip, port, listen_queue, ready_for_connect, nullptr, false))
+    ZeroCopyStats zc_stats;
+    std::memset(&zc_stats, 0, sizeof(zc_stats));
+    ZeroCopyStats * zc = echo_zerocopy ? &zc_stats : nullptr;
+    ZeroCopyBufferKeeper<std::vector<char>> keep_message(zc_stats, message);
+
+    int listen_sock = -1;
+    if (not wait_for_conn(th_count, sockets.fds, ip, port, listen_queue, ready_for_connect, nullptr, true,
+                          echo_churn ? &listen_sock : nullptr))
         return 1;
+    FDCloser listener(listen_sock);
 
-    for(int sockfd: sockets.fds)
+    int max_fd = 0;
+    for(int sockfd: sockets.fds) {
         if (not selector.add_fd(sockfd))
             return 1;
+        max_fd = std::max(max_fd, sockfd);
+    }
+
+    std::vector<EchoConn> conns(max_fd + 1, EchoConn{0, false, 0});
+    std::vector<int> accepted;
+
+    auto accept_new = [&]() {
+        if (not accept_batch(listen_sock, accepted))
+            return false;
+
+        for(int client_sock: accepted) {
+            sockets.add(client_sock);
+            if ((size_t)client_sock >= conns.size())
+                conns.resize(client_sock + 1);
+            conns[client_sock] = EchoConn{0, false, 0};
+            if (not selector.add_fd(client_sock))
+                return false;
+            ++fd_left;
+        }
+        return true;
+    };
+
+    if (-1 != listen_sock and not selector.add_listener(listen_sock))
+        return 1;
 
     if (nullptr != preparation_done)
         preparation_done();
 
-    while(fd_left > 0) {
+    for(;;) {
+        // loader connects replacement before closing old connection, but
+        // last close still may come before replacement is accepted
+        if (0 == fd_left) {
+            if (-1 == listen_sock)
+                break;
+            if (not accept_new())
+                return 1;
+            if (0 == fd_left)
+                break;
+        }
+
         if (not selector.wait())
             return 1;
 
         uint32_t events;
         int sockfd;
         while(selector.next(sockfd, events)) {
+            if (sockfd == listen_sock) {
+                if (not accept_new())
+                    return 1;
+                continue;
+            }
+
             bool close_sock = false;
 
-            if ((events & POLLHUP) or (events & POLLERR)) {
+            // zerocopy completions are reported as POLLERR
+            if (nullptr != zc and (events & POLLERR)) {
+                close_sock = (0 > read_zerocopy_completions(sockfd, *zc));
+                events &= ~POLLERR;
+            }
+
+            if (close_sock) {
+                // socket error
+            } else if ((events & POLLHUP) or (events & POLLERR)) {
                 close_sock = true;
             } else if (events & POLLNVAL) {
                 std::cerr << "Poll - POLLNVAL for fd " << sockfd;
                 std::cerr << " val " << events << "\n";
                 close_sock = true;
-            } else if (events & POLLIN) {
-                close_sock = not process_message(sockfd, message, msize);
+            } else if (events & (POLLIN | POLLOUT)) {
+                auto & conn = conns[sockfd];
+                close_sock = not process_stream(sockfd, conn, buffer, &message[0], msize, zc);
+
+                // wait for free space in socket buffer only while there is something to send
+                if (not close_sock and (0 != conn.unsent) != conn.want_write) {
+                    conn.want_write = not conn.want_write;
+                    close_sock = not selector.set_write_interest(conn.want_write);
+                }
             } else if (0 != events) {
                 std::cerr << "Poll - ??? for fd " << sockfd;
                 std::cerr << " val " << events << "\n";
@@ -281,16 +693,33 @@ int run_test(RSelector & selector,
             if (close_sock) {
                 selector.remove_current_ready();
                 --fd_left;
+                if (-1 != listen_sock)
+                    sockets.close_fd(sockfd);
             }
         }
     }
 
+    // kernel should finish with message before return
+    if (nullptr != zc) {
+        wait_zerocopy_completions(sockets.fds, zc_stats, BILLION);
+        print_zerocopy_stats(zc_stats);
+    }
+
     if (nullptr != test_done)
         test_done();
 
     return 0;
 }
 
+// busy poll policy for epoll based engines, set by set_busy_poll
+BusyPollParams echo_busy_poll = {0, 0};
+
+extern "C"
+void set_busy_poll(int spin_us, int busy_poll_us) {
+    echo_busy_poll.spin_ns = (long)spin_us * 1000;
+    echo_busy_poll.busy_poll_us = busy_poll_us;
+}
+
 extern "C"
 int run_test_epoll(const char * ip,
                    const int port,
@@ -302,13 +731,927 @@ int run_test_epoll(const char * ip,
                    void (*test_done)())
 {
     EPollRSelector eps(th_count);
-    if (not eps.ok())
+    if (not eps.ok() or not eps.set_busy_poll(echo_busy_poll))
         return 1;
     return run_test(eps, ip, port, th_count, msize,
                     listen_queue,
                     ready_for_connect, preparation_done, test_done);
 }
 
+// biggest pipe, requested for splice echo. Kernel may refuse it for
+// unprivileged user (fs.pipe-max-size, fs.pipe-user-pages-soft)
+const int SPLICE_MAX_PIPE = 1024 * 1024;
+
+// splice echo connection: data goes from socket to pipe and back
+// to the same socket, never landing in user space
+struct SpliceConn {
+    int pipe_rd, pipe_wr;
+    size_t in_pipe;     // bytes in pipe, not send back yet
+    size_t pipe_size;
+};
+
+// moves all available data socket -> pipe -> socket, till socket is drained
+// or its send buffer is full. Returns false, if connection should be closed
+bool splice_echo(int sockfd, SpliceConn & conn) {
+    for(;;) {
+        bool progress = false;
+
+        // EAGAIN here - socket is empty or pipe is full
+        if (conn.in_pipe < conn.pipe_size) {
+            ssize_t bc = splice(sockfd, nullptr, conn.pipe_wr, nullptr, conn.pipe_size - conn.in_pipe,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (0 < bc) {
+                conn.in_pipe += bc;
+                progress = true;
+            } else if (0 == bc) {
+                return false;
+            } else if (EAGAIN != errno) {
+                if (ECONNRESET != errno)
+                    std::perror("splice(sockfd, nullptr, pipe_wr, ...)");
+                return false;
+            }
+        }
+
+        if (0 != conn.in_pipe) {
+            ssize_t bc = splice(conn.pipe_rd, nullptr, sockfd, nullptr, conn.in_pipe,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (0 < bc) {
+                conn.in_pipe -= bc;
+                progress = true;
+            } else if (0 > bc and EAGAIN != errno) {
+                if (ECONNRESET != errno and EPIPE != errno)
+                    std::perror("splice(pipe_rd, nullptr, sockfd, ...)");
+                return false;
+            }
+        }
+
+        if (not progress)
+            return true;
+    }
+}
+
+// stream echo via per-connection pipe. There are no message boundaries
+// on this path, bytes are returned as they come. splice already avoids
+// user space copies, so set_zerocopy has no effect here
+extern "C"
+int run_test_splice(const char * ip,
+                    const int port,
+                    const int th_count,
+                    int msize,
+                    int listen_queue,
+                    void (*ready_for_connect)(),
+                    void (*preparation_done)(),
+                    void (*test_done)())
+{
+    int fd_left = th_count;
+    FDList sockets;
+    FDList pipes;
+
+    int listen_sock = -1;
+    if (not wait_for_conn(th_count, sockets.fds, ip, port, listen_queue, ready_for_connect, nullptr, true,
+                          echo_churn ? &listen_sock : nullptr))
+        return 1;
+    FDCloser listener(listen_sock);
+
+    EPollRSelector selector(th_count);
+    if (not selector.ok() or not selector.set_busy_poll(echo_busy_poll))
+        return 1;
+
+    int max_fd = 0;
+    for(int sockfd: sockets.fds)
+        max_fd = std::max(max_fd, sockfd);
+
+    std::vector<SpliceConn> conns(max_fd + 1, SpliceConn{-1, -1, 0, 0});
+
+    // whole message in pipe saves splice calls, but small messages don't need default 64KiB
+    int pipe_size = std::min(std::max(msize, (int)sysconf(_SC_PAGESIZE)), SPLICE_MAX_PIPE);
+
+    auto add_conn = [&](int sockfd) {
+        int pipefd[2];
+        if (0 > pipe2(pipefd, O_NONBLOCK)) {
+            std::perror("pipe2(pipefd, O_NONBLOCK)");
+            return false;
+        }
+        pipes.add(pipefd[0]);
+        pipes.add(pipefd[1]);
+
+        // on failure pipe keeps its default size, which works too
+        fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size);
+        int real_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+        if (0 > real_size) {
+            std::perror("fcntl(pipe, F_GETPIPE_SZ)");
+            return false;
+        }
+
+        if ((size_t)sockfd >= conns.size())
+            conns.resize(sockfd + 1, SpliceConn{-1, -1, 0, 0});
+        conns[sockfd] = SpliceConn{pipefd[0], pipefd[1], 0, (size_t)real_size};
+
+        // edge triggered EPOLLOUT resumes data, which didn't fit into send buffer
+        return selector.add_fd(sockfd, EPOLLIN | EPOLLOUT | EPOLLET);
+    };
+
+    for(int sockfd: sockets.fds)
+        if (not add_conn(sockfd))
+            return 1;
+
+    std::vector<int> accepted;
+    auto accept_new = [&]() {
+        if (not accept_batch(listen_sock, accepted))
+            return false;
+
+        for(int client_sock: accepted) {
+            sockets.add(client_sock);
+            if (not add_conn(client_sock))
+                return false;
+            ++fd_left;
+        }
+        return true;
+    };
+
+    if (-1 != listen_sock and not selector.add_listener(listen_sock))
+        return 1;
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    for(;;) {
+        // same as in run_test - replacement may come after last close
+        if (0 == fd_left) {
+            if (-1 == listen_sock)
+                break;
+            if (not accept_new())
+                return 1;
+            if (0 == fd_left)
+                break;
+        }
+
+        if (not selector.wait())
+            return 1;
+
+        uint32_t events;
+        int sockfd;
+        while(selector.next(sockfd, events)) {
+            if (sockfd == listen_sock) {
+                if (not accept_new())
+                    return 1;
+                continue;
+            }
+
+            bool close_sock = false;
+
+            if ((events & EPOLLHUP) or (events & EPOLLERR)) {
+                close_sock = true;
+            } else if (events & (EPOLLIN | EPOLLOUT)) {
+                close_sock = not splice_echo(sockfd, conns[sockfd]);
+            } else if (0 != events) {
+                std::cerr << "Epoll - ??? for fd " << sockfd;
+                std::cerr << " val " << events << "\n";
+                close_sock = true;
+            }
+
+            if (close_sock) {
+                selector.remove_current_ready();
+                --fd_left;
+                if (-1 != listen_sock) {
+                    auto & conn = conns[sockfd];
+                    pipes.close_fd(conn.pipe_rd);
+                    pipes.close_fd(conn.pipe_wr);
+                    sockets.close_fd(sockfd);
+                }
+            }
+        }
+    }
+
+    if (nullptr != test_done)
+        test_done();
+
+    return 0;
+}
+
+const unsigned short URING_BGID = 0;
+
+int run_test_uring(bool sqpoll,
+                   const char * ip,
+                   const int port,
+                   const int th_count,
+                   const int msize,
+                   const int listen_queue,
+                   void (*ready_for_connect)(),
+                   void (*preparation_done)(),
+                   void (*test_done)())
+{
+    int fd_left = th_count;
+    std::vector<char> message(msize, 'X');
+    FDList sockets;
+
+    int listen_sock = -1;
+    if (not wait_for_conn(th_count, sockets.fds, ip, port, listen_queue, ready_for_connect, nullptr, false,
+                          echo_churn ? &listen_sock : nullptr))
+        return 1;
+    FDCloser listener(listen_sock);
+
+    URing ring(4096, sqpoll);
+    if (not ring.ok())
+        return 1;
+
+    // closed loop - only one message in flight per socket, big ones are received in chunks
+    if (not ring.setup_buf_ring(URING_BGID, th_count, std::min(msize, MAX_RECV_CHUNK)))
+        return 1;
+
+    if (not ring.has_buf_ring())
+        std::cerr << "io_uring buffer ring isn't usable, fallback to IORING_OP_PROVIDE_BUFFERS\n";
+
+    int max_fd = 0;
+    for(int sockfd: sockets.fds)
+        max_fd = std::max(max_fd, sockfd);
+
+    std::vector<char> active(max_fd + 1, 0);
+    // bytes of not completed request
+    std::vector<int> received(max_fd + 1, 0);
+    // requests, which may still complete. With churn fd can be closed and
+    // reused only after all of them, or completions would go to a new connection
+    std::vector<int> inflight(max_fd + 1, 0);
+
+    auto add_conn = [&](int sockfd) {
+        if ((size_t)sockfd >= active.size()) {
+            active.resize(sockfd + 1, 0);
+            received.resize(sockfd + 1, 0);
+            inflight.resize(sockfd + 1, 0);
+        }
+
+        io_uring_sqe * sqe = ring.get_sqe();
+        if (nullptr == sqe)
+            return false;
+        uring_prep_recv_multishot(sqe, sockfd, URING_BGID, sockfd);
+        active[sockfd] = 1;
+        received[sockfd] = 0;
+        inflight[sockfd] = 1;
+        return true;
+    };
+
+    for(int sockfd: sockets.fds)
+        if (not add_conn(sockfd))
+            return 1;
+
+    // listener is polled in one-shot mode, sockets get blocking flags,
+    // same as ones from wait_for_conn
+    std::vector<int> accepted;
+    auto accept_new = [&]() {
+        if (not accept_batch(listen_sock, accepted, 0))
+            return false;
+
+        for(int client_sock: accepted) {
+            sockets.add(client_sock);
+            if (not add_conn(client_sock))
+                return false;
+            ++fd_left;
+        }
+        return true;
+    };
+
+    auto poll_listener = [&]() {
+        io_uring_sqe * sqe = ring.get_sqe();
+        if (nullptr == sqe)
+            return false;
+        uring_prep_rw(sqe, IORING_OP_POLL_ADD, listen_sock, nullptr, 0, listen_sock);
+        sqe->poll32_events = POLLIN;
+        return true;
+    };
+
+    if (-1 != listen_sock and not poll_listener())
+        return 1;
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    io_uring_cqe cqe;
+    for(;;) {
+        // same as in run_test - replacement may come after last close
+        if (0 == fd_left) {
+            if (-1 == listen_sock)
+                break;
+            if (not accept_new())
+                return 1;
+            if (0 == fd_left)
+                break;
+        }
+
+        // submit all sends queued on previous round and wait for new completions
+        if (not ring.submit(1))
+            return 1;
+
+        while(ring.next(cqe)) {
+            int sockfd = uring_tag_fd(cqe.user_data);
+            bool close_sock = false;
+
+            if (-1 != listen_sock and cqe.user_data == (unsigned long long)listen_sock) {
+                if (0 > cqe.res and -ECANCELED != cqe.res) {
+                    std::cerr << "poll(listener) failed: " << std::strerror(-cqe.res) << "\n";
+                    return 1;
+                }
+                if (not accept_new() or not poll_listener())
+                    return 1;
+                continue;
+            }
+
+            if (cqe.user_data & URING_SEND_TAG) {
+                --inflight[sockfd];
+                int size = (int)uring_send_size(cqe.user_data);
+                if (0 > cqe.res and -EAGAIN != cqe.res) {
+                    if (-ECONNRESET != cqe.res and -EPIPE != cqe.res)
+                        std::cerr << "send failed: " << std::strerror(-cqe.res) << "\n";
+                    close_sock = true;
+                } else if (cqe.res < size and active[sockfd]) {
+                    // short send - resubmit the rest
+                    unsigned rest = size - std::max(cqe.res, 0);
+                    io_uring_sqe * sqe = ring.get_sqe();
+                    if (nullptr == sqe)
+                        return 1;
+                    uring_prep_rw(sqe, IORING_OP_SEND, sockfd, &message[0], rest,
+                                  uring_send_tag(sockfd, rest));
+                    ++inflight[sockfd];
+                }
+            } else {
+                bool rearm = not (cqe.flags & IORING_CQE_F_MORE);
+                if (rearm)
+                    --inflight[sockfd];
+
+                // data is never sent from recv buffer, so can return it immediatelly
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                    ring.recycle_buf((unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+
+                if (-ENOBUFS == cqe.res) {
+                    // all buffers are busy, multishot recv get terminated
+                } else if (0 > cqe.res) {
+                    if (-ECONNRESET != cqe.res)
+                        std::cerr << "recv failed: " << std::strerror(-cqe.res) << "\n";
+                    close_sock = true;
+                } else if (0 == cqe.res) {
+                    close_sock = true;
+                } else if (active[sockfd]) {
+                    // request may come in parts, reply when it's complete
+                    for(received[sockfd] += cqe.res; received[sockfd] >= msize; received[sockfd] -= msize) {
+                        io_uring_sqe * sqe = ring.get_sqe();
+                        if (nullptr == sqe)
+                            return 1;
+                        uring_prep_rw(sqe, IORING_OP_SEND, sockfd, &message[0], msize,
+                                      uring_send_tag(sockfd, msize));
+                        ++inflight[sockfd];
+                    }
+                }
+
+                if (rearm and not close_sock and active[sockfd]) {
+                    io_uring_sqe * sqe = ring.get_sqe();
+                    if (nullptr == sqe)
+                        return 1;
+                    uring_prep_recv_multishot(sqe, sockfd, URING_BGID, sockfd);
+                    ++inflight[sockfd];
+                }
+            }
+
+            // late completions for already closed socket are ignored
+            if (close_sock and active[sockfd]) {
+                active[sockfd] = 0;
+                shutdown(sockfd, SHUT_RDWR);
+                --fd_left;
+            }
+
+            if (-1 != listen_sock and not active[sockfd] and 0 == inflight[sockfd])
+                sockets.close_fd(sockfd);
+        }
+    }
+
+    if (nullptr != test_done)
+        test_done();
+
+    return 0;
+}
+
+extern "C"
+int run_test_uring(const char * ip,
+                   const int port,
+                   const int th_count,
+                   int msize,
+                   int listen_queue,
+                   void (*ready_for_connect)(),
+                   void (*preparation_done)(),
+                   void (*test_done)())
+{
+    return run_test_uring(false, ip, port, th_count, msize, listen_queue,
+                          ready_for_connect, preparation_done, test_done);
+}
+
+extern "C"
+int run_test_uring_sqpoll(const char * ip,
+                          const int port,
+                          const int th_count,
+                          int msize,
+                          int listen_queue,
+                          void (*ready_for_connect)(),
+                          void (*preparation_done)(),
+                          void (*test_done)())
+{
+    return run_test_uring(true, ip, port, th_count, msize, listen_queue,
+                          ready_for_connect, preparation_done, test_done);
+}
+
+struct MTState {
+    std::atomic_int accepted;
+    // open connections of all threads
+    std::atomic_int live;
+    // threads inside accept, connection may be already out of queue, but not in live yet
+    std::atomic_int accepting;
+    std::atomic_bool failed;
+    // with churn - all connections are closed, set by the first thread, which noticed that
+    std::atomic_bool done;
+    std::vector<int> listeners;
+};
+
+// with churn loader connects replacement before closing old connection, so test is over
+// only when no connection is open, accepted or waiting in queue of any listener.
+// Order of checks matters - replacement, taken from queue after live check, is seen
+// by accepting or accepted counters
+bool mt_all_closed(MTState * state) {
+    int accepted = state->accepted.load();
+    if (0 != state->live.load())
+        return false;
+
+    std::vector<pollfd> pfds;
+    for(int listen_sock: state->listeners)
+        pfds.push_back(pollfd{listen_sock, POLLIN, 0});
+
+    int ready = poll(&pfds[0], pfds.size(), 0);
+    if (0 > ready) {
+        perror("poll(listeners) failed");
+        state->failed.store(true);
+        return false;
+    }
+
+    return 0 == ready and 0 == state->accepting.load() and accepted == state->accepted.load();
+}
+
+int reuseport_listener(const int port, const int listen_queue, const int incoming_cpu) {
+    int listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (-1 == listen_sock) {
+        perror("Could not create socket");
+        return -1;
+    }
+
+    int enable = 1;
+    if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+        perror("setsockopt(SO_REUSEADDR) failed");
+
+    if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(listen_sock);
+        return -1;
+    }
+
+    // reuseport group prefer listener with same cpu, as one handling softirq
+    if (-1 != incoming_cpu and
+            0 > setsockopt(listen_sock, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu)))
+        perror("setsockopt(SO_INCOMING_CPU) failed");
+
+    enable_fastopen(listen_sock);
+
+    sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(port);
+
+    if( 0 > bind(listen_sock, (sockaddr *)&server , sizeof(server))) {
+        perror("bind failed. Error");
+        close(listen_sock);
+        return -1;
+    }
+
+    if (0 > listen(listen_sock, listen_queue)) {
+        perror("listen failed");
+        close(listen_sock);
+        return -1;
+    }
+
+    return listen_sock;
+}
+
+// one of independent event loops of run_test_epoll_mt, accepts
+// connections from own listener till all th_count get accepted by all threads.
+// With churn - till all connections of all threads are closed, listener
+// is kept, as replacements may come to it till the very end
+void epoll_mt_thread(int listen_sock,
+                     const int th_count,
+                     const int msize,
+                     const char * message,
+                     const int cpu,
+                     MTState * state,
+                     ZeroCopyStats * zc)
+{
+    if (-1 != cpu and not pin_current_thread({cpu}))
+        std::cerr << "Failed to pin thread to cpu " << cpu << "\n";
+
+    FDList sockets;
+    EPollRSelector selector(th_count);
+    if (not selector.ok() or not selector.set_busy_poll(echo_busy_poll) or
+            not selector.add_listener(listen_sock)) {
+        state->failed.store(true);
+        return;
+    }
+
+    // indexed by fd, grows on accept
+    std::vector<EchoConn> conns;
+    std::vector<char> buffer(std::min(msize, MAX_RECV_CHUNK));
+    std::vector<int> accepted;
+
+    int fd_left = 0;
+    auto accept_new = [&]() -> bool {
+        state->accepting++;
+        if (not accept_batch(listen_sock, accepted)) {
+            state->accepting--;
+            return false;
+        }
+
+        for(int client_sock: accepted) {
+            sockets.add(client_sock);
+            if ((size_t)client_sock >= conns.size())
+                conns.resize(client_sock + 1, EchoConn{0, false, 0});
+            conns[client_sock] = EchoConn{0, true, 0};
+
+            // edge triggered EPOLLOUT resumes replies, which didn't fit into socket
+            if (not selector.add_fd(client_sock, EPOLLIN | EPOLLOUT | EPOLLET)) {
+                state->accepting--;
+                return false;
+            }
+            ++fd_left;
+            state->live++;
+            state->accepted++;
+        }
+        state->accepting--;
+        return true;
+    };
+
+    for(;;) {
+        if (state->failed.load())
+            return;
+
+        if (state->accepted.load() >= th_count) {
+            if (not echo_churn and 0 == fd_left)
+                break;
+
+            if (echo_churn and (state->done.load() or mt_all_closed(state))) {
+                state->done.store(true);
+                break;
+            }
+        }
+
+        // wake up periodically, as connections may go to other threads
+        if (not selector.wait(100 * 1000 * 1000)) {
+            state->failed.store(true);
+            return;
+        }
+
+        uint32_t events;
+        int sockfd;
+        while(selector.next(sockfd, events)) {
+            if (sockfd == listen_sock) {
+                if (not accept_new()) {
+                    state->failed.store(true);
+                    return;
+                }
+                continue;
+            }
+
+            bool close_sock = false;
+
+            // zerocopy completions are reported as EPOLLERR
+            if (nullptr != zc and (events & EPOLLERR)) {
+                close_sock = (0 > read_zerocopy_completions(sockfd, *zc));
+                events &= ~EPOLLERR;
+            }
+
+            if (close_sock) {
+                // socket error
+            } else if ((events & EPOLLHUP) or (events & EPOLLERR)) {
+                close_sock = true;
+            } else if (events & (EPOLLIN | EPOLLOUT)) {
+                close_sock = not process_stream(sockfd, conns[sockfd], buffer, message, msize, zc);
+            } else if (0 != events) {
+                std::cerr << "Epoll - ??? for fd " << sockfd;
+                std::cerr << " val " << events << "\n";
+                close_sock = true;
+            }
+
+            if (close_sock) {
+                selector.remove_current_ready();
+                --fd_left;
+                if (echo_churn) {
+                    sockets.close_fd(sockfd);
+                    state->live--;
+                }
+            }
+        }
+    }
+
+    if (nullptr != zc)
+        wait_zerocopy_completions(sockets.fds, *zc, BILLION);
+}
+
+extern "C"
+int run_test_epoll_mt(const char * ip,
+                      const int port,
+                      const int th_count,
+                      int msize,
+                      int listen_queue,
+                      void (*ready_for_connect)(),
+                      void (*preparation_done)(),
+                      void (*test_done)(),
+                      int threads,
+                      int incoming_cpu)
+{
+    (void)ip;
+
+    if (threads <= 0)
+        threads = (int)std::thread::hardware_concurrency();
+
+    std::vector<char> message(msize, 'X');
+
+    MTState state;
+    state.accepted = 0;
+    state.live = 0;
+    state.accepting = 0;
+    state.failed = false;
+    state.done = false;
+
+    // threads go to cpus, process is allowed to run on, round robin.
+    // Listener of thread prefers connections, which softirq runs on its cpu
+    std::vector<int> cpus;
+    if (incoming_cpu and not get_current_affinity(cpus))
+        return 1;
+    auto thread_cpu = [&](int idx) {return incoming_cpu ? cpus[idx % cpus.size()] : -1;};
+
+    // all listeners should be in reuseport group before first connect
+    FDList listeners;
+    for(int i = 0; i < threads; ++i) {
+        int listen_sock = reuseport_listener(port, listen_queue, thread_cpu(i));
+        if (-1 == listen_sock)
+            return 1;
+        listeners.fds.push_back(listen_sock);
+    }
+    state.listeners = listeners.fds;
+
+    std::vector<ZeroCopyStats> zc_stats(threads);
+    std::memset(&zc_stats[0], 0, sizeof(zc_stats[0]) * threads);
+    ZeroCopyStats zc_total;
+    std::memset(&zc_total, 0, sizeof(zc_total));
+    ZeroCopyBufferKeeper<std::vector<char>> keep_message(zc_total, message);
+
+    std::vector<std::thread> workers;
+    for(int i = 0; i < threads; ++i)
+        workers.emplace_back(epoll_mt_thread, listeners.fds[i], th_count, msize,
+                             &message[0], thread_cpu(i), &state,
+                             echo_zerocopy ? &zc_stats[i] : nullptr);
+
+    if (nullptr != ready_for_connect)
+        ready_for_connect();
+
+    while(state.accepted.load() < th_count and not state.failed.load())
+        usleep(1000);
+
+    if (not state.failed.load() and nullptr != preparation_done)
+        preparation_done();
+
+    for(auto & th: workers)
+        th.join();
+
+    for(const auto & stats: zc_stats)
+        add_zerocopy_stats(zc_total, stats);
+
+    if (echo_zerocopy)
+        print_zerocopy_stats(zc_total);
+
+    if (state.failed.load())
+        return 1;
+
+    if (nullptr != test_done)
+        test_done();
+
+    return 0;
+}
+
+const int UDP_BATCH = 256;
+const int UDP_GRO_BUFF = 64 * 1024;
+// more than loader waits for fin answer before resend
+const int UDP_FIN_LINGER_US = 300 * 1000;
+
+// all flows share one socket, so a batch of datagrams from different
+// flows is received with one recvmmsg and answered with one sendmmsg.
+// With gro kernel may glue datagrams of one flow, they are echoed back
+// as single UDP_SEGMENT send. Requests are echoed as is, loader matches
+// replies by sequence number in them. Empty datagram is flow fin, it's
+// answered with empty one too, loader resends it till gets the answer
+extern "C"
+int run_test_udp(const char * ip,
+                 const int port,
+                 const int th_count,
+                 int msize,
+                 int listen_queue,
+                 void (*ready_for_connect)(),
+                 void (*preparation_done)(),
+                 void (*test_done)(),
+                 int gro)
+{
+    (void)ip;
+    (void)listen_queue;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (-1 == sock) {
+        perror("Could not create socket");
+        return 1;
+    }
+    FDCloser _sock(sock);
+
+    // all flows may have a message in flight at the same time
+    int rcvbuf = std::max(th_count * (msize + 512) * 2, 4 * 1024 * 1024);
+    if (0 > setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) and
+            0 > setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+        perror("setsockopt(SO_RCVBUF) failed");
+
+    int enable = 1;
+    if (gro and 0 > setsockopt(sock, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable))) {
+        perror("setsockopt(UDP_GRO) failed");
+        gro = 0;
+    }
+
+    // replies go from the address, request came to. Else, on loopback aliases and
+    // multihomed hosts, kernel may pick other source, and connected loader drops them
+    if (0 > setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable)))
+        perror("setsockopt(IP_PKTINFO) failed");
+
+    // wake up periodically to detect flows lost their fin datagram
+    timeval tv{1, 0};
+    if (0 > setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+        perror("setsockopt(SO_RCVTIMEO) failed");
+
+    sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(port);
+
+    if( 0 > bind(sock, (sockaddr *)&server , sizeof(server))) {
+        perror("bind failed. Error");
+        return 1;
+    }
+
+    const int buff_sz = gro ? UDP_GRO_BUFF : msize;
+    std::vector<char> buffers((size_t)UDP_BATCH * buff_sz);
+    std::vector<sockaddr_in> addrs(UDP_BATCH);
+    std::vector<iovec> iovs(UDP_BATCH);
+    std::vector<mmsghdr> msgs(UDP_BATCH);
+    std::vector<mmsghdr> replies(UDP_BATCH);
+    std::vector<iovec> reply_iovs(UDP_BATCH);
+
+    // kernel reports UDP_GRO segment size as int, but takes UDP_SEGMENT as u16
+    const size_t cmsg_sz = CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(in_pktinfo));
+    std::vector<char> cmsgs(UDP_BATCH * cmsg_sz);
+    std::vector<char> reply_cmsgs(UDP_BATCH * cmsg_sz);
+
+    if (nullptr != ready_for_connect)
+        ready_for_connect();
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    // source address - port of flows, which sent fin
+    std::set<unsigned long> finished;
+    int idle_seconds = 0;
+    bool started = false;
+    bool lingering = false;
+
+    for(;;) {
+        // fin answer may be lost, so stay till loader stops to resend fins
+        if (not lingering and (int)finished.size() >= th_count) {
+            timeval linger_tv{0, UDP_FIN_LINGER_US};
+            if (0 > setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &linger_tv, sizeof(linger_tv)))
+                break;
+            lingering = true;
+        }
+
+        for(int i = 0; i < UDP_BATCH; ++i) {
+            iovs[i].iov_base = &buffers[(size_t)i * buff_sz];
+            iovs[i].iov_len = buff_sz;
+            std::memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = &cmsgs[i * cmsg_sz];
+            msgs[i].msg_hdr.msg_controllen = cmsg_sz;
+        }
+
+        int count = recvmmsg(sock, &msgs[0], UDP_BATCH, MSG_WAITFORONE, nullptr);
+        if (0 > count) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno or EINTR == errno) {
+                if (lingering)
+                    break;
+                // loader gone without fin
+                if (started and ++idle_seconds >= 5) {
+                    std::cerr << "UDP: no data for 5s, " << th_count - (int)finished.size() << " flows lost\n";
+                    break;
+                }
+                continue;
+            }
+            perror("recvmmsg failed");
+            return 1;
+        }
+
+        started = true;
+        idle_seconds = 0;
+        int reply_count = 0;
+
+        for(int i = 0; i < count; ++i) {
+            msghdr & hdr = msgs[i].msg_hdr;
+            unsigned len = msgs[i].msg_len;
+
+            if (0 == len)
+                finished.insert((unsigned long)ntohl(addrs[i].sin_addr.s_addr) << 16 | ntohs(addrs[i].sin_port));
+
+            int segment = 0;
+            bool has_pktinfo = false;
+            in_pktinfo pktinfo;
+            for(cmsghdr * cmsg = CMSG_FIRSTHDR(&hdr); nullptr != cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+                if (SOL_UDP == cmsg->cmsg_level and UDP_GRO == cmsg->cmsg_type) {
+                    std::memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                } else if (IPPROTO_IP == cmsg->cmsg_level and IP_PKTINFO == cmsg->cmsg_type) {
+                    std::memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
+                    has_pktinfo = true;
+                }
+
+            if ((hdr.msg_flags & MSG_TRUNC) or
+                    (0 == segment and (unsigned)msize != len and 0 != len) or
+                    (0 != segment and (msize != segment or 0 != len % msize))) {
+                std::cerr << "partial message\n";
+                continue;
+            }
+
+            mmsghdr & reply = replies[reply_count];
+            std::memset(&reply.msg_hdr, 0, sizeof(reply.msg_hdr));
+            reply.msg_hdr.msg_name = &addrs[i];
+            reply.msg_hdr.msg_namelen = hdr.msg_namelen;
+            reply.msg_hdr.msg_iov = &reply_iovs[reply_count];
+            reply.msg_hdr.msg_iovlen = 1;
+
+            char * control = &reply_cmsgs[reply_count * cmsg_sz];
+            size_t control_len = 0;
+            auto add_cmsg = [&](int level, int type, const void * data, size_t data_len) {
+                cmsghdr * cmsg = reinterpret_cast<cmsghdr *>(control + control_len);
+                cmsg->cmsg_level = level;
+                cmsg->cmsg_type = type;
+                cmsg->cmsg_len = CMSG_LEN(data_len);
+                std::memcpy(CMSG_DATA(cmsg), data, data_len);
+                control_len += CMSG_SPACE(data_len);
+            };
+
+            if (has_pktinfo) {
+                in_pktinfo src;
+                std::memset(&src, 0, sizeof(src));
+                src.ipi_spec_dst = pktinfo.ipi_addr;
+                add_cmsg(IPPROTO_IP, IP_PKTINFO, &src, sizeof(src));
+            }
+
+            reply_iovs[reply_count].iov_base = iovs[i].iov_base;
+            reply_iovs[reply_count].iov_len = len;
+
+            // several glued datagrams - send them back with one gso call
+            if (0 != segment and (int)len > segment) {
+                uint16_t gso_size = (uint16_t)segment;
+                add_cmsg(SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+            }
+
+            if (0 != control_len) {
+                reply.msg_hdr.msg_control = control;
+                reply.msg_hdr.msg_controllen = control_len;
+            }
+            ++reply_count;
+        }
+
+        for(int sent = 0; sent < reply_count;) {
+            int res = sendmmsg(sock, &replies[sent], reply_count - sent, 0);
+            if (0 > res) {
+                if (EINTR == errno)
+                    continue;
+                perror("sendmmsg failed");
+                return 1;
+            }
+            sent += res;
+        }
+    }
+
+    if (nullptr != test_done)
+        test_done();
+
+    return 0;
+}
+
 extern "C"
 int run_test_poll(const char * ip,
                   const int port,
@@ -1,33 +1,127 @@
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <algorithm>
 #include <iostream>
 
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <dirent.h>
+#include <sched.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#include <linux/types.h>
+#include <linux/errqueue.h>
 
 #include "common.h"
 
-EPollRSelector::EPollRSelector(int sock_count) {
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// epoll busy poll ioctl, linux 6.9+
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    __u32 busy_poll_usecs;
+    __u16 busy_poll_budget;
+    __u8 prefer_busy_poll;
+    __u8 __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+static int sys_epoll_pwait2(int epfd, epoll_event * events, int maxevents, const timespec * timeout) {
+#ifdef __NR_epoll_pwait2
+    return syscall(__NR_epoll_pwait2, epfd, events, maxevents, timeout, nullptr, 0);
+#else
+    (void)epfd; (void)events; (void)maxevents; (void)timeout;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+PreciseWait detect_precise_wait() {
+    int efd = epoll_create1(0);
+    if (-1 == efd)
+        return PreciseWait::MS;
+
+    epoll_event event;
+    timespec timeout = {0, 0};
+    int res = sys_epoll_pwait2(efd, &event, 1, &timeout);
+    close(efd);
+
+    if (0 <= res)
+        return PreciseWait::PWAIT2;
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == tfd)
+        return PreciseWait::MS;
+
+    close(tfd);
+    return PreciseWait::TIMERFD;
+}
+
+const char * precise_wait_name(PreciseWait mode) {
+    switch(mode) {
+    case PreciseWait::PWAIT2:
+        return "pwait2";
+    case PreciseWait::TIMERFD:
+        return "timerfd";
+    default:
+        return "ms";
+    }
+}
+
+EPollRSelector::EPollRSelector(int sock_count, PreciseWait wait) {
 #ifdef EPOLL_CALL_STATS
     sock_activation_count = 0;
     wait_count = 0;
 #endif
+    busy_poll.spin_ns = 0;
+    busy_poll.busy_poll_us = 0;
     efd = epoll_create1(0);
     if (-1 == efd) {
         perror("epoll_create");
     }
-    events.events.resize(sock_count);
+
+    events.wait = wait;
+    if (-1 != efd and PreciseWait::TIMERFD == wait) {
+        events.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (-1 == events.timer_fd or not add_fd(events.timer_fd, EPOLLIN)) {
+            perror("timerfd_create");
+            close(efd);
+            efd = -1;
+        }
+        // one slot for timer
+        ++sock_count;
+    }
+
+    events.events.resize(std::max(1, std::min(sock_count, MAX_READY_EVENTS)));
     current_ready = end_of_ready = events.events.begin();
 }
 
 EPollRSelector::EPollRSelector(EPollRSelector && rsel) {
     efd = rsel.efd;
     rsel.efd = -1;
+    busy_poll = rsel.busy_poll;
+    events = std::move(rsel.events);
+    rsel.events.timer_fd = -1;
 
     #ifdef EPOLL_CALL_STATS
     sock_activation_count = rsel.sock_activation_count;
@@ -46,9 +140,15 @@ EPollRSelector::~EPollRSelector() {
 #endif
     if (-1 != efd)
         close(efd);
+    if (-1 != events.timer_fd)
+        close(events.timer_fd);
 }
 
 bool EPollRSelector::add_fd(int sockfd, int event_mask) {
+    // results are reported for requested busy poll, so it can't be silently lost for some sockets
+    if (0 != busy_poll.busy_poll_us and not set_socket_busy_poll(sockfd, busy_poll.busy_poll_us))
+        return false;
+
     epoll_event event;
 
     event.data.fd = sockfd;
@@ -57,11 +157,141 @@ bool EPollRSelector::add_fd(int sockfd, int event_mask) {
         perror("epoll_ctl");
         return false;
     }
+
+    return true;
+}
+
+bool EPollRSelector::set_busy_poll(const BusyPollParams & params) {
+    busy_poll = params;
+    if (0 == busy_poll.busy_poll_us)
+        return true;
+
+    epoll_params eparams;
+    std::memset(&eparams, 0, sizeof(eparams));
+    eparams.busy_poll_usecs = busy_poll.busy_poll_us;
+    eparams.busy_poll_budget = 8;
+    eparams.prefer_busy_poll = 1;
+
+    if (-1 == ioctl(efd, EPIOCSPARAMS, &eparams)) {
+        if (ENOTTY != errno and EINVAL != errno) {
+            perror("ioctl(EPIOCSPARAMS)");
+            return false;
+        }
+        // old kernel, only per-socket busy poll would work
+    }
+    return true;
+}
+
+bool set_socket_busy_poll(int sockfd, int busy_poll_us) {
+    if (0 > setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us))) {
+        perror("setsockopt(SO_BUSY_POLL)");
+        return false;
+    }
+
+    int enable = 1;
+    if (0 > setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable))) {
+        perror("setsockopt(SO_PREFER_BUSY_POLL)");
+        return false;
+    }
+    return true;
+}
+
+bool enable_zerocopy(int sockfd) {
+    int enable = 1;
+    if (0 > setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable))) {
+        perror("setsockopt(SO_ZEROCOPY)");
+        return false;
+    }
     return true;
 }
 
+long send_zerocopy(int sockfd, const void * buff, size_t size, ZeroCopyStats & stats) {
+    long res = send(sockfd, buff, size, MSG_ZEROCOPY);
+    if (0 <= res) {
+        stats.sends++;
+        return res;
+    }
+
+    // too many not completed zerocopy sends for socket
+    if (ENOBUFS == errno) {
+        stats.fallbacks++;
+        return send(sockfd, buff, size, 0);
+    }
+    return res;
+}
+
+long read_zerocopy_completions(int sockfd, ZeroCopyStats & stats) {
+    long completed = 0;
+    for(;;) {
+        char control[CMSG_SPACE(sizeof(sock_extended_err))];
+        msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (0 > recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno)
+                break;
+            perror("recvmsg(MSG_ERRQUEUE)");
+            return -1;
+        }
+
+        for(cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); nullptr != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            auto serr = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cmsg));
+            if (SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin) {
+                if (0 != serr->ee_errno) {
+                    errno = serr->ee_errno;
+                    return -1;
+                }
+                continue;
+            }
+
+            // notification covers sends [ee_info, ee_data]
+            unsigned long count = serr->ee_data - serr->ee_info + 1;
+            completed += count;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                stats.copied += count;
+        }
+    }
+
+    // error queue is empty, but there may be pending socket error
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (0 == completed and 0 == getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) and 0 != err) {
+        errno = err;
+        return -1;
+    }
+
+    stats.completed += completed;
+    return completed;
+}
+
+bool wait_zerocopy_completions(const std::vector<int> & fds, ZeroCopyStats & stats, long timeout_ns) {
+    auto end_time = get_fast_time() + timeout_ns;
+    std::vector<bool> failed(fds.size(), false);
+
+    while(stats.completed < stats.sends) {
+        for(size_t i = 0; i < fds.size(); ++i)
+            if (not failed[i] and 0 > read_zerocopy_completions(fds[i], stats))
+                failed[i] = true;
+
+        if (stats.completed >= stats.sends)
+            break;
+
+        if (get_fast_time() >= end_time)
+            return false;
+        usleep(1000);
+    }
+    return true;
+}
+
+void report_zerocopy_leak(const ZeroCopyStats & stats) {
+    std::cerr << (stats.sends - stats.completed) << " zerocopy sends are not completed, ";
+    std::cerr << "their buffer is left allocated\n";
+}
+
 bool EPollRSelector::wait(long int timeout_ns) {
-    if (not epoll_wait_ex(efd, events, timeout_ns))
+    if (not epoll_wait_ex(efd, events, timeout_ns, busy_poll.spin_ns))
         return false;
 
     current_ready = events.events.begin();
@@ -93,19 +323,504 @@ bool EPollRSelector::next(int & sockfd) {
     return true;
 }
 
+bool EPollRSelector::remove_fd(int sockfd) {
+    if (-1 == epoll_ctl(efd, EPOLL_CTL_DEL, sockfd, nullptr)) {
+        perror("epoll_ctl(EPOLL_CTL_DEL)");
+        return false;
+    }
+    return true;
+}
+
 void EPollRSelector::remove_current_ready() {
     epoll_ctl(efd, EPOLL_CTL_DEL, (current_ready - 1)->data.fd, nullptr);
 }
 
+bool EPollRSelector::set_write_interest(bool enable) {
+    epoll_event event;
+    event.data.fd = (current_ready - 1)->data.fd;
+    event.events = enable ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET;
+    if (-1 == epoll_ctl(efd, EPOLL_CTL_MOD, event.data.fd, &event)) {
+        perror("epoll_ctl(EPOLL_CTL_MOD)");
+        return false;
+    }
+    return true;
+}
+
 int EPollRSelector::ready_count() const {
     return end_of_ready - current_ready;
 }
 
+static int io_uring_setup(unsigned entries, io_uring_params * params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                          io_uring_getevents_arg * arg=nullptr)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                        arg, nullptr == arg ? 0 : sizeof(*arg));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+URing::URing(unsigned entries, bool _sqpoll):
+    ring_fd(-1), sqpoll(_sqpoll), sq_tail(0), sq_flushed(0),
+    sqes(static_cast<io_uring_sqe *>(MAP_FAILED)),
+    sq_ptr(MAP_FAILED), sq_ptr_sz(0), cq_ptr(MAP_FAILED), cq_ptr_sz(0), sqes_sz(0),
+    buf_ring(nullptr), buf_ring_sz(0), buf_mask(0), buf_size(0),
+    buf_group(0), legacy_bufs(false)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    // a burst of recv from all sockets may be much larger than sq
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000; // ms
+    }
+
+    int fd = io_uring_setup(entries, &params);
+    if (-1 == fd) {
+        perror("io_uring_setup");
+        return;
+    }
+
+    sq_ptr_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ptr_sz = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+    if (single_mmap)
+        sq_ptr_sz = cq_ptr_sz = std::max(sq_ptr_sz, cq_ptr_sz);
+
+    sq_ptr = mmap(nullptr, sq_ptr_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sq_ptr) {
+        perror("mmap(IORING_OFF_SQ_RING)");
+        close(fd);
+        return;
+    }
+
+    if (single_mmap) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(nullptr, cq_ptr_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cq_ptr) {
+            perror("mmap(IORING_OFF_CQ_RING)");
+            close(fd);
+            return;
+        }
+    }
+
+    sqes_sz = params.sq_entries * sizeof(io_uring_sqe);
+    void * sqes_ptr = mmap(nullptr, sqes_sz, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (MAP_FAILED == sqes_ptr) {
+        perror("mmap(IORING_OFF_SQES)");
+        close(fd);
+        return;
+    }
+    sqes = static_cast<io_uring_sqe *>(sqes_ptr);
+
+    char * sq_base = static_cast<char *>(sq_ptr);
+    sq_khead = reinterpret_cast<unsigned *>(sq_base + params.sq_off.head);
+    sq_ktail = reinterpret_cast<unsigned *>(sq_base + params.sq_off.tail);
+    sq_kflags = reinterpret_cast<unsigned *>(sq_base + params.sq_off.flags);
+    sq_array = reinterpret_cast<unsigned *>(sq_base + params.sq_off.array);
+    sq_mask = *reinterpret_cast<unsigned *>(sq_base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_tail = sq_flushed = *sq_ktail;
+
+    char * cq_base = static_cast<char *>(cq_ptr);
+    cq_khead = reinterpret_cast<unsigned *>(cq_base + params.cq_off.head);
+    cq_ktail = reinterpret_cast<unsigned *>(cq_base + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq_base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq_base + params.cq_off.cqes);
+
+    ring_fd = fd;
+}
+
+URing::~URing() {
+    if (nullptr != buf_ring)
+        munmap(buf_ring, buf_ring_sz);
+    if (MAP_FAILED != static_cast<void *>(sqes))
+        munmap(sqes, sqes_sz);
+    if (MAP_FAILED != cq_ptr and cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_ptr_sz);
+    if (MAP_FAILED != sq_ptr)
+        munmap(sq_ptr, sq_ptr_sz);
+    if (-1 != ring_fd)
+        close(ring_fd);
+}
+
+io_uring_sqe * URing::get_sqe() {
+    while (sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE) >= sq_entries) {
+        if (not submit())
+            return nullptr;
+    }
+
+    unsigned idx = sq_tail & sq_mask;
+    sq_array[idx] = idx;
+    ++sq_tail;
+    return &sqes[idx];
+}
+
+bool URing::submit(unsigned wait_nr, long int timeout_ns) {
+    unsigned to_submit = sq_tail - sq_flushed;
+    unsigned flags = 0;
+
+    if (0 != to_submit) {
+        __atomic_store_n(sq_ktail, sq_tail, __ATOMIC_RELEASE);
+        sq_flushed = sq_tail;
+    }
+
+    if (sqpoll) {
+        // kernel thread picks sqe by itself, syscall only to wake it up
+        if (0 != to_submit and
+                (__atomic_load_n(sq_kflags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP))
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        // sq is full - wait till kernel thread consume something
+        if (sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE) >= sq_entries)
+            flags |= IORING_ENTER_SQ_WAIT;
+        to_submit = 0;
+    }
+
+    if (0 != wait_nr)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    if (0 == to_submit and 0 == flags)
+        return true;
+
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    io_uring_getevents_arg * parg = nullptr;
+
+    if (0 != wait_nr and -1 != timeout_ns) {
+        ts.tv_sec = timeout_ns / BILLION;
+        ts.tv_nsec = timeout_ns % BILLION;
+        std::memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long)&ts;
+        parg = &arg;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    if (0 > io_uring_enter(ring_fd, to_submit, wait_nr, flags, parg)) {
+        if (EINTR == errno or EAGAIN == errno or EBUSY == errno or ETIME == errno)
+            return true;
+        perror("io_uring_enter");
+        return false;
+    }
+    return true;
+}
+
+bool URing::pop_cqe(io_uring_cqe & cqe) {
+    unsigned head = *cq_khead;
+    if (head == __atomic_load_n(cq_ktail, __ATOMIC_ACQUIRE))
+        return false;
+
+    cqe = cqes[head & cq_mask];
+    __atomic_store_n(cq_khead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool URing::next(io_uring_cqe & cqe) {
+    while(pop_cqe(cqe)) {
+        if (URING_INTERNAL_TAG != cqe.user_data)
+            return true;
+
+        // delays report ETIME on expiration
+        if (0 > cqe.res and -ETIME != cqe.res)
+            std::cerr << "io_uring internal request failed: " << std::strerror(-cqe.res) << "\n";
+    }
+    return false;
+}
+
+bool URing::setup_buf_ring(unsigned short bgid, unsigned count, unsigned size) {
+    unsigned entries = 1;
+    while (entries < count and entries < 32768)
+        entries <<= 1;
+
+    buf_mask = entries - 1;
+    buf_size = size;
+    buf_group = bgid;
+    buf_storage.resize((size_t)entries * size);
+
+    buf_ring_sz = entries * sizeof(io_uring_buf);
+    void * ptr = mmap(nullptr, buf_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == ptr) {
+        perror("mmap(buf_ring)");
+        return false;
+    }
+    buf_ring = static_cast<io_uring_buf_ring *>(ptr);
+    buf_ring->tail = 0;
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)buf_ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+
+    legacy_bufs = (0 > io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1));
+    if (not legacy_bufs) {
+        for(unsigned bid = 0; bid < entries; ++bid)
+            recycle_buf((unsigned short)bid);
+
+        if (not probe_buf_ring()) {
+            io_uring_register(ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            legacy_bufs = true;
+        }
+    }
+
+    if (legacy_bufs) {
+        munmap(buf_ring, buf_ring_sz);
+        buf_ring = nullptr;
+
+        io_uring_sqe * sqe = get_sqe();
+        if (nullptr == sqe)
+            return false;
+
+        uring_prep_rw(sqe, IORING_OP_PROVIDE_BUFFERS, (int)entries,
+                      &buf_storage[0], size, URING_INTERNAL_TAG);
+        sqe->buf_group = bgid;
+
+        io_uring_cqe cqe;
+        if (not submit(1) or not pop_cqe(cqe) or 0 > cqe.res) {
+            std::cerr << "io_uring can't provide buffers\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// some kernels accept buffer ring registration, but never
+// select buffers from it - check with one read from pipe
+bool URing::probe_buf_ring() {
+    int pipefd[2];
+    if (0 > pipe(pipefd)) {
+        perror("pipe");
+        return false;
+    }
+
+    bool res = false;
+    io_uring_sqe * sqe = get_sqe();
+    io_uring_cqe cqe;
+
+    if (1 == write(pipefd[1], "X", 1) and nullptr != sqe) {
+        uring_prep_rw(sqe, IORING_OP_READ, pipefd[0], nullptr, 1, URING_INTERNAL_TAG);
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buf_group;
+        sqe->off = (unsigned long long)-1;
+
+        if (submit(1) and pop_cqe(cqe)) {
+            res = (1 == cqe.res);
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+                recycle_buf((unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return res;
+}
+
+void URing::recycle_buf(unsigned short bid) {
+    if (legacy_bufs) {
+        // batched with other sqe on next submit
+        io_uring_sqe * sqe = get_sqe();
+        if (nullptr == sqe)
+            return;
+        uring_prep_rw(sqe, IORING_OP_PROVIDE_BUFFERS, 1, get_buf(bid), buf_size,
+                      URING_INTERNAL_TAG);
+        sqe->off = bid;
+        sqe->buf_group = buf_group;
+        return;
+    }
+
+    // bufs[] flex array is shifted by 8 bytes when compiled as C++
+    // (empty struct has size 1), so index ring entries directly
+    unsigned short tail = buf_ring->tail;
+    io_uring_buf & buf = reinterpret_cast<io_uring_buf *>(buf_ring)[tail & buf_mask];
+    buf.addr = (unsigned long)get_buf(bid);
+    buf.len = buf_size;
+    buf.bid = bid;
+    __atomic_store_n(&buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+LatHistogram::LatHistogram(int _significant_digits, unsigned long max_value):
+    significant_digits(_significant_digits)
+{
+    // smallest power of 2 sub-buckets count, which gives required precision
+    unsigned long largest_single_unit = 2;
+    for(int i = 0; i < significant_digits; ++i)
+        largest_single_unit *= 10;
+
+    int sub_bucket_count_magnitude = 1;
+    while((1UL << sub_bucket_count_magnitude) < largest_single_unit)
+        ++sub_bucket_count_magnitude;
+
+    sub_bucket_half_count_magnitude = sub_bucket_count_magnitude - 1;
+    sub_bucket_half_count = 1UL << sub_bucket_half_count_magnitude;
+    sub_bucket_mask = (1UL << sub_bucket_count_magnitude) - 1;
+
+    size_t bucket_count = 1;
+    for(unsigned long smallest_untrackable = 1UL << sub_bucket_count_magnitude;
+            smallest_untrackable <= max_value and bucket_count < 64 - (size_t)sub_bucket_count_magnitude;
+            smallest_untrackable <<= 1)
+        ++bucket_count;
+
+    counts_len = (bucket_count + 1) * sub_bucket_half_count;
+    counts.reset(new std::atomic<unsigned long>[counts_len]);
+    reset();
+}
+
+void LatHistogram::reset() {
+    for(size_t idx = 0; idx < counts_len; ++idx)
+        counts[idx].store(0, std::memory_order_relaxed);
+}
+
+bool LatHistogram::merge(const LatHistogram & other) {
+    if (other.counts_len != counts_len or other.significant_digits != significant_digits) {
+        std::cerr << "Can't merge histograms with different layout\n";
+        return false;
+    }
+
+    for(size_t idx = 0; idx < counts_len; ++idx) {
+        unsigned long cnt = other.count_at(idx);
+        if (0 != cnt)
+            counts[idx].fetch_add(cnt, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool LatHistogram::subtract(const LatHistogram & other) {
+    if (other.counts_len != counts_len or other.significant_digits != significant_digits) {
+        std::cerr << "Can't subtract histograms with different layout\n";
+        return false;
+    }
+
+    for(size_t idx = 0; idx < counts_len; ++idx) {
+        unsigned long cnt = other.count_at(idx);
+        if (0 != cnt)
+            counts[idx].fetch_sub(cnt, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+unsigned long LatHistogram::lowest_at(size_t idx) const {
+    long bucket_idx = (long)(idx >> sub_bucket_half_count_magnitude) - 1;
+    unsigned long sub_bucket_idx = (idx & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+    if (bucket_idx < 0) {
+        sub_bucket_idx -= sub_bucket_half_count;
+        bucket_idx = 0;
+    }
+    return sub_bucket_idx << bucket_idx;
+}
+
+unsigned long LatHistogram::highest_at(size_t idx) const {
+    long bucket_idx = std::max(0L, (long)(idx >> sub_bucket_half_count_magnitude) - 1);
+    return lowest_at(idx) + (1UL << bucket_idx) - 1;
+}
+
+unsigned long LatHistogram::count() const {
+    unsigned long total = 0;
+    for(size_t idx = 0; idx < counts_len; ++idx)
+        total += count_at(idx);
+    return total;
+}
+
+unsigned long LatHistogram::mean() const {
+    unsigned long total = 0;
+    double sum = 0;
+    for(size_t idx = 0; idx < counts_len; ++idx) {
+        unsigned long cnt = count_at(idx);
+        if (0 != cnt) {
+            total += cnt;
+            sum += (double)cnt * ((lowest_at(idx) + highest_at(idx)) / 2);
+        }
+    }
+    return 0 == total ? 0 : (unsigned long)(sum / total);
+}
+
+unsigned long LatHistogram::value_at_percentile(double percentile) const {
+    unsigned long total = count();
+    if (0 == total)
+        return 0;
+
+    unsigned long target = (unsigned long)(percentile / 100 * total + 0.5);
+    target = std::max(1UL, std::min(target, total));
+
+    unsigned long curr = 0;
+    for(size_t idx = 0; idx < counts_len; ++idx) {
+        curr += count_at(idx);
+        if (curr >= target)
+            return highest_at(idx);
+    }
+    return highest_at(counts_len - 1);
+}
+
+// single epoll wait with ns timeout, -1 - infinite
+static int epoll_wait_ns(int epollfd, EventsList & ready, long int timeout_ns) {
+    epoll_event * events = &(ready.events[0]);
+    int max_events = ready.events.size();
+
+    if (-1 != ready.timer_fd) {
+        // stale timer would wake up next infinite wait
+        if (0 >= timeout_ns and ready.timer_armed) {
+            itimerspec disarm;
+            std::memset(&disarm, 0, sizeof(disarm));
+            timerfd_settime(ready.timer_fd, 0, &disarm, nullptr);
+            ready.timer_armed = false;
+        }
+
+        if (0 < timeout_ns) {
+            itimerspec timer;
+            std::memset(&timer, 0, sizeof(timer));
+            timer.it_value.tv_sec = timeout_ns / BILLION;
+            timer.it_value.tv_nsec = timeout_ns % BILLION;
+            if (-1 == timerfd_settime(ready.timer_fd, 0, &timer, nullptr)) {
+                perror("timerfd_settime");
+                return -1;
+            }
+            ready.timer_armed = true;
+            timeout_ns = -1;
+        }
+
+        int num_ready = epoll_wait(epollfd, events, max_events, 0 == timeout_ns ? 0 : -1);
+
+        // timer is not a socket - remove it from ready list
+        for(int i = 0; i < num_ready; ++i)
+            if (events[i].data.fd == ready.timer_fd) {
+                uint64_t expirations;
+                if (sizeof(expirations) != read(ready.timer_fd, &expirations, sizeof(expirations)))
+                    perror("read(timer_fd)");
+                ready.timer_armed = false;
+                events[i] = events[--num_ready];
+                break;
+            }
+        return num_ready;
+    }
+
+    if (PreciseWait::PWAIT2 == ready.wait and 0 < timeout_ns) {
+        timespec timeout = {timeout_ns / BILLION, timeout_ns % BILLION};
+        return sys_epoll_pwait2(epollfd, events, max_events, &timeout);
+    }
+
+    return epoll_wait(epollfd, events, max_events, 0 >= timeout_ns ? timeout_ns : timeout_ns / 1000000);
+}
+
 // epoll_wait support timeout only with ms granularity
 // while we need at least us presicion
 bool epoll_wait_ex(int epollfd,
                    EventsList & ready,
-                   const long int timeout_ns)
+                   const long int timeout_ns,
+                   const long int spin_ns)
 {
     bool already_polled = false;
 
@@ -113,6 +828,7 @@ bool epoll_wait_ex(int epollfd,
 
     auto curr_time = get_fast_time();
     auto return_time = curr_time + timeout_ns;
+    auto spin_end_time = curr_time + spin_ns;
 
     for(;;) {
         auto time_left = (long int)return_time - (long int)curr_time;
@@ -124,19 +840,25 @@ bool epoll_wait_ex(int epollfd,
                 time_left = 0;
         }
 
-        auto poll_timeout = (timeout_ns == -1 ? -1 : time_left / 1000000);
+        auto poll_timeout = (timeout_ns == -1 ? -1 : time_left);
+
+        // busy loop, till spin budget is exhausted
+        if (curr_time < spin_end_time)
+            poll_timeout = 0;
 
-        ready.num_ready = epoll_wait(epollfd,
-                                     &(ready.events[0]),
-                                     ready.events.size(),
-                                     poll_timeout);
+        ready.num_ready = epoll_wait_ns(epollfd, ready, poll_timeout);
         already_polled = true;
 
         curr_time = get_fast_time();
 
+        if (0 != poll_timeout)
+            ready.wakeups++;
+
         if (ready.num_ready == 0) {
-            if (curr_time >= return_time)
+            if (timeout_ns != -1 and curr_time >= return_time)
                 return true;
+            if (0 != poll_timeout)
+                ready.spurious_wakeups++;
             continue;
         } else if ( 0 > ready.num_ready ) {
             if (errno == EINTR) {
@@ -159,3 +881,451 @@ bool epoll_wait_ex(int epollfd,
         return true;
     }
 }
+
+TimerWheel::TimerWheel(unsigned long now_ns, unsigned long _tick_ns):
+    start_ns(now_ns), tick_ns(_tick_ns), curr_tick(0), count(0)
+{
+    std::memset(used, 0, sizeof(used));
+}
+
+void TimerWheel::insert(int fd, unsigned long tick) {
+    unsigned long top_mask = (1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if ((tick & ~top_mask) != (curr_tick & ~top_mask))
+        tick = curr_tick | top_mask;
+
+    // wheel level is the highest TIMER_WHEEL_BITS group, in which tick differs from current
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 and
+          (tick >> (TIMER_WHEEL_BITS * (level + 1))) != (curr_tick >> (TIMER_WHEEL_BITS * (level + 1))))
+        ++level;
+
+    int slot = (tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    slots[level][slot].push_back(Entry{fd, tick});
+    used[level][slot / 64] |= 1UL << (slot % 64);
+}
+
+void TimerWheel::cascade(int level) {
+    int slot = (curr_tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    std::vector<Entry> entries;
+    entries.swap(slots[level][slot]);
+    used[level][slot / 64] &= ~(1UL << (slot % 64));
+
+    for(auto & entry: entries)
+        insert(entry.fd, entry.tick);
+
+    // keep allocated memory
+    entries.clear();
+    if (slots[level][slot].empty())
+        slots[level][slot].swap(entries);
+}
+
+int TimerWheel::next_used(int level, int from) const {
+    for(int word = from / 64; word < TIMER_WHEEL_SLOTS / 64; ++word) {
+        unsigned long bits = used[level][word];
+        if (word == from / 64)
+            bits &= ~0UL << (from % 64);
+        if (0 != bits)
+            return word * 64 + __builtin_ctzl(bits);
+    }
+    return -1;
+}
+
+unsigned long TimerWheel::next_event_tick() const {
+    // not yet cascaded slots at wheel turn may be earlier, than lower level ones,
+    // so check all levels
+    unsigned long next_tick = ~0UL;
+    for(int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        int shift = TIMER_WHEEL_BITS * level;
+        int curr_slot = (curr_tick >> shift) & (TIMER_WHEEL_SLOTS - 1);
+
+        // higher level slot, which curr_tick is in, is already cascaded,
+        // unless curr_tick is exactly at its start
+        bool cascaded = 0 != level and 0 != (curr_tick & ((1UL << shift) - 1));
+        int slot = next_used(level, cascaded ? curr_slot + 1 : curr_slot);
+        if (-1 != slot) {
+            unsigned long high_mask = ~0UL << (shift + TIMER_WHEEL_BITS);
+            unsigned long tick = (curr_tick & high_mask) | ((unsigned long)slot << shift);
+            next_tick = std::min(next_tick, std::max(tick, curr_tick));
+        }
+    }
+    return next_tick;
+}
+
+void TimerWheel::add(int fd, unsigned long expire_ns) {
+    unsigned long tick = expire_ns > start_ns ? (expire_ns - start_ns) / tick_ns : 0;
+    if (tick < curr_tick)
+        overdue.push_back(fd);
+    else
+        insert(fd, tick);
+    ++count;
+}
+
+void TimerWheel::expire(unsigned long now_ns, std::vector<int> & expired) {
+    if (now_ns < start_ns)
+        return;
+
+    expired.insert(expired.end(), overdue.begin(), overdue.end());
+    count -= overdue.size();
+    overdue.clear();
+
+    unsigned long now_tick = (now_ns - start_ns) / tick_ns;
+    const unsigned long slot_mask = TIMER_WHEEL_SLOTS - 1;
+
+    while(curr_tick <= now_tick and 0 != count) {
+        // at wheel turn move timers from upper slot down, highest level first
+        if (0 == (curr_tick & slot_mask)) {
+            int top = 1;
+            while(top < TIMER_WHEEL_LEVELS - 1 and
+                  0 == (curr_tick & ((1UL << (TIMER_WHEEL_BITS * (top + 1))) - 1)))
+                ++top;
+            for(int level = top; level > 0; --level)
+                cascade(level);
+        }
+
+        // expire lowest level till the end of current turn
+        unsigned long last_tick = curr_tick | slot_mask;
+        if (last_tick > now_tick)
+            last_tick = now_tick;
+
+        int last_slot = last_tick & slot_mask;
+        for(int slot = next_used(0, curr_tick & slot_mask);
+            -1 != slot and slot <= last_slot;
+            slot = next_used(0, slot + 1)) {
+            for(auto & entry: slots[0][slot])
+                expired.push_back(entry.fd);
+            count -= slots[0][slot].size();
+            slots[0][slot].clear();
+            used[0][slot / 64] &= ~(1UL << (slot % 64));
+        }
+
+        curr_tick = last_tick + 1;
+
+        // skip empty ticks
+        unsigned long next_tick = next_event_tick();
+        if (next_tick > now_tick) {
+            // can't skip past now, as new timers are placed relative to curr_tick
+            curr_tick = now_tick + 1;
+            break;
+        }
+        curr_tick = next_tick;
+    }
+
+    if (0 == count and curr_tick <= now_tick)
+        curr_tick = now_tick + 1;
+}
+
+long TimerWheel::next_timeout(unsigned long now_ns) const {
+    if (0 == count)
+        return -1;
+
+    if (not overdue.empty())
+        return 0;
+
+    unsigned long tick = next_event_tick();
+    unsigned long event_ns = start_ns + tick * tick_ns;
+    return event_ns > now_ns ? event_ns - now_ns : 0;
+}
+
+TSCClock tsc_clock = {false, 0, 0, 0.0, 0.0};
+
+const char * fast_time_source() {
+    return tsc_clock.enabled ? "tsc" : "monotonic";
+}
+
+#ifdef USERDTSC
+// TSC keeps constant rate over frequency changes and deep C-states
+static bool tsc_is_invariant() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while(std::getline(cpuinfo, line)) {
+        if (0 != line.compare(0, 5, "flags"))
+            continue;
+        line += " ";
+        return std::string::npos != line.find(" constant_tsc ") and
+               std::string::npos != line.find(" nonstop_tsc ");
+    }
+    return false;
+}
+
+// TSC value in the middle of the narrowest of several tsc - clock_gettime - tsc brackets
+static bool tsc_monotonic_pair(unsigned long & tsc, unsigned long & ns) {
+    tsc = ns = 0;
+    unsigned long best = ~0UL;
+    for(int i = 0; i < 16; ++i) {
+        unsigned long tsc1 = __rdtsc();
+        unsigned long curr_ns = get_monotonic_time();
+        unsigned long tsc2 = __rdtsc();
+        if (0 == curr_ns)
+            return false;
+        if (tsc2 - tsc1 < best) {
+            best = tsc2 - tsc1;
+            tsc = tsc1 + best / 2;
+            ns = curr_ns;
+        }
+    }
+    return true;
+}
+
+static void sleep_ns(long ns) {
+    timespec ts = {ns / BILLION, ns % BILLION};
+    while(-1 == nanosleep(&ts, &ts) and EINTR == errno);
+}
+#endif
+
+bool profile_RDTSC(long calibration_ns) {
+    tsc_clock.enabled = false;
+#ifdef USERDTSC
+    if (not tsc_is_invariant()) {
+        std::cerr << "CPU has no constant_tsc/nonstop_tsc, using CLOCK_MONOTONIC\n";
+        return true;
+    }
+
+    unsigned long tsc1 = 0, ns1 = 0, tsc2 = 0, ns2 = 0, tsc3 = 0, ns3 = 0;
+    if (not tsc_monotonic_pair(tsc1, ns1))
+        return false;
+    sleep_ns(calibration_ns);
+    if (not tsc_monotonic_pair(tsc2, ns2))
+        return false;
+
+    if (tsc2 <= tsc1 or ns2 <= ns1) {
+        std::cerr << "TSC goes backward, using CLOCK_MONOTONIC\n";
+        return true;
+    }
+
+    double ns_per_tick = double(ns2 - ns1) / (tsc2 - tsc1);
+
+    // check calibration on next interval
+    sleep_ns(calibration_ns / 2);
+    if (not tsc_monotonic_pair(tsc3, ns3))
+        return false;
+
+    double predicted_ns = (tsc3 - tsc2) * ns_per_tick;
+    double err_ppm = (predicted_ns - double(ns3 - ns2)) / double(ns3 - ns2) * MICRO;
+
+    std::cout << "TSC freq " << (long)(1000 / ns_per_tick) << " MHz, calibration error ";
+    std::cout << err_ppm << " ppm\n";
+
+    // 0.1% is way above any normal clock drift
+    if (std::fabs(err_ppm) > 1000) {
+        std::cerr << "TSC calibration is unstable, using CLOCK_MONOTONIC\n";
+        return true;
+    }
+
+    tsc_clock.base_tsc = tsc3;
+    tsc_clock.base_ns = ns3;
+    tsc_clock.ns_per_tick = ns_per_tick;
+    tsc_clock.calibration_err_ppm = err_ppm;
+    tsc_clock.enabled = true;
+#else
+    (void)calibration_ns;
+#endif
+    return true;
+}
+
+bool parse_cpu_list(const std::string & spec, std::vector<int> & cpus) {
+    cpus.clear();
+    const char * curr = spec.c_str();
+    while(true) {
+        // each range must be "N" or "N-M", followed by ',' and next range or end of string
+        char * end = nullptr;
+        if (not std::isdigit((unsigned char)*curr)) {
+            std::cerr << "Broken cpu list '" << spec << "'\n";
+            return false;
+        }
+        unsigned long first = std::strtoul(curr, &end, 10);
+        unsigned long last = first;
+        if ('-' == *end) {
+            curr = end + 1;
+            if (not std::isdigit((unsigned char)*curr)) {
+                std::cerr << "Broken cpu list '" << spec << "'\n";
+                return false;
+            }
+            last = std::strtoul(curr, &end, 10);
+        }
+
+        if (',' != *end and '\0' != *end) {
+            std::cerr << "Broken cpu list '" << spec << "'\n";
+            return false;
+        }
+
+        if (last < first or last >= CPU_SETSIZE) {
+            std::cerr << "Broken cpu range " << first << "-" << last << "\n";
+            return false;
+        }
+
+        for(unsigned long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back((int)cpu);
+
+        if ('\0' == *end)
+            break;
+        curr = end + 1;
+    }
+
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return true;
+}
+
+std::string format_cpu_list(const std::vector<int> & cpus) {
+    std::string res;
+    for(size_t i = 0; i < cpus.size();) {
+        size_t last = i;
+        while(last + 1 < cpus.size() and cpus[last + 1] == cpus[last] + 1)
+            ++last;
+
+        if (not res.empty())
+            res += ",";
+        res += std::to_string(cpus[i]);
+        if (last != i)
+            res += "-" + std::to_string(cpus[last]);
+        i = last + 1;
+    }
+    return res;
+}
+
+int cpu_numa_node(int cpu) {
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR * dir = opendir(path.c_str());
+    if (nullptr == dir)
+        return -1;
+
+    int node = -1;
+    while(dirent * entry = readdir(dir))
+        if (1 == std::sscanf(entry->d_name, "node%d", &node))
+            break;
+
+    closedir(dir);
+    return node;
+}
+
+bool get_current_affinity(std::vector<int> & cpus) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (0 != sched_getaffinity(0, sizeof(cpuset), &cpuset)) {
+        perror("sched_getaffinity");
+        return false;
+    }
+
+    cpus.clear();
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &cpuset))
+            cpus.push_back(cpu);
+    return true;
+}
+
+bool pin_current_thread(const std::vector<int> & cpus) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for(int cpu: cpus)
+        CPU_SET(cpu, &cpuset);
+
+    if (0 != sched_setaffinity(0, sizeof(cpuset), &cpuset)) {
+        perror(("sched_setaffinity(" + format_cpu_list(cpus) + ")").c_str());
+        return false;
+    }
+    return true;
+}
+
+// from linux/mempolicy.h, which isn't always installed
+const int MPOL_PREFERRED_MODE = 1;
+const unsigned MPOL_MF_MOVE_PAGES = 1 << 1;
+
+bool bind_memory_to_node(void * addr, size_t size, int node) {
+    const unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long first = ((unsigned long)addr + page - 1) & ~(page - 1);
+    unsigned long last = ((unsigned long)addr + size) & ~(page - 1);
+    if (first >= last)
+        return true;
+
+    const size_t bits = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> nodemask(node / bits + 1, 0);
+    nodemask[node / bits] |= 1UL << (node % bits);
+
+    // kernel reads maxnode - 1 bits
+    if (0 != syscall(__NR_mbind, first, last - first, MPOL_PREFERRED_MODE,
+                     &nodemask[0], nodemask.size() * bits + 1, MPOL_MF_MOVE_PAGES)) {
+        perror("mbind");
+        return false;
+    }
+    return true;
+}
+
+bool raise_nofile_limit(unsigned long need) {
+    rlimit limit;
+    if (0 != getrlimit(RLIMIT_NOFILE, &limit)) {
+        perror("getrlimit(RLIMIT_NOFILE)");
+        return false;
+    }
+
+    if (limit.rlim_cur >= need)
+        return true;
+
+    // fails without privileges or above fs.nr_open, then soft limit goes up to hard one
+    if (limit.rlim_max < need) {
+        rlimit raised = {need, need};
+        if (0 == setrlimit(RLIMIT_NOFILE, &raised))
+            return true;
+    }
+
+    limit.rlim_cur = std::min((rlim_t)need, limit.rlim_max);
+    if (0 != setrlimit(RLIMIT_NOFILE, &limit)) {
+        perror("setrlimit(RLIMIT_NOFILE)");
+        return false;
+    }
+
+    if (limit.rlim_cur < need) {
+        std::cerr << "Open files limit is " << limit.rlim_max << ", " << need << " required. ";
+        std::cerr << "Raise it with 'ulimit -n' or run as root\n";
+        return false;
+    }
+    return true;
+}
+
+unsigned long ephemeral_port_count() {
+    unsigned long low = 0, high = 0;
+    std::ifstream("/proc/sys/net/ipv4/ip_local_port_range") >> low >> high;
+    return high >= low and 0 != high ? high - low + 1 : 0;
+}
+
+// value of 'key: value kB' line of /proc status like file
+static unsigned long read_kb_field(const char * path, const std::string & key) {
+    std::ifstream file(path);
+    std::string name;
+    unsigned long value = 0;
+    while(file >> name) {
+        if (name == key and file >> value)
+            return value * 1024;
+        file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return 0;
+}
+
+bool sample_memory(MemorySample & sample) {
+    std::memset(&sample, 0, sizeof(sample));
+    sample.rss = read_kb_field("/proc/self/status", "VmRSS:");
+    sample.slab = read_kb_field("/proc/meminfo", "Slab:");
+
+    // sockets: used N
+    // TCP: inuse N orphan N tw N alloc N mem PAGES
+    std::ifstream sockstat("/proc/net/sockstat");
+    if (not sockstat) {
+        perror("open /proc/net/sockstat");
+        return false;
+    }
+
+    const unsigned long page = sysconf(_SC_PAGESIZE);
+    std::string line;
+    while(std::getline(sockstat, line)) {
+        std::istringstream fields(line);
+        std::string proto, key;
+        unsigned long value;
+        fields >> proto;
+        while(fields >> key >> value) {
+            if (proto == "sockets:" and key == "used")
+                sample.sockets = value;
+            else if ((proto == "TCP:" or proto == "UDP:") and key == "mem")
+                sample.sock_mem += value * page;
+        }
+    }
+    return 0 != sample.rss;
+}
@@ -1,30 +1,125 @@
 #ifndef COMMON_H__
 #define COMMON_H__
+#include <atomic>
+#include <memory>
+#include <string>
 #include <vector>
+#include <cstring>
 
+#include <time.h>
 #include <sys/epoll.h>
+#include <linux/io_uring.h>
+
+#if defined(USERDTSC) and not (defined(__x86_64__) or defined(__i386__))
+#undef USERDTSC
+#endif
+
+#ifdef USERDTSC
+#include <x86intrin.h>
+#endif
 
 #define MICRO (1000 * 1000)
 #define BILLION (1000 * 1000 * 1000)
 
+// how epoll_wait_ex implements sub-ms timeouts: ms rounded epoll_wait,
+// epoll_pwait2 (linux 5.11+) or timerfd in the same epoll set
+enum class PreciseWait {MS, PWAIT2, TIMERFD};
+
+// best mode, supported by running kernel
+PreciseWait detect_precise_wait();
+const char * precise_wait_name(PreciseWait mode);
+
 struct EventsList {
     std::vector<epoll_event> events;
     int num_ready;
     unsigned long recv_time;
+    PreciseWait wait;
+    // timerfd, registered in epoll set for PreciseWait::TIMERFD, else -1
+    int timer_fd;
+    bool timer_armed;
+    // blocking waits and ones, which returned nothing before timeout expires
+    unsigned long wakeups;
+    unsigned long spurious_wakeups;
+
+    EventsList():num_ready(0), recv_time(0), wait(PreciseWait::MS), timer_fd(-1), timer_armed(false),
+                 wakeups(0), spurious_wakeups(0) {}
 };
 
 class RSelector {
 public:
     virtual bool add_fd(int sockfd) = 0;
+    // level triggered, so listener may be drained in batches
+    virtual bool add_listener(int sockfd) = 0;
     virtual void remove_current_ready() = 0;
     virtual bool wait(long int timeout_ns=-1) = 0;
     virtual bool next(int & sockfd, uint32_t & flags) = 0;
+    // (un)subscribe last socket, returned by next, for writability
+    virtual bool set_write_interest(bool enable) = 0;
+};
+
+// big messages are received in chunks of at most this size
+const int MAX_RECV_CHUNK = 256 * 1024;
+
+// busy poll policy for epoll selectors, 0 disables a part
+struct BusyPollParams {
+    // spin with zero timeout epoll_wait that long, before block in kernel
+    long spin_ns;
+    // SO_BUSY_POLL + SO_PREFER_BUSY_POLL for sockets and
+    // EPIOCSPARAMS for epoll fd, if kernel has it (6.9+)
+    int busy_poll_us;
+};
+
+// returns false if kernel refuses, e.g. without CAP_NET_ADMIN
+bool set_socket_busy_poll(int sockfd, int busy_poll_us);
+
+// MSG_ZEROCOPY sends. Kernel reads data from user pages after send returns,
+// so buffer must stay unchanged till completion comes via socket error queue
+struct ZeroCopyStats {
+    unsigned long sends;
+    unsigned long completed;
+    // completed, but kernel copied data anyway (e.g. loopback)
+    unsigned long copied;
+    // send with plain copy, as kernel refused MSG_ZEROCOPY (optmem limit)
+    unsigned long fallbacks;
+};
+
+bool enable_zerocopy(int sockfd);
+// returns same as send()
+long send_zerocopy(int sockfd, const void * buff, size_t size, ZeroCopyStats & stats);
+// reads all completions, available in error queue. Returns amount of
+// completed sends or -1 on socket error
+long read_zerocopy_completions(int sockfd, ZeroCopyStats & stats);
+// waits till all zerocopy sends are completed, but no longer than timeout_ns.
+// Sockets with errors are skipped
+bool wait_zerocopy_completions(const std::vector<int> & fds, ZeroCopyStats & stats, long timeout_ns);
+void report_zerocopy_leak(const ZeroCopyStats & stats);
+
+// kernel reads zerocopy buffer till completion, even after socket close. If some
+// completions didn't come till scope exit, buffer is moved to heap and never freed.
+// Buffer should keep data in place on move - vector or unique_ptr, not std::string
+template<class Buffer>
+class ZeroCopyBufferKeeper {
+    const ZeroCopyStats & stats;
+    Buffer & buffer;
+public:
+    ZeroCopyBufferKeeper(const ZeroCopyStats & _stats, Buffer & _buffer): stats(_stats), buffer(_buffer) {}
+    ~ZeroCopyBufferKeeper() {
+        if (stats.completed < stats.sends) {
+            report_zerocopy_leak(stats);
+            new Buffer(std::move(buffer));
+        }
+    }
 };
 
+// epoll_wait batch. Ready sockets above it are returned by next wait, so
+// event list doesn't grow with socket count
+const int MAX_READY_EVENTS = 4096;
+
 class EPollRSelector: public RSelector {
 protected:
     int efd;
     EventsList events;
+    BusyPollParams busy_poll;
     std::vector<epoll_event>::iterator current_ready;
     std::vector<epoll_event>::iterator end_of_ready;
 
@@ -38,7 +133,8 @@ private:
   EPollRSelector(const EPollRSelector &);
 
 public:
-    EPollRSelector(int sock_count);
+    // ms waits are exact for ms multiple timeouts, shorter ones need pwait2 or timerfd
+    EPollRSelector(int sock_count, PreciseWait wait=PreciseWait::MS);
     EPollRSelector(EPollRSelector && rsel);
     ~EPollRSelector();
     bool ok() const {return efd != -1;}
@@ -46,21 +142,280 @@ public:
         return add_fd(sockfd, EPOLLIN | EPOLLET);
     }
 
+    bool add_listener(int sockfd) {
+        return add_fd(sockfd, EPOLLIN);
+    }
+
     bool add_fd(int sockfd, int events);
+    bool remove_fd(int sockfd);
+    // should be called before add_fd
+    bool set_busy_poll(const BusyPollParams & params);
     bool wait(long int timeout_ns=-1);
     void remove_current_ready();
+    // for sockets, added with add_fd(sockfd)
+    bool set_write_interest(bool enable);
     int ready_count() const;
+    unsigned long wakeups() const {return events.wakeups;}
+    unsigned long spurious_wakeups() const {return events.spurious_wakeups;}
     bool next(int & sockfd, uint32_t & flags);
     bool next(int & sockfd);
 };
 
+// user_data for URing internal requests, never returned from next()
+const unsigned long long URING_INTERNAL_TAG = ~0ULL;
+
+// engines tag send completions to distinguish them from recv ones
+const unsigned long long URING_SEND_TAG = 1ULL << 63;
+
+// send user_data also keeps send size, so short send can be resubmitted
+inline unsigned long long uring_send_tag(int fd, unsigned size) {
+    return URING_SEND_TAG | ((unsigned long long)(size & 0x7FFFFFFF) << 32) | (unsigned)fd;
+}
+
+inline int uring_tag_fd(unsigned long long user_data) {
+    return (int)(user_data & 0xFFFFFFFF);
+}
+
+inline unsigned uring_send_size(unsigned long long user_data) {
+    return (unsigned)(user_data >> 32) & 0x7FFFFFFF;
+}
+
+// minimal raw-syscall io_uring wrapper, as liburing isn't
+// available everywhere. Single threaded use only.
+class URing {
+protected:
+    int ring_fd;
+    bool sqpoll;
+
+    unsigned * sq_khead;
+    unsigned * sq_ktail;
+    unsigned * sq_kflags;
+    unsigned * sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    unsigned sq_flushed;
+    io_uring_sqe * sqes;
+
+    unsigned * cq_khead;
+    unsigned * cq_ktail;
+    unsigned cq_mask;
+    io_uring_cqe * cqes;
+
+    void * sq_ptr;
+    size_t sq_ptr_sz;
+    void * cq_ptr;
+    size_t cq_ptr_sz;
+    size_t sqes_sz;
+
+    io_uring_buf_ring * buf_ring;
+    size_t buf_ring_sz;
+    unsigned buf_mask;
+    unsigned buf_size;
+    unsigned short buf_group;
+    bool legacy_bufs;
+    std::vector<char> buf_storage;
+
+    bool pop_cqe(io_uring_cqe & cqe);
+    bool probe_buf_ring();
+
+private:
+    URing();
+    URing(const URing &);
+
+public:
+    URing(unsigned entries, bool sqpoll=false);
+    ~URing();
+    bool ok() const {return ring_fd != -1;}
+
+    // returns nullptr only if ring can't be flushed
+    io_uring_sqe * get_sqe();
+
+    // push queued sqe to kernel and wait for at least wait_nr completions,
+    // but no longer than timeout_ns
+    bool submit(unsigned wait_nr=0, long int timeout_ns=-1);
+    bool next(io_uring_cqe & cqe);
+
+    // provided buffers ring, used with IOSQE_BUFFER_SELECT
+    // count is rounded up to power of 2. Falls back to IORING_OP_PROVIDE_BUFFERS
+    // if kernel can't register or doesn't fill buffers from ring
+    bool setup_buf_ring(unsigned short bgid, unsigned count, unsigned size);
+    bool has_buf_ring() const {return not legacy_bufs;}
+    char * get_buf(unsigned short bid) {
+        return &buf_storage[(size_t)bid * buf_size];
+    }
+    void recycle_buf(unsigned short bid);
+};
+
+inline void uring_prep_rw(io_uring_sqe * sqe, int op, int fd,
+                          const void * addr, unsigned len,
+                          unsigned long long user_data)
+{
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char)op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->user_data = user_data;
+}
+
+inline void uring_prep_recv_multishot(io_uring_sqe * sqe, int fd,
+                                      unsigned short bgid,
+                                      unsigned long long user_data)
+{
+    uring_prep_rw(sqe, IORING_OP_RECV, fd, nullptr, 0, user_data);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+}
+
+// timeout, which doesn't break link chain, so linked request
+// would be started after timeout_ns
+inline void uring_prep_delay(io_uring_sqe * sqe, __kernel_timespec * ts,
+                             unsigned long timeout_ns)
+{
+    ts->tv_sec = timeout_ns / BILLION;
+    ts->tv_nsec = timeout_ns % BILLION;
+    uring_prep_rw(sqe, IORING_OP_TIMEOUT, -1, ts, 1, URING_INTERNAL_TAG);
+    sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+    sqe->flags = IOSQE_IO_LINK;
+}
+
+// log-linear latency histogram, same layout as HdrHistogram:
+// power of 2 buckets, each split into linear sub-buckets, so any value
+// is stored with significant_digits decimal digits precision.
+// Only one thread may record, but any thread may merge/read it
+// concurrently, as counters are relaxed atomics.
+class LatHistogram {
+protected:
+    int significant_digits;
+    int sub_bucket_half_count_magnitude;
+    unsigned long sub_bucket_half_count;
+    unsigned long sub_bucket_mask;
+    size_t counts_len;
+    std::unique_ptr<std::atomic<unsigned long>[]> counts;
+
+public:
+    LatHistogram(int significant_digits=3, unsigned long max_value=3600UL * BILLION);
+
+    size_t index_for(unsigned long value) const {
+        int pow2ceiling = 64 - __builtin_clzl(value | sub_bucket_mask);
+        int bucket_idx = pow2ceiling - (sub_bucket_half_count_magnitude + 1);
+        size_t idx = ((size_t)(bucket_idx + 1) << sub_bucket_half_count_magnitude) +
+                     (value >> bucket_idx) - sub_bucket_half_count;
+        return idx < counts_len ? idx : counts_len - 1;
+    }
+
+    // no lock prefix - only owner thread writes
+    void record(unsigned long value) {
+        std::atomic<unsigned long> & cnt = counts[index_for(value)];
+        cnt.store(cnt.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    bool merge(const LatHistogram & other);
+    // takes out counts of earlier snapshot of the same histogram
+    bool subtract(const LatHistogram & other);
+    void reset();
+
+    int digits() const {return significant_digits;}
+    size_t size() const {return counts_len;}
+    unsigned long count_at(size_t idx) const {return counts[idx].load(std::memory_order_relaxed);}
+    // lowest and highest values, which are stored in bucket idx
+    unsigned long lowest_at(size_t idx) const;
+    unsigned long highest_at(size_t idx) const;
+
+    unsigned long count() const;
+    unsigned long mean() const;
+    unsigned long value_at_percentile(double percentile) const;
+};
+
+// hierarchical timer wheel for fd timeouts: TIMER_WHEEL_LEVELS wheels of
+// TIMER_WHEEL_SLOTS slots, with tick_ns resolution (1us by default).
+// Insert and expire are O(1), far timers are cascaded to lower wheels
+// when their slot comes. Timeouts longer than 2^32 ticks are clamped.
+// Single threaded use only.
+const int TIMER_WHEEL_BITS = 8;
+const int TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_BITS;
+const int TIMER_WHEEL_LEVELS = 4;
+
+class TimerWheel {
+protected:
+    struct Entry {
+        int fd;
+        unsigned long tick;
+    };
+
+    unsigned long start_ns;
+    unsigned long tick_ns;
+    // first not processed tick
+    unsigned long curr_tick;
+    size_t count;
+    std::vector<Entry> slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    // timers, added with already processed tick
+    std::vector<int> overdue;
+    // non-empty slots
+    unsigned long used[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS / 64];
+
+    void insert(int fd, unsigned long tick);
+    void cascade(int level);
+    // first tick after curr_tick, at which any slot needs to be processed
+    unsigned long next_event_tick() const;
+    // first used slot >= from at level or -1
+    int next_used(int level, int from) const;
+
+public:
+    TimerWheel(unsigned long now_ns, unsigned long tick_ns=1000);
+
+    void add(int fd, unsigned long expire_ns);
+    // append all fds with expire time <= now_ns to expired
+    void expire(unsigned long now_ns, std::vector<int> & expired);
+    // ns till next expiration (may be earlier, than real one), -1 if empty
+    long next_timeout(unsigned long now_ns) const;
+
+    size_t size() const {return count;}
+    bool empty() const {return 0 == count;}
+};
+
 // epoll_wait support timeout only with ms granularity
-// while we need at least us presicion
+// while we need at least us presicion, so wait mode of ready list is used.
+// If spin_ns != 0, spins with zero timeout epoll_wait up to spin_ns
+// before block in kernel
 bool epoll_wait_ex(int epollfd,
                    EventsList & ready,
-                   long int timeout_ns);
+                   long int timeout_ns,
+                   long int spin_ns=0);
 
-inline unsigned long get_fast_time() {
+// TSC to ns conversion, filled by profile_RDTSC before any worker starts.
+// Until then, or if TSC isn't invariant, CLOCK_MONOTONIC is used
+struct TSCClock {
+    bool enabled;
+    unsigned long base_tsc;
+    unsigned long base_ns;
+    double ns_per_tick;
+    double calibration_err_ppm;
+};
+
+extern TSCClock tsc_clock;
+
+// checks constant_tsc/nonstop_tsc, calibrates TSC against CLOCK_MONOTONIC
+// and switches get_fast_time to it. Fails only if clock_gettime fails
+bool profile_RDTSC(long calibration_ns=200 * 1000 * 1000);
+
+// "tsc" or "monotonic"
+const char * fast_time_source();
+
+inline unsigned long get_monotonic_time() {
+   timespec curr_time;
+   if( -1 == clock_gettime( CLOCK_MONOTONIC, &curr_time)) {
+     perror( "clock gettime" );
+     return 0;
+   }
+
+   return curr_time.tv_nsec + ((unsigned long)curr_time.tv_sec) * BILLION;
+}
+
+// wall clock, comparable between hosts with synchronized clocks
+inline unsigned long get_realtime() {
    timespec curr_time;
    if( -1 == clock_gettime( CLOCK_REALTIME, &curr_time)) {
      perror( "clock gettime" );
@@ -68,10 +423,44 @@ inline unsigned long get_fast_time() {
    }
 
    return curr_time.tv_nsec + ((unsigned long)curr_time.tv_sec) * BILLION;
+}
 
-   // using namespace std::chrono;
-   // auto curr_time = high_resolution_clock::now().time_since_epoch();
-   // return (unsigned long) duration_cast<nanoseconds>(curr_time).count();
+inline unsigned long get_fast_time() {
+#ifdef USERDTSC
+   if (tsc_clock.enabled)
+       return tsc_clock.base_ns + (unsigned long)((__rdtsc() - tsc_clock.base_tsc) * tsc_clock.ns_per_tick);
+#endif
+   return get_monotonic_time();
 }
 
+// cpu list in taskset format: "0-3,8,10-11"
+bool parse_cpu_list(const std::string & spec, std::vector<int> & cpus);
+// "0-3,8" back from sorted cpus
+std::string format_cpu_list(const std::vector<int> & cpus);
+// numa node of cpu from sysfs, -1 if unknown (e.g. kernel without numa)
+int cpu_numa_node(int cpu);
+bool get_current_affinity(std::vector<int> & cpus);
+bool pin_current_thread(const std::vector<int> & cpus);
+// migrates pages of [addr, addr + size) to node and prefers it for future
+// faults (mbind MPOL_PREFERRED). Partial pages at the edges are skipped.
+// Raw syscall, as libnuma isn't available everywhere
+bool bind_memory_to_node(void * addr, size_t size, int node);
+
+// raises RLIMIT_NOFILE soft limit to at least need, and hard one if process
+// may do it (CAP_SYS_RESOURCE). Fails if need is still above the limit
+bool raise_nofile_limit(unsigned long need);
+// size of net.ipv4.ip_local_port_range, 0 if unknown
+unsigned long ephemeral_port_count();
+
+// process and kernel memory, sampled before and after connections are opened.
+// Kernel values are for the whole host (network namespace for sockstat)
+struct MemorySample {
+    unsigned long rss;          // VmRSS of this process, bytes
+    unsigned long sock_mem;     // tcp + udp buffers from /proc/net/sockstat, bytes
+    unsigned long slab;         // kernel slab, socket structures included, bytes
+    unsigned long sockets;      // sockets in use
+};
+
+bool sample_memory(MemorySample & sample);
+
 #endif //COMMON_H__
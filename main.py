@@ -2,11 +2,14 @@ import os
 import sys
 import ctypes
 import socket
+import struct
 import asyncio
 import argparse
+import resource
 import traceback
 import selectors
 import threading
+import time
 
 import gevent
 from gevent import socket as gevent_socket
@@ -18,12 +21,43 @@ import pretty_yaml
 
 class TestParams:
     def __init__(self):
-        self.loader_addr = None
+        # several loaders split connections and start together, see get_run_stats
+        self.loader_addrs = None
         self.count = None
         self.msize = None
         self.runtime = None
         self.timeout = None
         self.local_addr = None
+        self.loader_engine = 'epoll'
+        self.echo_threads = 0
+        self.incoming_cpu = False
+        self.udp_gro = False
+        self.depth = 1
+        self.lat_digits = 3
+        self.rate = 0
+        self.spin_us = 0
+        self.busy_poll_us = 0
+        self.wait = 'auto'
+        self.zerocopy = False
+        self.loader_workers = 3
+        self.loader_cpus = None
+        self.rebalance = False
+        self.mode = 'echo'
+        self.connect_threads = 1
+        self.connect_window = 32
+        self.fastopen = False
+        self.bind_no_port = False
+        self.listen_queue = 0
+        self.churn_msgs = 0
+        self.churn_rate = 0
+        self.control_proto = 'binary'
+        self.interval_ms = 0
+        # echo listens on bind port and next ones, loader connects to all of them
+        self.bind_ports = 1
+        # loader destination addresses, bind ip if empty
+        self.dest_ips = None
+        # share of loader connections, which send messages, the rest stay idle
+        self.active_frac = 1.0
 
 
 def prepare_socket(sock, set_no_block=True):
@@ -39,7 +73,15 @@ def prepare_socket(sock, set_no_block=True):
 ALL_TESTS = {}
 
 
-def get_listen_param(count):
+def get_listen_param(params):
+    if params.listen_queue:
+        return params.listen_queue
+
+    # fastopen connections get stuck, if SYN with data overflows the queue
+    if params.fastopen:
+        return params.count
+
+    count = params.count
     if count < 15:
         return int(count // 5)
     if count < 100:
@@ -49,10 +91,23 @@ def get_listen_param(count):
 
 def im_test(func):
     func.test_name = func.__name__.replace('_test', '')
+    func.proto = getattr(func, 'proto', 'tcp')
+    func.multi_port = getattr(func, 'multi_port', False)
     ALL_TESTS[func.test_name] = func
     return func
 
 
+def udp(func):
+    func.proto = 'udp'
+    return func
+
+
+# engine accepts on several listen ports, see set_listen_ports in client.cpp
+def multi_port(func):
+    func.multi_port = True
+    return func
+
+
 @im_test
 def selector_test(params, ready_to_connect, before_test, after_test):
     message = ('X' * params.msize).encode('ascii')
@@ -61,7 +116,7 @@ def selector_test(params, ready_to_connect, before_test, after_test):
     master_sock = socket.socket()
     master_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     master_sock.bind(params.local_addr)
-    master_sock.listen(get_listen_param(params.count))
+    master_sock.listen(get_listen_param(params))
 
     ready_to_connect()
 
@@ -115,7 +170,7 @@ def asyncio_sock_test(params, ready_to_connect, before_test, after_test,
     master_sock = socket.socket()
     master_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     master_sock.bind(params.local_addr)
-    master_sock.listen(get_listen_param(params.count))
+    master_sock.listen(get_listen_param(params))
 
     socks = []
     ready_to_connect()
@@ -176,7 +231,7 @@ def asyncio_test(params, ready_to_connect, before_test, after_test,
                                 params.local_addr[1],
                                 loop=loop,
                                 reuse_address=True,
-                                backlog=get_listen_param(params.count))
+                                backlog=get_listen_param(params))
     server.append(loop.run_until_complete(coro))
     ready_to_connect()
     loop.run_until_complete(server[0].wait_closed())
@@ -221,7 +276,7 @@ def asyncio_proto_test(params, ready_to_connect, before_test, after_test,
                               params.local_addr[0],
                               params.local_addr[1],
                               reuse_address=True,
-                              backlog=get_listen_param(params.count))
+                              backlog=get_listen_param(params))
 
     server = loop.run_until_complete(coro)
     e_server.append(server)
@@ -266,7 +321,7 @@ def thread_test(params, ready_to_connect, before_test, after_test):
     master_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     master_sock.bind(params.local_addr)
 
-    listen_queue_sz = get_listen_param(params.count)
+    listen_queue_sz = get_listen_param(params)
     master_sock.listen(listen_queue_sz)
 
     threads = []
@@ -313,7 +368,7 @@ def gevent_test(params, ready_to_connect, before_test, after_test):
     master_sock = gevent_socket.socket()
     master_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     master_sock.bind(params.local_addr)
-    master_sock.listen(get_listen_param(params.count))
+    master_sock.listen(get_listen_param(params))
 
     ready_to_connect()
     gl = []
@@ -351,14 +406,19 @@ def go_test(params, ready_to_connect, before_test, after_test):
          params.local_addr[1],
          params.count,
          params.msize,
-         get_listen_param(params.count),
+         get_listen_param(params),
          TIME_CB(ready_to_connect),
          TIME_CB(before_test),
          TIME_CB(after_test))
 
 
-def run_c_test(fname, params, ready_to_connect, before_test, after_test):
+def run_c_test(fname, params, ready_to_connect, before_test, after_test, *extra_int_args):
     so = ctypes.cdll.LoadLibrary("./bin/libclient.so")
+    so.set_busy_poll(params.spin_us, params.busy_poll_us)
+    so.set_zerocopy(int(params.zerocopy))
+    so.set_fastopen(get_listen_param(params) if params.fastopen else 0)
+    so.set_churn(int(bool(params.churn_msgs or params.churn_rate)))
+    so.set_listen_ports(params.bind_ports)
     func = getattr(so, fname)
     func.restype = ctypes.c_int
     func.argtypes = [ctypes.POINTER(ctypes.c_char),  # local ip
@@ -368,43 +428,222 @@ def run_c_test(fname, params, ready_to_connect, before_test, after_test):
                      ctypes.c_int,                   # listen value
                      TIME_CB,
                      TIME_CB,
-                     TIME_CB]
+                     TIME_CB] + [ctypes.c_int] * len(extra_int_args)
 
     func(params.local_addr[0].encode(),
          params.local_addr[1],
          params.count,
          params.msize,
-         get_listen_param(params.count),
+         get_listen_param(params),
          TIME_CB(ready_to_connect),
          TIME_CB(before_test),
-         TIME_CB(after_test))
+         TIME_CB(after_test),
+         *extra_int_args)
 
 
 @im_test
+@multi_port
 def cpp_poll_test(*params):
     return run_c_test("run_test_poll", *params)
 
 
 @im_test
+@multi_port
 def cpp_epoll_test(*params):
     return run_c_test("run_test_epoll", *params)
 
 
 @im_test
+@multi_port
+def cpp_splice_test(*params):
+    return run_c_test("run_test_splice", *params)
+
+
+@im_test
+def cpp_epoll_mt_test(params, *cbs):
+    return run_c_test("run_test_epoll_mt", params, *cbs, params.echo_threads, int(params.incoming_cpu))
+
+
+@im_test
+@udp
+def cpp_udp_test(params, *cbs):
+    return run_c_test("run_test_udp", params, *cbs, int(params.udp_gro))
+
+
+@im_test
+@multi_port
+def cpp_uring_test(*params):
+    return run_c_test("run_test_uring", *params)
+
+
+@im_test
+@multi_port
+def cpp_uring_sqpoll_test(*params):
+    return run_c_test("run_test_uring_sqpoll", *params)
+
+
+@im_test
+@multi_port
 def cpp_th_test(*params):
     return run_c_test("run_test_th", *params)
 
 
+# loader connections are split evenly, first loaders get the remainder
+def split_count(count, parts):
+    return [count // parts + (1 if idx < count % parts else 0) for idx in range(parts)]
+
+
 def get_run_stats(func, params):
     times = []
-    s = socket.socket()
-    s.connect(params.loader_addr)
+    socks = [socket.create_connection(addr) for addr in params.loader_addrs]
+    counts = split_count(params.count, len(socks))
+
+    # several loaders report ready once connected and get common start time,
+    # when the last one is ready. Connect mode has no start to synchronize
+    coordinated = len(socks) > 1 and params.mode != 'connect'
+    start_at = []
+    ready = threading.Barrier(len(socks),
+                              action=lambda: start_at.append(int(time.time() * 1E9) + COORDINATED_START_LEAD_NS))
+
+    # loaders stream interval frames while the test runs, and this thread runs echo side
+    intervals = [[] for _ in socks]
+    intervals_lock = threading.Lock()
+    result_parts = [b""] * len(socks)
+
+    def on_interval(idx, interval):
+        with intervals_lock:
+            intervals[idx].append(interval)
+            pos = len(intervals[idx]) - 1
+            if all(len(loader_intervals) > pos for loader_intervals in intervals):
+                print_interval(merge_intervals([loader_intervals[pos] for loader_intervals in intervals]))
+
+    def on_ready(s):
+        try:
+            ready.wait()
+        except threading.BrokenBarrierError:
+            # other loader failed, this one aborts the test on closed connection
+            s.shutdown(socket.SHUT_RDWR)
+            return
+        s.sendall(encode_frame(FRAME_START, [(START_REALTIME, U64.pack(start_at[0]))]))
+
+    def read_results(idx, s):
+        result = b""
+        while True:
+            data = s.recv(1024 * 64)
+            if not data:
+                break
+            result += data
+
+            while result.startswith(PROTO_MAGIC) and len(result) >= PROTO_HEADER.size:
+                _, _, ftype, size = PROTO_HEADER.unpack_from(result)
+                if ftype not in (FRAME_INTERVAL, FRAME_READY) or len(result) < PROTO_HEADER.size + size:
+                    break
+                frame = result[:PROTO_HEADER.size + size]
+                result = result[PROTO_HEADER.size + size:]
+                if ftype == FRAME_READY:
+                    on_ready(s)
+                else:
+                    on_interval(idx, parse_interval(frame))
+        result_parts[idx] = result
+        # loader, failed before ready, releases the rest
+        ready.abort()
+
+    readers = [threading.Thread(target=read_results, args=(idx, s), daemon=True)
+               for idx, s in enumerate(socks)]
+    for reader in readers:
+        reader.start()
+
+    # echo side memory before connections and with all of them accepted
+    echo_memory = []
 
     def ready_func():
-        s.send((f"{params.local_addr[0]} {params.local_addr[1]} {params.count} " +
-                f"{params.runtime} {params.timeout[0]} {params.timeout[1]} {params.msize}").encode('ascii'))
+        echo_memory.append(sample_memory())
+
+        # options are only send if differ from defaults, to keep old loaders working
+        options = []
+        if params.loader_engine != 'epoll':
+            options.append(f"engine={params.loader_engine}")
+
+        if func.proto != 'tcp':
+            options.append(f"proto={func.proto}")
+
+        if params.depth != 1:
+            options.append(f"depth={params.depth}")
+
+        if params.lat_digits != 3:
+            options.append(f"lat_digits={params.lat_digits}")
+
+        if params.rate:
+            options.append(f"rate={params.rate}")
+
+        if params.spin_us:
+            options.append(f"spin_us={params.spin_us}")
+
+        if params.busy_poll_us:
+            options.append(f"busy_poll_us={params.busy_poll_us}")
+
+        if params.wait != 'auto':
+            options.append(f"wait={params.wait}")
+
+        if params.zerocopy:
+            options.append("zerocopy=1")
+
+        if params.loader_workers != 3:
+            options.append(f"workers={params.loader_workers}")
+
+        if params.loader_cpus:
+            options.append(f"cpus={params.loader_cpus}")
+
+        if params.rebalance:
+            options.append("rebalance=1")
+
+        if params.mode != 'echo':
+            options.append(f"mode={params.mode}")
+
+        if params.connect_threads != 1:
+            options.append(f"connect_threads={params.connect_threads}")
+
+        if params.connect_window != 32:
+            options.append(f"connect_window={params.connect_window}")
+
+        if params.fastopen:
+            options.append("fastopen=1")
+
+        if params.bind_no_port:
+            options.append("bind_no_port=1")
+
+        if params.churn_msgs:
+            options.append(f"churn_msgs={params.churn_msgs}")
+
+        if params.churn_rate:
+            options.append(f"churn_rate={params.churn_rate}")
+
+        if params.interval_ms:
+            options.append(f"interval_ms={params.interval_ms}")
+
+        if params.bind_ports != 1:
+            options.append(f"dest_ports={params.bind_ports}")
+
+        if params.dest_ips:
+            options.append(f"dest_ips={params.dest_ips}")
+
+        if params.active_frac != 1:
+            options.append(f"active_frac={params.active_frac}")
+
+        if coordinated:
+            options.append("sync_start=1")
+
+        for s, count in zip(socks, counts):
+            if params.control_proto == 'text':
+                spec = (f"{params.local_addr[0]} {params.local_addr[1]} {count} " +
+                        f"{params.runtime} {params.timeout[0]} {params.timeout[1]} {params.msize}")
+                s.sendall(" ".join([spec] + options).encode('ascii'))
+            else:
+                s.sendall(encode_spec_frame(params, count, options))
 
     def stamp():
+        if not times:
+            echo_memory.append(sample_memory())
         times.append(os.times())
 
     func(params, ready_func, stamp, stamp)
@@ -413,48 +652,347 @@ def get_run_stats(func, params):
     stime = times[1].system - times[0].system
     ctime = times[1].elapsed - times[0].elapsed
 
-    result = s.recv(1024 * 64)
-    s.close()
+    for reader, s in zip(readers, socks):
+        reader.join()
+        s.close()
+
+    results = []
+    for result in result_parts:
+        if result.startswith(PROTO_MAGIC):
+            results.append(parse_binary_result(result))
+        else:
+            results.append(parse_text_result(result))
+
+    merged_intervals = [merge_intervals(loader_intervals) for loader_intervals in zip(*intervals)]
+    return (utime, stime, ctime) + merge_results(results, params.lat_digits) + \
+        (tuple(echo_memory), merged_intervals)
+
+
+def parse_text_result(result):
+    # see RESULT FORMAT in server.cpp
+    fields = iter(result.split())
+    msg_processed = int(next(fields))
+
+    lat_distribution = {}
+    for _ in range(int(next(fields))):
+        bucket_ns = int(next(fields))
+        lat_distribution[bucket_ns] = int(next(fields))
+
+    percentiles = [int(next(fields)) for _ in range(int(next(fields)))]
+
+    lat_percentiles = {}
+    for _ in range(int(next(fields))):
+        perc = float(next(fields))
+        lat_percentiles[perc] = int(next(fields))
+
+    # older loaders don't report clock
+    clock_source = next(fields, b'realtime').decode('ascii')
+    clock_err_ppm = float(next(fields, 0))
+    loader_cpu_ns = int(next(fields, 0))
+    wait_mode = next(fields, b'ms').decode('ascii')
+    wakeups = int(next(fields, 0))
+    spurious_wakeups = int(next(fields, 0))
+    zc_sends, zc_completed, zc_copied, zc_fallbacks = [int(next(fields, 0)) for _ in range(4)]
+
+    # (cpu, numa node), where each loader worker finished
+    worker_cpus = []
+    for _ in range(int(next(fields, 0))):
+        cpu = int(next(fields))
+        worker_cpus.append((cpu, int(next(fields))))
+
+    # (messages, busy permille, connections, connections in, connections out) per loader worker
+    worker_usage = []
+    for _ in range(int(next(fields, 0))):
+        worker_usage.append(tuple(int(next(fields)) for _ in range(5)))
+
+    connect_stats = parse_connect_stats(fields)
+    churn_stats = parse_connect_stats(fields)
+    # deferred counts are appended after all other fields
+    connect_stats = connect_stats[:3] + (int(next(fields, 0)),) + connect_stats[3:]
+    churn_stats = churn_stats[:3] + (int(next(fields, 0)),) + churn_stats[3:]
+    udp_lost = int(next(fields, 0))
+
+    # per connection message counts, worker start lags, start time and memory are only reported in binary format
+    return msg_processed, lat_distribution, percentiles, lat_percentiles, \
+        (clock_source, clock_err_ppm), loader_cpu_ns, (wait_mode, wakeups, spurious_wakeups), \
+        (zc_sends, zc_completed, zc_copied, zc_fallbacks), worker_cpus, worker_usage, \
+        connect_stats, churn_stats, [], [], [], [], udp_lost
+
+
+# (connects, wall time, fastopen connects, latency histogram, latency percentiles)
+def parse_connect_stats(fields):
+    connects = int(next(fields, 0))
+    wall_ns = int(next(fields, 0))
+    fastopen_connects = int(next(fields, 0))
+
+    lat_distribution = {}
+    for _ in range(int(next(fields, 0))):
+        bucket_ns = int(next(fields))
+        lat_distribution[bucket_ns] = int(next(fields))
+
+    lat_percentiles = {}
+    for _ in range(int(next(fields, 0))):
+        perc = float(next(fields))
+        lat_percentiles[perc] = int(next(fields))
+
+    return connects, wall_ns, fastopen_connects, lat_distribution, lat_percentiles
+
+
+# see BINARY CONTROL PROTOCOL in server.cpp
+PROTO_MAGIC = b'NPTB'
+PROTO_VERSION = 1
+PROTO_HEADER = struct.Struct('<4sHHI')
+RECORD_HEADER = struct.Struct('<HI')
+U64 = struct.Struct('<Q')
+
+FRAME_SPEC = 1
+FRAME_RESULT = 2
+FRAME_INTERVAL = 3
+FRAME_READY = 4
+FRAME_START = 5
+
+SPEC_IP, SPEC_PORT, SPEC_NUM_CONN, SPEC_RUNTIME, SPEC_MIN_TIMEOUT, SPEC_MAX_TIMEOUT, \
+    SPEC_MESSAGE_LEN, SPEC_OPTION = range(1, 9)
+
+RES_MCOUNT, RES_LAT_HIST, RES_MESS_PERC, RES_LAT_PERC, RES_CLOCK_SOURCE, RES_CLOCK_ERR_PPM, \
+    RES_LOADER_CPU_NS, RES_WAIT_MODE, RES_WAKEUPS, RES_ZEROCOPY, RES_WORKER_CPUS, RES_WORKER_USAGE, \
+    RES_CONNECT, RES_CONNECT_HIST, RES_CONNECT_LAT_PERC, RES_CHURN, RES_CHURN_HIST, RES_CHURN_LAT_PERC, \
+    RES_CONN_MCOUNT, RES_WORKER_START_LAG, RES_START_REALTIME, RES_MEMORY, RES_DEFERRED, RES_UDP_LOST = range(1, 25)
+
+IV_START_NS, IV_DURATION_NS, IV_MCOUNT, IV_LAT_HIST, IV_WORKER_MCOUNT = range(1, 6)
+
+START_REALTIME = 1
+
+# from the last loader ready till common start, covers FRAME_START delivery to remote loaders
+COORDINATED_START_LEAD_NS = 100 * 1000 * 1000
+
+
+def encode_frame(frame_type, records):
+    payload = b"".join(RECORD_HEADER.pack(tag, len(value)) + value for tag, value in records)
+    return PROTO_HEADER.pack(PROTO_MAGIC, PROTO_VERSION, frame_type, len(payload)) + payload
+
+
+def encode_spec_frame(params, count, options):
+    records = [(SPEC_IP, params.local_addr[0].encode('ascii')),
+               (SPEC_PORT, U64.pack(params.local_addr[1])),
+               (SPEC_NUM_CONN, U64.pack(count)),
+               (SPEC_RUNTIME, U64.pack(params.runtime)),
+               (SPEC_MIN_TIMEOUT, U64.pack(params.timeout[0])),
+               (SPEC_MAX_TIMEOUT, U64.pack(params.timeout[1])),
+               (SPEC_MESSAGE_LEN, U64.pack(params.msize))]
+    records.extend((SPEC_OPTION, option.encode('ascii')) for option in options)
+    return encode_frame(FRAME_SPEC, records)
+
+
+# {tag: value}, newer loader may add tags, which are ignored
+def decode_frame(data, frame_type):
+    magic, version, ftype, size = PROTO_HEADER.unpack_from(data)
+    if magic != PROTO_MAGIC or ftype != frame_type or len(data) != PROTO_HEADER.size + size:
+        raise ValueError("Broken frame from loader")
+
+    records = {}
+    pos = PROTO_HEADER.size
+    while pos < len(data):
+        tag, value_size = RECORD_HEADER.unpack_from(data, pos)
+        pos += RECORD_HEADER.size
+        records[tag] = data[pos:pos + value_size]
+        pos += value_size
+    return records
 
-    msg_processed, lat_base, *lat_distribution_and_percentiles_s = result.split()
-    lat_distribution_and_percentiles = list(map(int, lat_distribution_and_percentiles_s))
 
-    lats_size = lat_distribution_and_percentiles[0]
-    lat_distribution_raw = lat_distribution_and_percentiles[1: 1 + lats_size * 2]
-    raw_msg_percentiles = lat_distribution_and_percentiles[1 + lats_size * 2:]
+def u64_array(value):
+    return struct.unpack(f'<{len(value) // 8}Q', value)
 
-    lat_distribution = dict(zip(lat_distribution_raw[::2], lat_distribution_raw[1::2]))
-    perc_size = raw_msg_percentiles[0]
-    assert len(raw_msg_percentiles) == perc_size + 1
-    percentiles = raw_msg_percentiles[1:]
 
-    return utime, stime, ctime, int(msg_processed), float(lat_base), lat_distribution, percentiles
+# {bucket_ns: count}, first value is histogram precision
+def parse_hist(value):
+    vals = u64_array(value)
+    return dict(zip(vals[1::2], vals[2::2]))
 
 
-def print_lat_stats(lats, log_base):
+# (start ns, duration ns, messages, latency histogram, messages per worker)
+def parse_interval(data):
+    records = decode_frame(data, FRAME_INTERVAL)
+    start_ns, = U64.unpack(records[IV_START_NS])
+    duration_ns, = U64.unpack(records[IV_DURATION_NS])
+    mcount, = U64.unpack(records[IV_MCOUNT])
+    return start_ns, duration_ns, mcount, parse_hist(records[IV_LAT_HIST]), \
+        list(u64_array(records[IV_WORKER_MCOUNT]))
+
+
+# bucket of histogram, where percentile falls
+def hist_percentile(lat_distribution, perc):
+    total = sum(lat_distribution.values())
+    target = max(1, int(perc / 100 * total + 0.5))
+    curr = 0
+    for bucket_ns, count in sorted(lat_distribution.items()):
+        curr += count
+        if curr >= target:
+            return bucket_ns
+    return 0
+
+
+# upper bound of loader histogram bucket, as LatHistogram::highest_at in common.cpp
+def bucket_highest(bucket_ns, lat_digits):
+    sub_bucket_count_magnitude = (2 * 10 ** lat_digits - 1).bit_length()
+    return bucket_ns + (1 << max(0, bucket_ns.bit_length() - sub_bucket_count_magnitude)) - 1
+
+
+def merge_hists(hists):
+    merged = {}
+    for hist in hists:
+        for bucket_ns, count in hist.items():
+            merged[bucket_ns] = merged.get(bucket_ns, 0) + count
+    return merged
+
+
+# same values, as loader reports for own histogram
+def hist_lat_percentiles(lat_distribution, percentiles, lat_digits):
+    return {perc: bucket_highest(hist_percentile(lat_distribution, perc), lat_digits) for perc in percentiles}
+
+
+# 19 message count percentiles over connections, as in loader run_test
+def mess_percentiles(conn_mcounts):
+    mps = sorted(conn_mcounts)
+    return [mps[len(mps) * (idx + 1) // 20] if mps else 0 for idx in range(19)]
+
+
+def merge_connect_stats(stats, lat_digits):
+    connects, wall_ns, fastopen_connects, deferred_connects, hists, lat_percs = zip(*stats)
+    lat_distribution = merge_hists(hists)
+    # loaders connect in parallel
+    return sum(connects), max(wall_ns), sum(fastopen_connects), sum(deferred_connects), lat_distribution, \
+        hist_lat_percentiles(lat_distribution, lat_percs[0], lat_digits)
+
+
+# one result of several loaders, run side by side. Histograms and per connection
+# counts are merged, so percentiles are the same, as one loader would report
+def merge_results(results, lat_digits):
+    if len(results) == 1:
+        return results[0]
+
+    msg_processed, hists, _, lat_percs, clocks, loader_cpu_ns, waits, zc_stats, worker_cpus, \
+        worker_usage, connect_stats, churn_stats, conn_mcounts, start_lags, start_realtimes, memory, udp_lost = \
+        zip(*results)
+
+    lat_distribution = merge_hists(hists)
+    conn_mcount = [mcount for loader_mcounts in conn_mcounts for mcount in loader_mcounts]
+
+    # worst clock of all loaders
+    clock = max(clocks, key=lambda clock: abs(clock[1]))
+    wait = (waits[0][0],) + tuple(sum(vals) for vals in zip(*(wait[1:] for wait in waits)))
+
+    return sum(msg_processed), lat_distribution, mess_percentiles(conn_mcount), \
+        hist_lat_percentiles(lat_distribution, lat_percs[0], lat_digits), clock, sum(loader_cpu_ns), wait, \
+        tuple(sum(vals) for vals in zip(*zc_stats)), sum(worker_cpus, []), sum(worker_usage, []), \
+        merge_connect_stats(connect_stats, lat_digits), merge_connect_stats(churn_stats, lat_digits), \
+        conn_mcount, sum(start_lags, []), sum(start_realtimes, []), sum(memory, []), sum(udp_lost)
+
+
+# intervals of different loaders with the same index
+def merge_intervals(intervals):
+    start_ns, duration_ns, mcount, hists, worker_mcount = zip(*intervals)
+    return min(start_ns), max(duration_ns), sum(mcount), merge_hists(hists), sum(worker_mcount, [])
+
+
+def interval_mps(interval):
+    _, duration_ns, mcount, _, _ = interval
+    return int(mcount * 1E9 / max(duration_ns, 1))
+
+
+def print_interval(interval):
+    start_ns, _, _, lats, _ = interval
+    lat_50, lat_99 = hist_percentile(lats, 50), hist_percentile(lats, 99)
+    print(f"{start_ns / 1E9:7.1f}s {interval_mps(interval):>9d} mps, " +
+          f"lat_50 {ns_to_readable(lat_50) if lat_50 else '-'}, lat_99 {ns_to_readable(lat_99) if lat_99 else '-'}",
+          file=sys.stderr)
+
+
+def parse_binary_result(data):
+    records = decode_frame(data, FRAME_RESULT)
+
+    def u64s(tag):
+        return u64_array(records.get(tag, b''))
+
+    def rows(tag, fmt):
+        return list(struct.iter_unpack(fmt, records.get(tag, b'')))
+
+    def hist(tag):
+        return parse_hist(records.get(tag, b''))
+
+    deferred = u64s(RES_DEFERRED) or (0, 0)
+
+    def connect_stats(tag, hist_tag, perc_tag, deferred_connects):
+        connects, wall_ns, fastopen_connects = u64s(tag) or (0, 0, 0)
+        return connects, wall_ns, fastopen_connects, deferred_connects, hist(hist_tag), \
+            dict(rows(perc_tag, '<dQ'))
+
+    msg_processed, = u64s(RES_MCOUNT)
+    clock_err_ppm, = struct.unpack('<d', records[RES_CLOCK_ERR_PPM])
+    loader_cpu_ns, = u64s(RES_LOADER_CPU_NS)
+
+    return msg_processed, hist(RES_LAT_HIST), list(u64s(RES_MESS_PERC)), dict(rows(RES_LAT_PERC, '<dQ')), \
+        (records[RES_CLOCK_SOURCE].decode('ascii'), clock_err_ppm), loader_cpu_ns, \
+        (records[RES_WAIT_MODE].decode('ascii'),) + u64s(RES_WAKEUPS), u64s(RES_ZEROCOPY), \
+        rows(RES_WORKER_CPUS, '<qq'), rows(RES_WORKER_USAGE, '<5Q'), \
+        connect_stats(RES_CONNECT, RES_CONNECT_HIST, RES_CONNECT_LAT_PERC, deferred[0]), \
+        connect_stats(RES_CHURN, RES_CHURN_HIST, RES_CHURN_LAT_PERC, deferred[1]), list(u64s(RES_CONN_MCOUNT)), \
+        list(u64s(RES_WORKER_START_LAG)), list(u64s(RES_START_REALTIME)), \
+        [tuple(rows(RES_MEMORY, '<4Q'))] if RES_MEMORY in records else [], (u64s(RES_UDP_LOST) or (0,))[0]
+
+
+def print_lat_stats(lats):
     print("Lats:")
-    for pos, i in enumerate(lats):
-        if i > 100:
-            print(f"    {ns_to_readable(log_base ** pos):<8s}: {i}")
+    for bucket_ns, count in sorted(lats.items()):
+        if count > 100:
+            print(f"    {ns_to_readable(bucket_ns):<8s}: {count}")
+
+
+# (rss, socket buffers, kernel slab, sockets in use), as MemorySample in common.h
+def sample_memory():
+    def kb_field(path, key):
+        with open(path) as fd:
+            for line in fd:
+                if line.startswith(key):
+                    return int(line.split()[1]) * 1024
+        return 0
 
+    sock_mem = sockets = 0
+    with open('/proc/net/sockstat') as fd:
+        for line in fd:
+            proto, *fields = line.split()
+            vals = dict(zip(fields[::2], fields[1::2]))
+            if proto == 'sockets:':
+                sockets = int(vals.get('used', 0))
+            elif proto in ('TCP:', 'UDP:'):
+                sock_mem += int(vals.get('mem', 0)) * resource.getpagesize()
 
-def get_lats(lats, log_base, percs=(0.5, 0.75, 0.95)):
+    return kb_field('/proc/self/status', 'VmRSS:'), sock_mem, kb_field('/proc/meminfo', 'Slab:'), sockets
 
-    all_mess = sum(lats)
-    if 0 == all_mess:
-        return [0] * len(percs)
 
-    curr = 0
-    res = [None] * len(percs)
-    assert list(sorted(percs)) == list(percs)
+# growth of memory sample fields
+def memory_growth(before, after):
+    return tuple(max(0, val_after - val_before) for val_before, val_after in zip(before, after))
 
-    for idx, val in sorted(lats.items()):
-        curr += val
-        for res_idx, perc in enumerate(percs):
-            if curr >= all_mess * perc and res[res_idx] is None:
-                res[res_idx] = log_base ** idx
 
-    return res
+# socket per connection, splice echo needs a pipe pair more
+def raise_nofile_limit(count):
+    need = count * 3 + 1024
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft >= need:
+        return True
+
+    try:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (need, max(need, hard)))
+        return True
+    except (ValueError, OSError):
+        # not privileged to raise hard limit
+        resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    if hard < count + 1024:
+        print(f"Open files limit is {hard}, {count} connections need more. " +
+              "Raise it with 'ulimit -n' or run as root", file=sys.stderr)
+    return False
 
 
 def ns_to_readable(val):
@@ -470,6 +1008,7 @@ def main(argv):
 
     parser = argparse.ArgumentParser()
 
+    # HOST[:PORT][,HOST[:PORT]...] - several loaders, driven together, port defaults to --loader-port
     parser.add_argument('loader_ip')
     parser.add_argument('count', type=int)
     parser.add_argument('tests')
@@ -483,15 +1022,109 @@ def main(argv):
     parser.add_argument('--timeout', '-t', type=int, default=0)
     parser.add_argument('--max-timeout', type=int, default=None)
     parser.add_argument('--min-timeout', type=int, default=None)
+    parser.add_argument('--loader-engine', choices=('epoll', 'uring', 'uring_sqpoll'), default='epoll')
+    parser.add_argument('--echo-threads', type=int, default=0)  # 0 - one per cpu
+    parser.add_argument('--incoming-cpu', action='store_true')
+    parser.add_argument('--udp-gro', action='store_true')
+    parser.add_argument('--depth', '-d', type=int, default=1)  # messages in flight per connection
+    parser.add_argument('--lat-digits', type=int, default=3)  # latency histogram precision
+    parser.add_argument('--rate', type=int, default=0)  # open loop messages per second, 0 - closed loop
+    # busy polling for epoll based loader and echo engines
+    parser.add_argument('--spin-us', type=int, default=0)  # spin in epoll_wait(0) before block
+    parser.add_argument('--busy-poll-us', type=int, default=0)  # SO_BUSY_POLL and epoll busy poll ioctl
+    # loader sub-ms waits: epoll_pwait2, timerfd or ms rounded epoll_wait
+    parser.add_argument('--wait', choices=('auto', 'pwait2', 'timerfd', 'ms'), default='auto')
+    # MSG_ZEROCOPY sends on both sides, for tcp epoll/poll/th engines
+    parser.add_argument('--zerocopy', action='store_true')
+    parser.add_argument('--loader-workers', type=int, default=3)
+    # taskset style list, ':' separates per-worker groups: 0-3 or 0,1:2,3
+    parser.add_argument('--loader-cpus', default=None)
+    # idle loader workers steal connections from busy ones
+    parser.add_argument('--rebalance', action='store_true')
+    # connect - only open connections and report connect rate and latency
+    parser.add_argument('--mode', choices=('echo', 'connect'), default='echo')
+    parser.add_argument('--connect-threads', type=int, default=1)
+    parser.add_argument('--connect-window', type=int, default=32)  # connects in flight per thread
+    # TCP_FASTOPEN on echo listeners and TCP_FASTOPEN_CONNECT on loader sockets
+    parser.add_argument('--fastopen', action='store_true')
+    # IP_BIND_ADDRESS_NO_PORT for loader sockets, bound to client ip's
+    parser.add_argument('--bind-no-port', action='store_true')
+    # echo side listen backlog, 0 - derive from count. Overflow drops SYN for 1s
+    parser.add_argument('--listen-queue', type=int, default=0)
+    # loader reconnects each connection after N messages and/or at given rate, cpp tcp engines only
+    parser.add_argument('--churn-msgs', type=int, default=0)
+    parser.add_argument('--churn-rate', type=int, default=0)  # reconnects per second
+    # text - for loaders without binary control protocol
+    parser.add_argument('--control-proto', choices=('binary', 'text'), default='binary')
+    # loader streams throughput and latency for each interval, binary protocol only
+    parser.add_argument('--interval-ms', type=int, default=0)
+    # echo listens on N ports from --bind-port, loader spreads connections over them
+    parser.add_argument('--bind-ports', type=int, default=1)
+    # loader destination addresses, e.g. loopback aliases 127.0.0.1,127.0.0.2. Default - --bind-ip
+    parser.add_argument('--dest-ips', default=None)
+    # share of connections, sending messages. Rest are idle, to measure memory per connection at scale
+    parser.add_argument('--active-frac', type=float, default=1.0)
 
     opts = parser.parse_args(argv[1:])
 
     params = TestParams()
-    params.loader_addr = (opts.loader_ip, opts.loader_port)
+    params.loader_addrs = []
+    for addr in opts.loader_ip.split(','):
+        host, _, port = addr.partition(':')
+        params.loader_addrs.append((host, int(port) if port else opts.loader_port))
     params.local_addr = (opts.bind_ip, opts.bind_port)
     params.msize = opts.msize
     params.count = opts.count
     params.runtime = opts.runtime
+    params.loader_engine = opts.loader_engine
+    params.echo_threads = opts.echo_threads
+    params.incoming_cpu = opts.incoming_cpu
+    params.udp_gro = opts.udp_gro
+    params.depth = opts.depth
+    params.lat_digits = opts.lat_digits
+    params.rate = opts.rate
+    params.spin_us = opts.spin_us
+    params.busy_poll_us = opts.busy_poll_us
+    params.wait = opts.wait
+    params.zerocopy = opts.zerocopy
+    params.loader_workers = opts.loader_workers
+    params.loader_cpus = opts.loader_cpus
+    params.rebalance = opts.rebalance
+    params.mode = opts.mode
+    params.connect_threads = opts.connect_threads
+    params.connect_window = opts.connect_window
+    params.fastopen = opts.fastopen
+    params.bind_no_port = opts.bind_no_port
+    params.listen_queue = opts.listen_queue
+    params.churn_msgs = opts.churn_msgs
+    params.churn_rate = opts.churn_rate
+    params.control_proto = opts.control_proto
+    params.interval_ms = opts.interval_ms
+    params.bind_ports = opts.bind_ports
+    params.dest_ips = opts.dest_ips
+    params.active_frac = opts.active_frac
+
+    if opts.interval_ms and opts.control_proto != 'binary':
+        print("--interval-ms requires binary control protocol")
+        return 1
+
+    if len(params.loader_addrs) > 1:
+        if opts.control_proto != 'binary':
+            print("Several loaders require binary control protocol")
+            return 1
+        if opts.count < len(params.loader_addrs):
+            print("Each loader needs at least one connection")
+            return 1
+
+    # loader sends at most one request per ns
+    if not 0 <= opts.rate <= 10 ** 9:
+        print("--rate should be in [0, 1000000000]")
+        return 1
+
+    # deferred fastopen connect completes with the first request, open loop doesn't prime connections
+    if opts.fastopen and (opts.rate or opts.mode == 'connect'):
+        print("--fastopen can't be used with --rate or connect mode")
+        return 1
 
     if opts.timeout and (opts.max_timeout or opts.min_timeout):
         print("--runtime option is conflict with --max-timeout/--min-timeout")
@@ -526,13 +1159,76 @@ def main(argv):
 
     run_tests.sort(key=lambda x: x.__name__)
 
+    if opts.bind_ports < 1 or opts.bind_port + opts.bind_ports > 65536:
+        print("--bind-ports is out of range")
+        return 1
+
+    if opts.bind_ports > 1:
+        if opts.churn_msgs or opts.churn_rate:
+            print("Churn accepts on single listen port, --bind-ports can't be used")
+            return 1
+
+        for func in run_tests:
+            if not func.multi_port:
+                print(f"Test {func.test_name!r} listens on single port, --bind-ports can't be used")
+                return 1
+
+    if not 0 < opts.active_frac <= 1:
+        print("--active-frac should be in (0, 1]")
+        return 1
+
+    if opts.dest_ips:
+        for func in run_tests:
+            if func.proto != 'tcp':
+                print(f"Test {func.test_name!r} is udp, loader can't use --dest-ips")
+                return 1
+
+    # udp request starts with 8 bytes sequence number
+    if opts.msize < 8:
+        for func in run_tests:
+            if func.proto == 'udp':
+                print(f"Test {func.test_name!r} is udp, --msize should be at least 8")
+                return 1
+
+    raise_nofile_limit(opts.count)
+
+    if opts.churn_msgs or opts.churn_rate:
+        for func in run_tests:
+            if not func.test_name.startswith('cpp') or func.proto != 'tcp':
+                print(f"Test {func.test_name!r} doesn't accept connections during the test, can't churn")
+                return 1
+
     results_struct = dict(
         workers=opts.count,
-        server=f"{opts.loader_ip}:{opts.loader_port}",
+        server=",".join(f"{host}:{port}" for host, port in params.loader_addrs),
         bind_addr=f"{opts.bind_ip}:{opts.bind_port}",
         msize=opts.msize,
         runtime=opts.runtime,
         timeout=opts.timeout,
+        loader_engine=opts.loader_engine,
+        echo_threads=opts.echo_threads,
+        depth=opts.depth,
+        rate=opts.rate,
+        spin_us=opts.spin_us,
+        busy_poll_us=opts.busy_poll_us,
+        wait=opts.wait,
+        zerocopy=opts.zerocopy,
+        loader_workers=opts.loader_workers,
+        loader_cpus=opts.loader_cpus,
+        rebalance=opts.rebalance,
+        mode=opts.mode,
+        connect_threads=opts.connect_threads,
+        connect_window=opts.connect_window,
+        fastopen=opts.fastopen,
+        bind_no_port=opts.bind_no_port,
+        listen_queue=opts.listen_queue,
+        churn_msgs=opts.churn_msgs,
+        churn_rate=opts.churn_rate,
+        control_proto=opts.control_proto,
+        interval_ms=opts.interval_ms,
+        bind_ports=opts.bind_ports,
+        dest_ips=opts.dest_ips,
+        active_frac=opts.active_frac,
         data=[],
     )
 
@@ -553,23 +1249,108 @@ def main(argv):
     for func in run_tests:
         for i in range(opts.rounds):
             try:
-                utime, stime, ctime, msg_processed, lat_base, \
-                    lat_distribution, msg_percentiles = get_run_stats(func, params)
+                utime, stime, ctime, msg_processed, lat_distribution, \
+                    msg_percentiles, lat_percentiles, (clock, clock_err_ppm), loader_cpu_ns, \
+                    (wait_mode, wakeups, spurious_wakeups), zc_stats, worker_cpus, \
+                    worker_usage, connect_stats, churn_stats, conn_mcounts, start_lags, \
+                    start_realtimes, loader_memory, udp_lost, echo_memory, intervals = get_run_stats(func, params)
 
                 assert len(msg_percentiles) == 19
 
-                lat_50, lat_75, lat_95 = get_lats(lat_distribution, lat_base)
-
                 curr_res = dict(
                     func=func.__name__.replace("_test", ''),
+                    proto=func.proto,
                     utime=f"{utime:.2f}",
                     stime=f"{stime:.2f}",
                     ctime=f"{ctime:.2f}",
-                    lat_50=ns_to_readable(lat_50),
-                    lat_95=ns_to_readable(lat_95),
+                    lat_50=ns_to_readable(lat_percentiles[50]),
+                    lat_95=ns_to_readable(lat_percentiles[95]),
+                    lat_99=ns_to_readable(lat_percentiles[99]),
+                    lat_999=ns_to_readable(lat_percentiles[99.9]),
+                    lat_9999=ns_to_readable(lat_percentiles[99.99]),
+                    lat_max=ns_to_readable(lat_percentiles[100]),
                     msg_5perc=msg_percentiles[0],
                     msg_95perc=msg_percentiles[-1],
-                    messages=msg_processed)
+                    messages=msg_processed,
+                    echo_cpu_per_msg=ns_to_readable((utime + stime) * 1E9 / max(msg_processed, 1)),
+                    loader_cpu_per_msg=ns_to_readable(loader_cpu_ns / max(msg_processed, 1)),
+                    wait_mode=wait_mode,
+                    wakeups=wakeups,
+                    spurious_wakeups=spurious_wakeups,
+                    clock=clock,
+                    clock_err_ppm=f"{clock_err_ppm:.1f}",
+                    loader_cpus=" ".join(f"{cpu}@{node}" for cpu, node in worker_cpus),
+                    loader_busy=" ".join(f"{busy / 10:.0f}%" for _, busy, _, _, _ in worker_usage),
+                    loader_msgs=" ".join(str(mcount) for mcount, _, _, _, _ in worker_usage),
+                    loader_conns=" ".join(f"{conns}(+{cin}-{cout})"
+                                          for _, _, conns, cin, cout in worker_usage))
+
+                # deferred (fastopen) connects have no handshake yet and aren't in connect_lat_*
+                connects, connect_wall_ns, fastopen_connects, deferred_connects, _, connect_lats = connect_stats
+                if connects:
+                    curr_res.update(connects=connects,
+                                    connects_per_sec=int(connects * 1E9 / max(connect_wall_ns, 1)),
+                                    connect_lat_50=ns_to_readable(connect_lats[50]),
+                                    connect_lat_99=ns_to_readable(connect_lats[99]),
+                                    connect_lat_999=ns_to_readable(connect_lats[99.9]),
+                                    connect_lat_max=ns_to_readable(connect_lats[100]))
+                if opts.fastopen:
+                    curr_res.update(deferred_connects=deferred_connects, fastopen_connects=fastopen_connects)
+
+                reconnects, churn_run_ns, fastopen_reconnects, deferred_reconnects, _, reconnect_lats = churn_stats
+                if reconnects and opts.fastopen:
+                    curr_res.update(deferred_reconnects=deferred_reconnects,
+                                    fastopen_reconnects=fastopen_reconnects)
+                if reconnects:
+                    curr_res.update(reconnects=reconnects,
+                                    accepts_per_sec=int(reconnects * 1E9 / max(churn_run_ns, 1)),
+                                    reconnect_lat_50=ns_to_readable(reconnect_lats[50]),
+                                    reconnect_lat_99=ns_to_readable(reconnect_lats[99]),
+                                    reconnect_lat_max=ns_to_readable(reconnect_lats[100]))
+
+                # requests without reply in loader timeout, they were resent
+                if func.proto == 'udp':
+                    curr_res.update(udp_lost=udp_lost)
+
+                # time between common start and start of the latest loader worker
+                if start_lags:
+                    curr_res.update(loader_start_lag=ns_to_readable(max(start_lags)) if max(start_lags) else '0')
+
+                # difference of common start times of several loaders
+                if len(start_realtimes) > 1 and min(start_realtimes):
+                    skew = max(start_realtimes) - min(start_realtimes)
+                    curr_res.update(loaders=len(start_realtimes),
+                                    loader_start_skew=ns_to_readable(skew) if skew else '0')
+
+                # memory growth from connect till test end. Kernel memory is for whole
+                # host, so with local echo side it's the cost of both ends
+                if loader_memory:
+                    loader_growth = [memory_growth(before, after) for before, after in loader_memory]
+                    loader_rss = sum(rss for rss, _, _, _ in loader_growth)
+                    kernel_mem = max(sock_mem + slab for _, sock_mem, slab, _ in loader_growth)
+                    curr_res.update(mem_loader_rss=loader_rss,
+                                    mem_loader_per_conn=loader_rss // opts.count,
+                                    mem_kernel=kernel_mem,
+                                    mem_kernel_per_conn=kernel_mem // opts.count)
+
+                if len(echo_memory) == 2:
+                    echo_rss = memory_growth(*echo_memory)[0]
+                    curr_res.update(mem_echo_rss=echo_rss,
+                                    mem_echo_per_conn=echo_rss // opts.count)
+
+                if intervals:
+                    interval_lats = [hist_percentile(lats, 99) for _, _, _, lats, _ in intervals]
+                    curr_res.update(interval_mps=" ".join(str(interval_mps(iv)) for iv in intervals),
+                                    interval_lat_99=" ".join(ns_to_readable(lat) if lat else '-'
+                                                             for lat in interval_lats))
+
+                if opts.zerocopy:
+                    zc_sends, zc_completed, zc_copied, zc_fallbacks = zc_stats
+                    curr_res.update(zc_sends=zc_sends,
+                                    zc_completed=zc_completed,
+                                    zc_copied=zc_copied,
+                                    zc_fallbacks=zc_fallbacks)
+
                 results_struct['data'].append(curr_res)
             except Exception as exc:
                 traceback.print_exc()
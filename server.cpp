@@ -1,41 +1,112 @@
 #include <map>
-#include <queue>
+#include <array>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <vector>
 #include <thread>
 #include <random>
 #include <cstring>
-#include <sstream>
+#include <functional>
+#include <climits>
+#include <cstdlib>
 #include <iomanip>
+#include <sstream>
 #include <iostream>
 #include <algorithm>
 #include <unordered_map>
 
-#ifndef LOG2_LAT
-#include <cmath>
-#endif
-
 #include <poll.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "common.h"
 
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
 const int DEFAULT_PORT = 33331;
 const int MAX_CLIENT_MESSAGE = 1024;
+const int MAX_PIPELINE_DEPTH = IOV_MAX;
+const int DEFAULT_WORKERS = 3;
+const int MAX_WORKERS = 1024;
+// open files limit above connection count
+const unsigned long RESERVED_FDS = 1024;
+const size_t CACHE_LINE = 64;
+
+enum class WorkerEngine {
+    EPOLL,
+    URING,
+    URING_SQPOLL
+};
+
+// how connect_all opens connections
+struct ConnectParams {
+    int threads;
+    // connects in flight per thread
+    int window;
+    bool fastopen;
+    // delay source port selection till connect, so ports are shared between
+    // destinations when binding to client ip's
+    bool bind_no_port;
+    // no connect completed for that time. Should be above 1s SYN retransmit
+    // timeout, as SYN is dropped if echo side listen queue is full
+    int timeout_ms;
+};
 
 struct TestParams {
     int port, num_conn, runtime, message_len;
     unsigned long int min_timeout, max_timeout;
+    WorkerEngine engine;
+    bool udp;
+    int depth;
+    int lat_digits;
+    unsigned long rate;
+    BusyPollParams busy_poll;
+    // wait=auto|pwait2|timerfd|ms as requested, resolved into wait by check_params
+    std::string wait_mode;
+    PreciseWait wait;
+    bool zerocopy;
+    int workers;
+    // idle workers steal connections from busy ones
+    bool rebalance;
+    // affinity groups, worker i runs on cpus[i % cpus.size()]. Empty - not pinned
+    std::vector<std::vector<int>> cpus;
+    // only open connections and report connect rate/latency, no messages
+    bool connect_only;
+    ConnectParams connect;
+    // reconnect every connection after that many messages, 0 - never
+    unsigned long churn_msgs;
+    // reconnects per second for whole loader, 0 - no rate
+    unsigned long churn_rate;
+    // interval stats period, streamed during the test. 0 - only totals
+    int interval_ms;
+    // coordinated start: report FRAME_READY once connected, then start at time from FRAME_START
+    bool sync_start;
+    // connections go to each of dest_ips (ip if empty) on ports [port, port + dest_ports)
+    std::vector<std::string> dest_ips;
+    int dest_ports;
+    // share of connections, which send messages. The rest are only held open
+    double active_frac;
     char ip[MAX_CLIENT_MESSAGE + 1];
 };
 
@@ -56,6 +127,43 @@ public:
     }
 };
 
+// restores affinity of calling thread on scope exit
+class AffinityGuard {
+protected:
+    std::vector<int> saved;
+public:
+    AffinityGuard() {
+        if (not get_current_affinity(saved))
+            saved.clear();
+    }
+    ~AffinityGuard() {
+        if (not saved.empty())
+            pin_current_thread(saved);
+    }
+};
+
+// runs worker on given cpus, so memory it allocates is node-local on first touch.
+// Cpu, where worker finished, is stored to last_cpu
+template<typename Func>
+struct Pinned {
+    Func func;
+    std::vector<int> cpus;
+    int * last_cpu;
+
+    template<typename... Args>
+    void operator()(Args... args) const {
+        if (not cpus.empty() and not pin_current_thread(cpus))
+            std::cerr << "Worker would run unpinned\n";
+        func(args...);
+        *last_cpu = sched_getcpu();
+    }
+};
+
+template<typename Func>
+Pinned<Func> pinned(Func func, const std::vector<int> & cpus, int * last_cpu) {
+    return Pinned<Func>{func, cpus, last_cpu};
+}
+
 std::vector<epoll_event>::iterator begin(EventsList & elist) {
     return elist.events.begin();
 }
@@ -64,305 +172,2603 @@ std::vector<epoll_event>::iterator end(EventsList & elist) {
     return elist.events.begin() + elist.num_ready;
 }
 
-#ifdef LOG2_LAT
-const int LAT_ARR_SIZE = 30;
-#else
-const int LAT_ARR_SIZE = 300;
-#endif
+// latency percentiles, reported by loader
+const std::array<double, 6> LAT_PERCENTILES = {{50, 95, 99, 99.9, 99.99, 100}};
+
+// per worker counters, reported to show imbalance
+struct WorkerUsage {
+    unsigned long mcount;
+    unsigned long run_ns;
+    unsigned long busy_ns;      // time out of epoll_wait/io_uring_enter
+    unsigned long conns;        // connections, owned at exit
+    unsigned long conns_in;     // received from other workers by rebalancing
+    unsigned long conns_out;
+    unsigned long start_lag_ns; // own start after common start time
+};
+
+struct ConnectStats {
+    unsigned long connects;
+    // connect returned at once, SYN goes with the first request. Handshake
+    // isn't done yet, so these connects aren't in lat_hist
+    unsigned long deferred_connects;
+    // deferred connects, which SYN data was accepted by echo side (cookie was cached)
+    unsigned long fastopen_connects;
+    // time to open all connections
+    unsigned long wall_ns;
+    LatHistogram lat_hist;
+};
 
-struct TestResult{
+// one block per worker, aligned so hot counters of neighbours never share a line
+struct alignas(CACHE_LINE) TestResult{
     unsigned long mcount;
     unsigned long avg_lat_ns;
     std::array<unsigned long, 19> percentiles;
-    std::unordered_map<unsigned long, unsigned long> lat_map;
-    std::unordered_map<int, unsigned long> mess_count_for_sock;
+    std::array<unsigned long, LAT_PERCENTILES.size()> lat_percentiles;
+    LatHistogram lat_hist;
+    // user + system time, used by loader process during the test
+    unsigned long cpu_ns;
+    PreciseWait wait;
+    unsigned long wakeups;
+    unsigned long spurious_wakeups;
+    ZeroCopyStats zc;
+    // cpu, where each worker finished, -1 if unknown
+    std::vector<int> worker_cpus;
+    // own counters for worker result, all workers for merged one
+    WorkerUsage usage;
+    std::vector<WorkerUsage> worker_usage;
+    ConnectStats connect;
+    // reconnects during the test, wall_ns is the test run time
+    ConnectStats churn;
+    // messages per active connection, in connection order
+    std::vector<unsigned long> conn_mcount;
+    // CLOCK_REALTIME of the common start, lets coordinator check loaders skew
+    unsigned long start_realtime_ns;
+    // before connect and at the test end, with all connections open
+    MemorySample mem_before;
+    MemorySample mem_open;
+    // udp requests without reply in UDP_REPLY_TIMEOUT_NS, they are resent
+    unsigned long udp_lost;
 };
 
-class DecOnExit {
+// per connection state flags
+const unsigned short CONN_ACTIVE = 1;
+// connection waits for think time to expire
+const unsigned short CONN_WAITING = 2;
+// connection was replaced by deferred fastopen connect, handshake completes with next request
+const unsigned short CONN_DEFERRED = 4;
+
+// 32 bytes - two connections per cache line
+struct ConnState {
+    unsigned long last_send_ns; // 0 if nothing was send yet
+    unsigned long mcount;
+    int partial_bytes;          // received bytes of not completed tcp reply
+    unsigned int unsent_bytes;  // request bytes, not accepted by socket yet, send on EPOLLOUT
+    unsigned short in_flight;   // saturates at USHRT_MAX
+    unsigned short zc_pending;  // MSG_ZEROCOPY sends, not completed yet
+    unsigned short flags;
+    unsigned short worker;
+};
+
+// dense fd-indexed connection states, allocated once before test.
+// Workers get contiguous fd ranges, so they rarely share cache lines.
+class ConnTable {
+protected:
+    ConnState * states;
+    size_t count;
+
+private:
+    ConnTable(const ConnTable &);
+    ConnTable & operator=(const ConnTable &);
+
 public:
-    std::atomic_int * counter;
-    DecOnExit(std::atomic_int * _counter):counter(_counter){}
-    ~DecOnExit() {--(*counter);}
+    ConnTable():states(nullptr), count(0){}
+    ~ConnTable() {std::free(states);}
+
+    bool resize(size_t new_count) {
+        std::free(states);
+        states = nullptr;
+        count = 0;
+
+        void * mem = nullptr;
+        if (0 != posix_memalign(&mem, 64, std::max(new_count, (size_t)1) * sizeof(ConnState))) {
+            std::cerr << "Can't allocate connection table for " << new_count << " fds\n";
+            return false;
+        }
+        states = static_cast<ConnState *>(mem);
+        count = new_count;
+        std::memset(states, 0, count * sizeof(ConnState));
+        return true;
+    }
+
+    ConnState & operator[](int fd) {return states[fd];}
+    const ConnState & operator[](int fd) const {return states[fd];}
+    size_t size() const {return count;}
 };
 
-struct FdTimout {
-    int fd;
-    unsigned long int ready_time;
+// fixed size array of cache line aligned items, as std::allocator
+// ignores alignas before c++17
+template<class T>
+class AlignedArray {
+protected:
+    T * items;
+    size_t count;
+
+private:
+    AlignedArray(const AlignedArray &);
+    AlignedArray & operator=(const AlignedArray &);
+
+public:
+    AlignedArray():items(nullptr), count(0){}
+    ~AlignedArray() {clear();}
+
+    void clear() {
+        for(size_t idx = 0; idx < count; ++idx)
+            items[idx].~T();
+        std::free(items);
+        items = nullptr;
+        count = 0;
+    }
 
-    FdTimout(int _fd, unsigned long int _ready_time):fd(_fd), ready_time(_ready_time){}
-    bool operator<(const FdTimout & fd)const {
-        return ready_time > fd.ready_time;
+    bool resize(size_t new_count) {
+        clear();
+
+        void * mem = nullptr;
+        if (0 != posix_memalign(&mem, CACHE_LINE, std::max(new_count, (size_t)1) * sizeof(T))) {
+            std::cerr << "Can't allocate " << new_count << " aligned items\n";
+            return false;
+        }
+        items = static_cast<T *>(mem);
+        count = new_count;
+        for(size_t idx = 0; idx < count; ++idx)
+            new(&items[idx]) T();
+        return true;
     }
+
+    T & operator[](size_t idx) {return items[idx];}
+    const T & operator[](size_t idx) const {return items[idx];}
+    size_t size() const {return count;}
+
+    T * begin() {return items;}
+    T * end() {return items + count;}
+    const T * begin() const {return items;}
+    const T * end() const {return items + count;}
 };
 
-struct Sync {
-   std::atomic_bool done;
-   std::mutex run_lola_run;
-   std::atomic_int active_count;
+// running totals of one worker, published once per event loop round and read
+// by main thread every stats interval. Slot per cache line, so workers don't
+// invalidate each other lines. Histogram counters are relaxed atomics already,
+// so main thread reads worker own histogram instead of a copy
+struct alignas(CACHE_LINE) IntervalSlot {
+    std::atomic<unsigned long> mcount;
+    const LatHistogram * lat_hist;
+
+    IntervalSlot():mcount(0), lat_hist(nullptr){}
+
+    void publish(unsigned long total_mcount) {
+        mcount.store(total_mcount, std::memory_order_relaxed);
+    }
 };
 
-std::string serialize_to_str(const TestResult & res) {
-    std::stringstream serialized;
-    serialized << res.mcount;
+struct IntervalStats {
+    // since test start
+    unsigned long start_ns;
+    unsigned long duration_ns;
+    unsigned long mcount;
+    std::vector<unsigned long> worker_mcount;
+    LatHistogram lat_hist;
+};
 
-    #ifdef LOG2_LAT
-    serialized << " 2";
-    #else
-    serialized << " " << std::setprecision(12) << std::pow(2L, 0.1L);
-    #endif
+// turns running totals of worker slots into per interval stats
+class IntervalCollector {
+protected:
+    const AlignedArray<IntervalSlot> & slots;
+    unsigned long run_start;
+    unsigned long last_time;
+    std::vector<unsigned long> last_mcount;
+    LatHistogram last_total;
+    LatHistogram total;
 
-    serialized << " " << res.lat_map.size();
-    for(const auto & val: res.lat_map)
-        serialized << " " << val.first << " " << val.second;
+public:
+    IntervalCollector(const AlignedArray<IntervalSlot> & _slots, int lat_digits, unsigned long _run_start):
+        slots(_slots), run_start(_run_start), last_time(_run_start), last_mcount(_slots.size(), 0),
+        last_total(lat_digits), total(lat_digits)
+    {}
+
+    void collect(unsigned long curr_time, IntervalStats & stats) {
+        stats.start_ns = last_time - run_start;
+        stats.duration_ns = curr_time - last_time;
+        last_time = curr_time;
+
+        stats.mcount = 0;
+        stats.worker_mcount.resize(slots.size());
+        for(size_t i = 0; i < slots.size(); ++i) {
+            unsigned long mcount = slots[i].mcount.load(std::memory_order_relaxed);
+            stats.worker_mcount[i] = mcount - last_mcount[i];
+            stats.mcount += stats.worker_mcount[i];
+            last_mcount[i] = mcount;
+        }
 
-    serialized << " " << res.percentiles.size();
-    for(auto val: res.percentiles)
-        serialized << " " << val;
+        total.reset();
+        for(size_t i = 0; i < slots.size(); ++i)
+            total.merge(*slots[i].lat_hist);
 
-    return serialized.str();
-}
+        stats.lat_hist = LatHistogram(total.digits());
+        stats.lat_hist.merge(total);
+        stats.lat_hist.subtract(last_total);
+        std::swap(last_total, total);
+    }
+};
 
-bool load_from_str(const char * data, TestParams & params) {
-    if (std::strlen(data) > sizeof(params.ip)) {
-        std::cerr << "Message too large\n";
-        return false;
+class DecOnExit {
+public:
+    std::atomic_int * counter;
+    DecOnExit(std::atomic_int * _counter):counter(_counter){}
+    ~DecOnExit() {--(*counter);}
+};
+
+// workers wait in start barrier till main thread releases all of them.
+// Release sets common start time a bit ahead, so workers, woken up
+// earlier, spin till it and all start together regardless of wake up order
+const unsigned long START_LEAD_NS = 1000 * 1000;
+
+class Sync {
+protected:
+    std::mutex lock;
+    std::condition_variable cond;
+    int arrived;
+    bool released;
+    unsigned long start_ns;
+
+public:
+    std::atomic_int active_count;
+    // checked once per event loop round. On own cache line, so this check
+    // never misses because of writes to other fields
+    alignas(CACHE_LINE) std::atomic_bool done;
+
+    Sync(): arrived(0), released(false), start_ns(0), active_count(0), done(false) {}
+
+    bool stopped() const {return done.load(std::memory_order_relaxed);}
+    void stop() {done.store(true);}
+
+    // worker side, returns own start time
+    unsigned long arrive_and_wait() {
+        unsigned long start;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ++arrived;
+            cond.notify_all();
+            cond.wait(guard, [this]{return released;});
+            start = start_ns;
+        }
+
+        unsigned long now;
+        while((now = get_fast_time()) < start)
+            std::this_thread::yield();
+        return now;
     }
-    int num_scanned = std::sscanf(data, "%s %d %d %d %lu %lu %d",
-                                  params.ip,
-                                  &params.port,
-                                  &params.num_conn,
-                                  &params.runtime,
-                                  &params.min_timeout,
-                                  &params.max_timeout,
-                                  &params.message_len);
-    if (num_scanned != 7) {
-        std::cerr << "Message from client is broken '" << data << "'\n";
-        return false;
+
+    void wait_arrived(int count) {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this, count]{return arrived >= count;});
     }
 
-    if (params.min_timeout > params.max_timeout) {
-        std::cerr << "Message from client is broken. (min_timeout)" << params.min_timeout;
-        std::cerr << " > (max_timeout) " << params.min_timeout << "\n";
-        std::cerr << " data = '" << data << "'\n";
-        return false;
+    // returns common start time. Workers, arriving later, start at once
+    unsigned long release(unsigned long lead_ns) {
+        std::lock_guard<std::mutex> guard(lock);
+        start_ns = get_fast_time() + lead_ns;
+        released = true;
+        cond.notify_all();
+        return start_ns;
     }
 
-    return true;
-}
+    unsigned long start_time() {
+        std::lock_guard<std::mutex> guard(lock);
+        return start_ns;
+    }
+};
 
-int log2_64(uint64_t value) {
-    const int tab64[64] = {
-        63,  0, 58,  1, 59, 47, 53,  2,
-        60, 39, 48, 27, 54, 33, 42,  3,
-        61, 51, 37, 40, 49, 18, 28, 20,
-        55, 30, 34, 11, 43, 14, 22,  4,
-        62, 57, 46, 52, 38, 26, 32, 41,
-        50, 36, 17, 19, 29, 10, 13, 21,
-        56, 45, 25, 31, 35, 16,  9, 12,
-        44, 24, 15,  8, 23,  7,  6,  5};
+// BINARY CONTROL PROTOCOL
+// FRAME: MAGIC - VERSION(u16) - FRAME_TYPE(u16) - PAYLOAD_LEN(u32) - PAYLOAD
+// PAYLOAD: [TAG(u16) - LEN(u32) - VALUE]...
+// Little endian. Integer values are u64 (signed ones - two's complement),
+// floats are f64, strings are raw bytes without terminator. Readers skip unknown
+// tags, so new fields only need a new tag. VERSION is bumped on incompatible
+// changes only, loader rejects frames with newer version. Text spec is still
+// accepted and is answered with text RESULT FORMAT
+const char PROTO_MAGIC[4] = {'N', 'P', 'T', 'B'};
+const unsigned short PROTO_VERSION = 1;
+const size_t PROTO_HEADER_SIZE = 12;
+// spec is small, anything bigger is garbage
+const size_t MAX_SPEC_FRAME = 64 * 1024;
+
+const unsigned short FRAME_SPEC = 1;
+const unsigned short FRAME_RESULT = 2;
+// zero or more, streamed before FRAME_RESULT if interval_ms option is set
+const unsigned short FRAME_INTERVAL = 3;
+// sync_start option: loader sends empty FRAME_READY when connections are set up
+// and waits for FRAME_START from coordinator, which has got all loaders ready
+const unsigned short FRAME_READY = 4;
+const unsigned short FRAME_START = 5;
+
+// FRAME_SPEC tags, first seven are MESSAGE FORMAT positional fields
+const unsigned short SPEC_IP = 1;               // string
+const unsigned short SPEC_PORT = 2;
+const unsigned short SPEC_NUM_CONN = 3;
+const unsigned short SPEC_RUNTIME = 4;
+const unsigned short SPEC_MIN_TIMEOUT = 5;
+const unsigned short SPEC_MAX_TIMEOUT = 6;
+const unsigned short SPEC_MESSAGE_LEN = 7;
+const unsigned short SPEC_OPTION = 8;           // 'KEY=VAL' string, may repeat
+
+// FRAME_RESULT tags, same data as in RESULT FORMAT
+const unsigned short RES_MCOUNT = 1;
+const unsigned short RES_LAT_HIST = 2;          // DIGITS - [BUCKET_LOW_NS BUCKET_COUNT]...
+const unsigned short RES_MESS_PERC = 3;         // [MESS_PERC]...
+const unsigned short RES_LAT_PERC = 4;          // [PERC(f64) LAT_NS]...
+const unsigned short RES_CLOCK_SOURCE = 5;      // string
+const unsigned short RES_CLOCK_ERR_PPM = 6;     // f64
+const unsigned short RES_LOADER_CPU_NS = 7;
+const unsigned short RES_WAIT_MODE = 8;         // string
+const unsigned short RES_WAKEUPS = 9;           // WAKEUPS - SPURIOUS_WAKEUPS
+const unsigned short RES_ZEROCOPY = 10;         // SENDS - COMPLETED - COPIED - FALLBACKS
+const unsigned short RES_WORKER_CPUS = 11;      // [CPU NUMA_NODE]..., signed
+const unsigned short RES_WORKER_USAGE = 12;     // [MESS_COUNT BUSY_PERMILLE CONNS CONNS_IN CONNS_OUT]...
+// FASTOPEN_* - deferred connects, which SYN data was accepted, deferred counts are in RES_DEFERRED
+const unsigned short RES_CONNECT = 13;          // CONNECTS - CONNECT_WALL_NS - FASTOPEN_CONNECTS
+const unsigned short RES_CONNECT_HIST = 14;     // as RES_LAT_HIST
+const unsigned short RES_CONNECT_LAT_PERC = 15; // as RES_LAT_PERC
+const unsigned short RES_CHURN = 16;            // RECONNECTS - RUN_NS - FASTOPEN_RECONNECTS
+const unsigned short RES_CHURN_HIST = 17;
+const unsigned short RES_CHURN_LAT_PERC = 18;
+const unsigned short RES_CONN_MCOUNT = 19;      // [MESS_COUNT]... per active connection
+const unsigned short RES_WORKER_START_LAG = 20; // [START_LAG_NS]... per worker
+const unsigned short RES_START_REALTIME = 21;   // CLOCK_REALTIME ns of test start
+const unsigned short RES_MEMORY = 22;           // [RSS SOCK_MEM SLAB SOCKETS] before connect and at test end
+// connects, returned before handshake, they aren't in RES_CONNECT_HIST/RES_CHURN_HIST
+const unsigned short RES_DEFERRED = 23;         // DEFERRED_CONNECTS - DEFERRED_RECONNECTS
+const unsigned short RES_UDP_LOST = 24;         // udp requests, resent as got no reply in time
+
+// FRAME_INTERVAL tags
+const unsigned short IV_START_NS = 1;           // since test start
+const unsigned short IV_DURATION_NS = 2;
+const unsigned short IV_MCOUNT = 3;
+const unsigned short IV_LAT_HIST = 4;           // as RES_LAT_HIST
+const unsigned short IV_WORKER_MCOUNT = 5;      // [MESS_COUNT]... per worker
+
+// FRAME_START tags
+const unsigned short START_REALTIME = 1;        // CLOCK_REALTIME ns, common for all loaders
+
+// builds one frame, records are appended in place, without copies
+class FrameWriter {
+protected:
+    std::string data;
+    size_t record_start;
+
+    void put_raw(unsigned long val, int size) {
+        for(int i = 0; i < size; ++i)
+            data.push_back((char)((val >> (8 * i)) & 0xFF));
+    }
 
-    value |= value >> 1;
-    value |= value >> 2;
-    value |= value >> 4;
-    value |= value >> 8;
-    value |= value >> 16;
-    value |= value >> 32;
+    void patch_u32(size_t offset, unsigned long val) {
+        for(int i = 0; i < 4; ++i)
+            data[offset + i] = (char)((val >> (8 * i)) & 0xFF);
+    }
 
-    return tab64[((uint64_t)((value - (value >> 1))*0x07EDD5E59A4E28C2)) >> 58];
-}
+public:
+    FrameWriter(unsigned short frame_type): data(PROTO_MAGIC, sizeof(PROTO_MAGIC)), record_start(0) {
+        put_raw(PROTO_VERSION, 2);
+        put_raw(frame_type, 2);
+        put_raw(0, 4);
+    }
 
+    void begin(unsigned short tag) {
+        put_raw(tag, 2);
+        record_start = data.size();
+        put_raw(0, 4);
+    }
 
-bool check_socket_ready(int sockfd) {
-    int error = 0;
-    socklen_t len = sizeof(error);
-    int retval = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-    if (0 > retval) {
-        perror("getsockopt(...):");
-        return false;
+    void end() {patch_u32(record_start, data.size() - record_start - 4);}
+
+    void put_u64(unsigned long val) {put_raw(val, 8);}
+    void put_i64(long val) {put_raw((unsigned long)val, 8);}
+    void put_f64(double val) {
+        unsigned long bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+        put_raw(bits, 8);
     }
+    void put_str(const std::string & val) {data.append(val);}
 
-    if (error != 0) {
-        std::cerr << "Socket failed to connect ERROR\n";
-        return false;
+    void u64_record(unsigned short tag, unsigned long val) {begin(tag); put_u64(val); end();}
+    void str_record(unsigned short tag, const std::string & val) {begin(tag); put_str(val); end();}
+
+    const std::string & finish() {
+        patch_u32(8, data.size() - PROTO_HEADER_SIZE);
+        return data;
     }
+};
 
-    return true;
-}
+// walks over records of one frame payload
+class FrameReader {
+protected:
+    const char * data;
+    size_t size;
+    size_t pos;
 
-bool connect_all(int sock_count,
-                 std::vector<int> & sockets,
-                 const char * ip,
-                 const int port,
-                 const std::vector<sockaddr_in> & client_ip_addrs,
-                 int conn_q_size=32,
-                 int conn_timeout_ms=1000)
-{
-    const struct hostent * host = gethostbyname(ip);
-    if (NULL == host) {
-        std::string message("No such host: '");
-        message.append(ip);
-        message.append("'");
-        std::perror(message.c_str());
-        return false;
+public:
+    unsigned short tag;
+    const char * value;
+    size_t value_len;
+
+    FrameReader(const char * _data, size_t _size): data(_data), size(_size), pos(0),
+                                                   tag(0), value(nullptr), value_len(0) {}
+
+    static unsigned long get_raw(const char * ptr, int size) {
+        unsigned long val = 0;
+        for(int i = 0; i < size; ++i)
+            val |= (unsigned long)(unsigned char)ptr[i] << (8 * i);
+        return val;
     }
 
-    struct sockaddr_in serv_addr;
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((const char *)host->h_addr, (char *)&serv_addr.sin_addr.s_addr, host->h_length);
-    serv_addr.sin_port = htons(port);
-    sockets.clear();
+    // false at the end of payload or if record is truncated
+    bool next() {
+        if (pos + 6 > size)
+            return false;
 
-    auto curr_it = client_ip_addrs.begin();
-    auto end_it = client_ip_addrs.end();
-    bool need_bind = (curr_it != end_it);
-    int waiting_to_connect = 0;
-    EPollRSelector sel(conn_q_size);
+        tag = (unsigned short)get_raw(data + pos, 2);
+        value_len = get_raw(data + pos + 2, 4);
+        if (value_len > size - pos - 6)
+            return false;
 
-    if (not sel.ok())
-        return false;
+        value = data + pos + 6;
+        pos += 6 + value_len;
+        return true;
+    }
 
-    while(sock_count - sockets.size() != 0 or waiting_to_connect != 0) {
-        int max_connect = std::min(sock_count - (int)sockets.size(),
-                                   conn_q_size - waiting_to_connect);
+    bool at_end() const {return pos == size;}
 
-        for(int i = 0; i < max_connect ; ++i) {
-            int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-            if (sockfd < 0) {
-                std::perror("Socket creation:");
-                return false;
-            }
+    bool get_u64(unsigned long & val) const {
+        if (8 != value_len)
+            return false;
+        val = get_raw(value, 8);
+        return true;
+    }
 
-            sockets.push_back(sockfd); // external code would close all ports from sockets
+    std::string get_str() const {return std::string(value, value_len);}
+};
 
-            const int enable{1};
-            if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-                perror("setsockopt(SO_REUSEADDR) failed");
+// RESULT FORMAT
+// MESS_COUNT - HIST_SIZE - [BUCKET_LOW_NS BUCKET_COUNT]... -
+//     MESS_PERC_SIZE - [MESS_PERC]... - LAT_PERC_SIZE - [PERC LAT_NS]... -
+//     CLOCK_SOURCE - CLOCK_CALIBRATION_ERR_PPM - LOADER_CPU_NS -
+//     WAIT_MODE - WAKEUPS - SPURIOUS_WAKEUPS -
+//     ZC_SENDS - ZC_COMPLETED - ZC_COPIED - ZC_FALLBACKS -
+//     WORKERS - [CPU NUMA_NODE]... -
+//     WORKERS - [MESS_COUNT BUSY_PERMILLE CONNS CONNS_IN CONNS_OUT]... -
+//     CONNECTS - CONNECT_WALL_NS - FASTOPEN_CONNECTS -
+//     HIST_SIZE - [BUCKET_LOW_NS BUCKET_COUNT]... - LAT_PERC_SIZE - [PERC LAT_NS]... -
+//     RECONNECTS - RUN_NS - FASTOPEN_RECONNECTS -
+//     HIST_SIZE - [BUCKET_LOW_NS BUCKET_COUNT]... - LAT_PERC_SIZE - [PERC LAT_NS]... -
+//     DEFERRED_CONNECTS - DEFERRED_RECONNECTS - UDP_LOST
+// Deferred (fastopen) connects aren't in connect histograms, FASTOPEN_* are
+// deferred ones, which SYN data was accepted
+
+// HIST_SIZE - [BUCKET_LOW_NS BUCKET_COUNT]..., only non-empty buckets
+void serialize_hist(std::stringstream & serialized, const LatHistogram & hist) {
+    size_t used_buckets = 0;
+    for(size_t idx = 0; idx < hist.size(); ++idx)
+        if (0 != hist.count_at(idx))
+            ++used_buckets;
+
+    serialized << " " << used_buckets;
+    for(size_t idx = 0; idx < hist.size(); ++idx)
+        if (0 != hist.count_at(idx))
+            serialized << " " << hist.lowest_at(idx) << " " << hist.count_at(idx);
+}
 
-            if (need_bind) {
-                if (curr_it == end_it)
-                    curr_it = client_ip_addrs.begin();
-                if ( 0 > bind(sockfd, (struct sockaddr *)&*curr_it, sizeof(*curr_it))) {
-                    std::perror("Client bind:");
-                    return false;
-                }
-                ++curr_it;
-            }
+// COUNT - WALL_NS - FASTOPEN_COUNT - latency histogram and percentiles
+void serialize_connect_stats(std::stringstream & serialized, const ConnectStats & stats) {
+    serialized << " " << stats.connects << " " << stats.wall_ns << " " << stats.fastopen_connects;
+    serialize_hist(serialized, stats.lat_hist);
+    serialized << " " << LAT_PERCENTILES.size();
+    for(double perc: LAT_PERCENTILES)
+        serialized << " " << perc << " " << stats.lat_hist.value_at_percentile(perc);
+}
 
-            if (0 > connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr))) {
-                if (errno != EINPROGRESS) {
-                    std::perror("Connecting:");
-                    return false;
-                }
-            }
+std::string serialize_to_str(const TestResult & res) {
+    std::stringstream serialized;
+    serialized << res.mcount;
+    serialize_hist(serialized, res.lat_hist);
 
-            if (not sel.add_fd(sockfd, EPOLLOUT | EPOLLET))
-                return false;
+    serialized << " " << res.percentiles.size();
+    for(auto val: res.percentiles)
+        serialized << " " << val;
 
-            ++waiting_to_connect;
-        }
+    serialized << " " << LAT_PERCENTILES.size();
+    for(size_t i = 0; i < LAT_PERCENTILES.size(); ++i)
+        serialized << " " << LAT_PERCENTILES[i] << " " << res.lat_percentiles[i];
 
-        if (not sel.wait(conn_timeout_ms))
-            return false;
+    serialized << " " << fast_time_source() << " " << tsc_clock.calibration_err_ppm;
+    serialized << " " << res.cpu_ns;
+    serialized << " " << precise_wait_name(res.wait) << " " << res.wakeups << " " << res.spurious_wakeups;
+    serialized << " " << res.zc.sends << " " << res.zc.completed << " " << res.zc.copied;
+    serialized << " " << res.zc.fallbacks;
 
-        if (0 == sel.ready_count()) {
-            std::cerr << sock_count << " " << sockets.size() << " " << waiting_to_connect << "\n";
-            std::cerr << "Socket failed to connect\n";
-            return false;
-        }
+    serialized << " " << res.worker_cpus.size();
+    for(auto cpu: res.worker_cpus)
+        serialized << " " << cpu << " " << (0 > cpu ? -1 : cpu_numa_node(cpu));
 
-        int fd;
-        uint32_t flags;
+    serialized << " " << res.worker_usage.size();
+    for(const auto & usage: res.worker_usage) {
+        serialized << " " << usage.mcount << " " << usage.busy_ns * 1000 / std::max(usage.run_ns, 1UL);
+        serialized << " " << usage.conns << " " << usage.conns_in << " " << usage.conns_out;
+    }
 
-        while(sel.next(fd, flags)) {
-            if (not check_socket_ready(fd)) {
-                std::cerr << "Socket failed to connect\n";
-                return false;
-            }
-            --waiting_to_connect;
-            sel.remove_current_ready();
+    serialize_connect_stats(serialized, res.connect);
+    serialize_connect_stats(serialized, res.churn);
+    serialized << " " << res.connect.deferred_connects << " " << res.churn.deferred_connects;
+    serialized << " " << res.udp_lost;
+
+    return serialized.str();
+}
+
+void serialize_hist(FrameWriter & frame, unsigned short tag, const LatHistogram & hist) {
+    frame.begin(tag);
+    frame.put_u64(hist.digits());
+    for(size_t idx = 0; idx < hist.size(); ++idx)
+        if (0 != hist.count_at(idx)) {
+            frame.put_u64(hist.lowest_at(idx));
+            frame.put_u64(hist.count_at(idx));
         }
+    frame.end();
+}
+
+void serialize_lat_perc(FrameWriter & frame, unsigned short tag, const LatHistogram & hist) {
+    frame.begin(tag);
+    for(double perc: LAT_PERCENTILES) {
+        frame.put_f64(perc);
+        frame.put_u64(hist.value_at_percentile(perc));
     }
-    return true;
+    frame.end();
 }
 
-#ifdef EPOLL_CALL_STATS
-std::atomic<unsigned long int> socket_count_from_wait;
-std::atomic<unsigned int> epoll_wait_calls;
-#endif
+void serialize_connect_stats(FrameWriter & frame, unsigned short tag, const ConnectStats & stats) {
+    frame.begin(tag);
+    frame.put_u64(stats.connects);
+    frame.put_u64(stats.wall_ns);
+    frame.put_u64(stats.fastopen_connects);
+    frame.end();
+}
 
-bool ping(int fd, char * buff, int buff_sz) {
-    int bc = recv(fd, buff, buff_sz, 0);
-    if (0 > bc and ECONNRESET == errno) {
-        return false;
-    } else if (0 > bc) {
-        std::perror("recv(fd, &buffer[0], buff_sz, 0)");
-        return false;
-    } else if (0 == bc) {
-        perror("recv 0 bytes");
-        return false;
-    } else if (buff_sz != bc) {
-        std::perror("partial message");
-        return false;
+// BINARY CONTROL PROTOCOL version of serialize_to_str, with per connection counts
+std::string serialize_to_frame(const TestResult & res) {
+    FrameWriter frame(FRAME_RESULT);
+    frame.u64_record(RES_MCOUNT, res.mcount);
+    serialize_hist(frame, RES_LAT_HIST, res.lat_hist);
+
+    frame.begin(RES_MESS_PERC);
+    for(auto val: res.percentiles)
+        frame.put_u64(val);
+    frame.end();
+
+    frame.begin(RES_LAT_PERC);
+    for(size_t i = 0; i < LAT_PERCENTILES.size(); ++i) {
+        frame.put_f64(LAT_PERCENTILES[i]);
+        frame.put_u64(res.lat_percentiles[i]);
+    }
+    frame.end();
+
+    frame.str_record(RES_CLOCK_SOURCE, fast_time_source());
+    frame.begin(RES_CLOCK_ERR_PPM);
+    frame.put_f64(tsc_clock.calibration_err_ppm);
+    frame.end();
+    frame.u64_record(RES_LOADER_CPU_NS, res.cpu_ns);
+
+    frame.str_record(RES_WAIT_MODE, precise_wait_name(res.wait));
+    frame.begin(RES_WAKEUPS);
+    frame.put_u64(res.wakeups);
+    frame.put_u64(res.spurious_wakeups);
+    frame.end();
+
+    frame.begin(RES_ZEROCOPY);
+    frame.put_u64(res.zc.sends);
+    frame.put_u64(res.zc.completed);
+    frame.put_u64(res.zc.copied);
+    frame.put_u64(res.zc.fallbacks);
+    frame.end();
+
+    frame.begin(RES_WORKER_CPUS);
+    for(auto cpu: res.worker_cpus) {
+        frame.put_i64(cpu);
+        frame.put_i64(0 > cpu ? -1 : cpu_numa_node(cpu));
+    }
+    frame.end();
+
+    frame.begin(RES_WORKER_USAGE);
+    for(const auto & usage: res.worker_usage) {
+        frame.put_u64(usage.mcount);
+        frame.put_u64(usage.busy_ns * 1000 / std::max(usage.run_ns, 1UL));
+        frame.put_u64(usage.conns);
+        frame.put_u64(usage.conns_in);
+        frame.put_u64(usage.conns_out);
     }
+    frame.end();
+
+    serialize_connect_stats(frame, RES_CONNECT, res.connect);
+    serialize_hist(frame, RES_CONNECT_HIST, res.connect.lat_hist);
+    serialize_lat_perc(frame, RES_CONNECT_LAT_PERC, res.connect.lat_hist);
+
+    serialize_connect_stats(frame, RES_CHURN, res.churn);
+    serialize_hist(frame, RES_CHURN_HIST, res.churn.lat_hist);
+    serialize_lat_perc(frame, RES_CHURN_LAT_PERC, res.churn.lat_hist);
+
+    frame.begin(RES_WORKER_START_LAG);
+    for(const auto & usage: res.worker_usage)
+        frame.put_u64(usage.start_lag_ns);
+    frame.end();
+
+    frame.begin(RES_CONN_MCOUNT);
+    for(auto mcount: res.conn_mcount)
+        frame.put_u64(mcount);
+    frame.end();
+
+    frame.u64_record(RES_START_REALTIME, res.start_realtime_ns);
+
+    frame.begin(RES_MEMORY);
+    for(const auto & mem: {res.mem_before, res.mem_open}) {
+        frame.put_u64(mem.rss);
+        frame.put_u64(mem.sock_mem);
+        frame.put_u64(mem.slab);
+        frame.put_u64(mem.sockets);
+    }
+    frame.end();
+
+    frame.begin(RES_DEFERRED);
+    frame.put_u64(res.connect.deferred_connects);
+    frame.put_u64(res.churn.deferred_connects);
+    frame.end();
+
+    frame.u64_record(RES_UDP_LOST, res.udp_lost);
+    return frame.finish();
+}
+
+std::string serialize_interval(const IntervalStats & stats) {
+    FrameWriter frame(FRAME_INTERVAL);
+    frame.u64_record(IV_START_NS, stats.start_ns);
+    frame.u64_record(IV_DURATION_NS, stats.duration_ns);
+    frame.u64_record(IV_MCOUNT, stats.mcount);
+    serialize_hist(frame, IV_LAT_HIST, stats.lat_hist);
+
+    frame.begin(IV_WORKER_MCOUNT);
+    for(auto mcount: stats.worker_mcount)
+        frame.put_u64(mcount);
+    frame.end();
+
+    return frame.finish();
+}
 
-    if (buff_sz != write(fd, buff, buff_sz)) {
-        std::perror("write(fd, &buffer[0], buff_sz)");
+void set_default_params(TestParams & params) {
+    params.engine = WorkerEngine::EPOLL;
+    params.udp = false;
+    params.depth = 1;
+    params.lat_digits = 3;
+    params.rate = 0;
+    params.busy_poll.spin_ns = 0;
+    params.busy_poll.busy_poll_us = 0;
+    params.wait_mode = "auto";
+    params.wait = PreciseWait::MS;
+    params.zerocopy = false;
+    params.workers = DEFAULT_WORKERS;
+    params.rebalance = false;
+    params.cpus.clear();
+    params.connect_only = false;
+    params.connect.threads = 1;
+    params.connect.window = 32;
+    params.connect.fastopen = false;
+    params.connect.bind_no_port = false;
+    params.connect.timeout_ms = 5000;
+    params.churn_msgs = 0;
+    params.churn_rate = 0;
+    params.interval_ms = 0;
+    params.sync_start = false;
+    params.dest_ips.clear();
+    params.dest_ports = 1;
+    params.active_frac = 1;
+}
+
+// whole value of option key should be a decimal number in [min_val, max_val]
+bool parse_option_num(const std::string & key, const std::string & val,
+                      long min_val, long max_val, long & res) {
+    char * end = nullptr;
+    errno = 0;
+    res = std::strtol(val.c_str(), &end, 10);
+    if (val.empty() or '\0' != *end or 0 != errno or res < min_val or res > max_val) {
+        std::cerr << "Option " << key << " should be a number in [" << min_val << ", " << max_val;
+        std::cerr << "], got '" << val << "'\n";
         return false;
     }
     return true;
 }
 
-void worker_thread_fast(EPollRSelector * sel,
-                        int message_len,
-                        int,
-                        unsigned long int timeout_ns_min,
-                        unsigned long int timeout_ns_max,
-                        Sync * sync,
-                        TestResult * result)
-{
-    if (0 != timeout_ns_min or 0 != timeout_ns_max) {
-        std::cerr << "worker_thread_fast doesn't support timeouts\n";
-        return;
+// single 'key=value' option of test spec
+bool apply_option(const std::string & option, TestParams & params) {
+    auto eq_pos = option.find('=');
+    if (std::string::npos == eq_pos) {
+        std::cerr << "Broken test option '" << option << "'\n";
+        return false;
     }
 
-    DecOnExit exitor(&sync->active_count);
-    result->mcount = 0;
+    auto key = option.substr(0, eq_pos);
+    auto val = option.substr(eq_pos + 1);
+    long num;
+
+    if (key == "engine") {
+        if (val == "epoll")
+            params.engine = WorkerEngine::EPOLL;
+        else if (val == "uring")
+            params.engine = WorkerEngine::URING;
+        else if (val == "uring_sqpoll")
+            params.engine = WorkerEngine::URING_SQPOLL;
+        else {
+            std::cerr << "Unknown worker engine '" << val << "'\n";
+            return false;
+        }
+    } else if (key == "proto") {
+        if (val == "tcp" or val == "udp")
+            params.udp = (val == "udp");
+        else {
+            std::cerr << "Unknown protocol '" << val << "'\n";
+            return false;
+        }
+    } else if (key == "depth") {
+        if (not parse_option_num(key, val, 1, MAX_PIPELINE_DEPTH, num))
+            return false;
+        params.depth = num;
+    } else if (key == "lat_digits") {
+        if (not parse_option_num(key, val, 1, 4, num))
+            return false;
+        params.lat_digits = num;
+    } else if (key == "rate") {
+        // interval between requests is at least 1ns
+        if (not parse_option_num(key, val, 0, BILLION, num))
+            return false;
+        params.rate = num;
+    } else if (key == "spin_us") {
+        if (not parse_option_num(key, val, 0, INT_MAX, num))
+            return false;
+        params.busy_poll.spin_ns = num * 1000;
+    } else if (key == "busy_poll_us") {
+        if (not parse_option_num(key, val, 0, INT_MAX, num))
+            return false;
+        params.busy_poll.busy_poll_us = num;
+    } else if (key == "zerocopy") {
+        if (not parse_option_num(key, val, 0, 1, num))
+            return false;
+        params.zerocopy = (0 != num);
+    } else if (key == "workers") {
+        if (not parse_option_num(key, val, 1, MAX_WORKERS, num))
+            return false;
+        params.workers = num;
+    } else if (key == "rebalance") {
+        if (not parse_option_num(key, val, 0, 1, num))
+            return false;
+        params.rebalance = (0 != num);
+    } else if (key == "cpus") {
+        // ':' separates per-worker groups - "0-3" pins worker i to one cpu,
+        // "0,1:2,3" - worker 0 to cpus 0 and 1, worker 1 to 2 and 3
+        std::istringstream groups(val);
+        std::string group;
+        while(std::getline(groups, group, ':')) {
+            std::vector<int> cpus;
+            if (not parse_cpu_list(group, cpus))
+                return false;
+
+            if (std::string::npos != val.find(':')) {
+                params.cpus.push_back(cpus);
+            } else {
+                for(int cpu: cpus)
+                    params.cpus.push_back(std::vector<int>(1, cpu));
+            }
+        }
+    } else if (key == "mode") {
+        if (val == "echo" or val == "connect")
+            params.connect_only = (val == "connect");
+        else {
+            std::cerr << "Unknown test mode '" << val << "'\n";
+            return false;
+        }
+    } else if (key == "connect_threads") {
+        if (not parse_option_num(key, val, 1, MAX_WORKERS, num))
+            return false;
+        params.connect.threads = num;
+    } else if (key == "connect_window") {
+        if (not parse_option_num(key, val, 1, INT_MAX, num))
+            return false;
+        params.connect.window = num;
+    } else if (key == "connect_timeout_ms") {
+        if (not parse_option_num(key, val, 1, INT_MAX, num))
+            return false;
+        params.connect.timeout_ms = num;
+    } else if (key == "churn_msgs") {
+        if (not parse_option_num(key, val, 0, LONG_MAX, num))
+            return false;
+        params.churn_msgs = num;
+    } else if (key == "churn_rate") {
+        if (not parse_option_num(key, val, 0, BILLION, num))
+            return false;
+        params.churn_rate = num;
+    } else if (key == "interval_ms") {
+        if (not parse_option_num(key, val, 0, INT_MAX, num))
+            return false;
+        params.interval_ms = num;
+    } else if (key == "dest_ips") {
+        params.dest_ips.clear();
+        std::stringstream ips(val);
+        std::string dest_ip;
+        while(std::getline(ips, dest_ip, ','))
+            if (not dest_ip.empty())
+                params.dest_ips.push_back(dest_ip);
+    } else if (key == "dest_ports") {
+        if (not parse_option_num(key, val, 1, 65535, num))
+            return false;
+        params.dest_ports = num;
+    } else if (key == "active_frac") {
+        char * end = nullptr;
+        params.active_frac = std::strtod(val.c_str(), &end);
+        if (val.empty() or '\0' != *end or not (params.active_frac > 0 and params.active_frac <= 1)) {
+            std::cerr << "Active connections share should be in (0, 1], got '" << val << "'\n";
+            return false;
+        }
+    } else if (key == "sync_start") {
+        if (not parse_option_num(key, val, 0, 1, num))
+            return false;
+        params.sync_start = (0 != num);
+    } else if (key == "fastopen") {
+        if (not parse_option_num(key, val, 0, 1, num))
+            return false;
+        params.connect.fastopen = (0 != num);
+    } else if (key == "bind_no_port") {
+        if (not parse_option_num(key, val, 0, 1, num))
+            return false;
+        params.connect.bind_no_port = (0 != num);
+    } else if (key == "wait") {
+        if (val != "auto" and val != "pwait2" and val != "timerfd" and val != "ms") {
+            std::cerr << "Unknown wait mode '" << val << "'\n";
+            return false;
+        }
+        params.wait_mode = val;
+    } else {
+        std::cerr << "Unknown test option '" << option << "'\n";
+        return false;
+    }
+    return true;
+}
+
+// also resolves wait mode, once all options are known
+bool check_params(TestParams & params) {
+    if (params.wait_mode == "timerfd") {
+        params.wait = PreciseWait::TIMERFD;
+    } else if (params.wait_mode == "ms") {
+        params.wait = PreciseWait::MS;
+    } else {
+        params.wait = detect_precise_wait();
+        if (params.wait_mode == "pwait2" and PreciseWait::PWAIT2 != params.wait) {
+            std::cerr << "Kernel doesn't support epoll_pwait2\n";
+            return false;
+        }
+    }
+
+    if (0 != params.rate) {
+        if (0 != params.min_timeout or 0 != params.max_timeout or params.depth > 1) {
+            std::cerr << "Open loop mode can't be used with timeouts or pipelining\n";
+            return false;
+        }
+        if (WorkerEngine::EPOLL != params.engine) {
+            std::cerr << "Open loop mode is only supported by epoll engine\n";
+            return false;
+        }
+    }
+
+    if ((0 != params.busy_poll.spin_ns or 0 != params.busy_poll.busy_poll_us) and
+            WorkerEngine::EPOLL != params.engine) {
+        std::cerr << "Busy polling is only supported by epoll engine\n";
+        return false;
+    }
+
+    if (params.zerocopy and (WorkerEngine::EPOLL != params.engine or params.udp or
+                             params.depth > 1 or 0 != params.rate)) {
+        std::cerr << "Zerocopy is only supported by closed loop tcp epoll engine without pipelining\n";
+        return false;
+    }
+
+    if (params.depth > 1) {
+        if (0 != params.min_timeout or 0 != params.max_timeout) {
+            std::cerr << "Pipelining doesn't support timeouts\n";
+            return false;
+        }
+        if (WorkerEngine::EPOLL != params.engine) {
+            std::cerr << "Pipelining is only supported by epoll engine\n";
+            return false;
+        }
+    }
+
+    if (params.rebalance and (WorkerEngine::EPOLL != params.engine or
+                              params.depth > 1 or 0 != params.rate)) {
+        std::cerr << "Rebalancing is only supported by closed loop epoll engine without pipelining\n";
+        return false;
+    }
+
+    if ((0 != params.churn_msgs or 0 != params.churn_rate) and
+            (WorkerEngine::EPOLL != params.engine or params.udp or params.depth > 1 or
+             0 != params.rate or params.zerocopy or params.rebalance or params.connect_only)) {
+        std::cerr << "Churn is only supported by closed loop tcp epoll engine without pipelining, ";
+        std::cerr << "zerocopy and rebalancing\n";
+        return false;
+    }
+
+    if (params.udp and (params.connect_only or params.connect.fastopen)) {
+        std::cerr << "Connect mode and fastopen are only supported for tcp\n";
+        return false;
+    }
+
+    // udp request starts with its sequence number
+    if (params.udp and params.message_len < (int)sizeof(unsigned long)) {
+        std::cerr << "UDP message should be at least " << sizeof(unsigned long) << " bytes\n";
+        return false;
+    }
+
+    if (params.udp and (1 != params.dest_ports or not params.dest_ips.empty())) {
+        std::cerr << "Several destinations are only supported for tcp\n";
+        return false;
+    }
+
+    if (params.port + params.dest_ports - 1 > 65535) {
+        std::cerr << "Destination ports are out of range\n";
+        return false;
+    }
+
+    // idle udp flow is never seen by echo side, idle deferred fastopen connect never completes
+    if (params.active_frac < 1 and (params.udp or params.connect.fastopen)) {
+        std::cerr << "Idle connections can't be used with udp or fastopen\n";
+        return false;
+    }
+
+    // connect mode measures connection setup, which goes before the start
+    if (params.connect_only and params.sync_start) {
+        std::cerr << "Coordinated start can't be used in connect mode\n";
+        return false;
+    }
+
+    // deferred connect completes with the first request, which connect mode never sends
+    if (params.connect_only and params.connect.fastopen) {
+        std::cerr << "Fastopen can't be used in connect mode\n";
+        return false;
+    }
+
+    // open loop skips first request, so deferred connects wouldn't complete before start
+    if (0 != params.rate and params.connect.fastopen) {
+        std::cerr << "Fastopen can't be used in open loop mode\n";
+        return false;
+    }
+
+    if (params.min_timeout > params.max_timeout) {
+        std::cerr << "Message from client is broken. (min_timeout)" << params.min_timeout;
+        std::cerr << " > (max_timeout) " << params.min_timeout << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool load_from_str(const char * data, TestParams & params) {
+    if (std::strlen(data) > sizeof(params.ip)) {
+        std::cerr << "Message too large\n";
+        return false;
+    }
+    set_default_params(params);
+
+    int consumed = 0;
+    int num_scanned = std::sscanf(data, "%s %d %d %d %lu %lu %d%n",
+                                  params.ip,
+                                  &params.port,
+                                  &params.num_conn,
+                                  &params.runtime,
+                                  &params.min_timeout,
+                                  &params.max_timeout,
+                                  &params.message_len,
+                                  &consumed);
+    if (num_scanned != 7) {
+        std::cerr << "Message from client is broken '" << data << "'\n";
+        return false;
+    }
+
+    // optional 'key=value' options follows mandatory fields
+    std::istringstream options(data + consumed);
+    std::string option;
+    while(options >> option)
+        if (not apply_option(option, params))
+            return false;
+
+    return check_params(params);
+}
+
+// whole FRAME_SPEC frame. Positional fields are mandatory, options are applied
+// in order, same as in text spec
+bool load_from_frame(const std::string & frame, TestParams & params) {
+    unsigned long version = FrameReader::get_raw(&frame[4], 2);
+    if (version > PROTO_VERSION) {
+        std::cerr << "Unsupported control protocol version " << version << "\n";
+        return false;
+    }
+
+    if (FRAME_SPEC != FrameReader::get_raw(&frame[6], 2)) {
+        std::cerr << "Test spec frame expected\n";
+        return false;
+    }
+
+    set_default_params(params);
+
+    // bit per positional field tag
+    const unsigned all_fields = ((1U << (SPEC_MESSAGE_LEN + 1)) - 1) & ~1U;
+    unsigned found = 0;
+
+    FrameReader reader(frame.data() + PROTO_HEADER_SIZE, frame.size() - PROTO_HEADER_SIZE);
+    while(reader.next()) {
+        unsigned long val = 0;
+        if (SPEC_OPTION == reader.tag) {
+            if (not apply_option(reader.get_str(), params))
+                return false;
+            continue;
+        } else if (SPEC_IP == reader.tag) {
+            if (reader.value_len >= sizeof(params.ip)) {
+                std::cerr << "Client ip is too long\n";
+                return false;
+            }
+            std::memcpy(params.ip, reader.value, reader.value_len);
+            params.ip[reader.value_len] = 0;
+        } else if (0 == reader.tag or reader.tag > SPEC_OPTION) {
+            // field of newer client
+            continue;
+        } else if (not reader.get_u64(val)) {
+            std::cerr << "Broken test spec field " << reader.tag << "\n";
+            return false;
+        }
+
+        switch(reader.tag) {
+            case SPEC_PORT: params.port = (int)val; break;
+            case SPEC_NUM_CONN: params.num_conn = (int)val; break;
+            case SPEC_RUNTIME: params.runtime = (int)val; break;
+            case SPEC_MIN_TIMEOUT: params.min_timeout = val; break;
+            case SPEC_MAX_TIMEOUT: params.max_timeout = val; break;
+            case SPEC_MESSAGE_LEN: params.message_len = (int)val; break;
+        }
+        found |= 1U << reader.tag;
+    }
+
+    if (not reader.at_end()) {
+        std::cerr << "Test spec frame is truncated\n";
+        return false;
+    }
+
+    if (all_fields != found) {
+        std::cerr << "Test spec frame misses mandatory fields\n";
+        return false;
+    }
+
+    return check_params(params);
+}
+
+// common start time from coordinator FRAME_START
+bool load_start_frame(const std::string & frame, unsigned long & start_realtime) {
+    if (FRAME_START != FrameReader::get_raw(&frame[6], 2)) {
+        std::cerr << "Start frame expected\n";
+        return false;
+    }
+
+    FrameReader reader(frame.data() + PROTO_HEADER_SIZE, frame.size() - PROTO_HEADER_SIZE);
+    while(reader.next())
+        if (START_REALTIME == reader.tag)
+            return reader.get_u64(start_realtime);
+
+    std::cerr << "Start frame misses start time\n";
+    return false;
+}
+
+bool check_socket_ready(int sockfd) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    int retval = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (0 > retval) {
+        perror("getsockopt(...):");
+        return false;
+    }
+
+    if (error != 0) {
+        std::cerr << "Socket failed to connect ERROR\n";
+        return false;
+    }
+
+    return true;
+}
+
+// fills serv_addr for host ip:port. Returns false if host is unknown
+bool resolve_addr(const char * ip, const int port, sockaddr_in & serv_addr) {
+    const struct hostent * host = gethostbyname(ip);
+    if (NULL == host) {
+        std::string message("No such host: '");
+        message.append(ip);
+        message.append("'");
+        std::perror(message.c_str());
+        return false;
+    }
+
+    bzero((char *)&serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    bcopy((const char *)host->h_addr, (char *)&serv_addr.sin_addr.s_addr, host->h_length);
+    serv_addr.sin_port = htons(port);
+    return true;
+}
+
+// destination and client addresses of loader connections. Connection idx goes
+// from client(idx) to dest(idx), client address changes first, so every pair is
+// used before any repeats. With bind_no_port each pair has own ephemeral port range
+struct Endpoints {
+    std::vector<sockaddr_in> dests;
+    std::vector<sockaddr_in> clients;
+
+    const sockaddr_in & dest(size_t idx) const {
+        return dests[idx / std::max(clients.size(), (size_t)1) % dests.size()];
+    }
+
+    const sockaddr_in * client(size_t idx) const {
+        return clients.empty() ? nullptr : &clients[idx % clients.size()];
+    }
+
+    // connections, which fit into ephemeral port ranges, 0 if unknown
+    unsigned long capacity(bool bind_no_port) const {
+        unsigned long pairs = std::max(clients.size(), (size_t)1);
+        // port, bound to client address, is reserved for all destinations
+        if (bind_no_port or clients.empty())
+            pairs *= dests.size();
+        return pairs * ephemeral_port_count();
+    }
+};
+
+// dest_ips (or ip) and dest_ports consecutive ports from port
+bool resolve_dests(const TestParams & params, std::vector<sockaddr_in> & dests) {
+    std::vector<std::string> ips(params.dest_ips);
+    if (ips.empty())
+        ips.push_back(params.ip);
+
+    dests.clear();
+    for(const auto & ip: ips)
+        for(int port = params.port; port < params.port + params.dest_ports; ++port) {
+            dests.emplace_back();
+            if (not resolve_addr(ip.c_str(), port, dests.back()))
+                return false;
+        }
+    return true;
+}
+
+// creates nonblocking socket and starts connect to serv_addr. bind_addr - client
+// address or nullptr. connected is set, if connect completed at once (fastopen).
+// Returns socket or -1, socket is closed on failure
+int start_connect(const sockaddr_in & serv_addr,
+                  const sockaddr_in * bind_addr,
+                  const ConnectParams & cparams,
+                  bool & connected)
+{
+    const int enable{1};
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        std::perror("Socket creation:");
+        return -1;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+        perror("setsockopt(SO_REUSEADDR) failed");
+
+    // with cached cookie connect returns at once, SYN goes with first request
+    if (cparams.fastopen and
+            0 > setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(enable))) {
+        std::perror("setsockopt(TCP_FASTOPEN_CONNECT)");
+        close(sockfd);
+        return -1;
+    }
+
+    if (nullptr != bind_addr) {
+        // source port is chosen on connect, so it's unique per 4-tuple, not per ip
+        if (cparams.bind_no_port and
+                0 > setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(enable))) {
+            std::perror("setsockopt(IP_BIND_ADDRESS_NO_PORT)");
+            close(sockfd);
+            return -1;
+        }
+
+        if ( 0 > bind(sockfd, (struct sockaddr *)bind_addr, sizeof(*bind_addr))) {
+            std::perror("Client bind:");
+            close(sockfd);
+            return -1;
+        }
+    }
+
+    connected = (0 == connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)));
+    if (not connected and errno != EINPROGRESS) {
+        std::perror("Connecting:");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// one thread of connect_all: opens count connections, keeping up to window of
+// connects in flight. addr_idx - Endpoints index of the first connection
+bool connect_some(int count,
+                  std::vector<int> & sockets,
+                  const Endpoints & endpoints,
+                  size_t addr_idx,
+                  const ConnectParams & cparams,
+                  ConnectStats & stats)
+{
+    int started = 0;
+    int waiting_to_connect = 0;
+    EPollRSelector sel(cparams.window);
+
+    if (not sel.ok())
+        return false;
+
+    // connect start time by fd
+    std::vector<unsigned long> start_times;
+
+    while(started != count or waiting_to_connect != 0) {
+        int max_connect = std::min(count - started, cparams.window - waiting_to_connect);
+
+        for(int i = 0; i < max_connect ; ++i) {
+            bool connected = false;
+            unsigned long start_time = get_fast_time();
+            int sockfd = start_connect(endpoints.dest(addr_idx), endpoints.client(addr_idx), cparams, connected);
+            ++addr_idx;
+            if (0 > sockfd)
+                return false;
+
+            sockets.push_back(sockfd); // external code would close all ports from sockets
+            ++started;
+
+            if (connected) {
+                stats.connects++;
+                stats.deferred_connects++;
+                continue;
+            }
+
+            if ((size_t)sockfd >= start_times.size())
+                start_times.resize(sockfd + 1);
+            start_times[sockfd] = start_time;
+
+            if (not sel.add_fd(sockfd, EPOLLOUT | EPOLLET))
+                return false;
+
+            ++waiting_to_connect;
+        }
+
+        if (0 == waiting_to_connect)
+            continue;
+
+        if (not sel.wait((long)cparams.timeout_ms * 1000 * 1000))
+            return false;
+
+        if (0 == sel.ready_count()) {
+            std::cerr << count << " " << started << " " << waiting_to_connect << "\n";
+            std::cerr << "Socket failed to connect\n";
+            return false;
+        }
+
+        int fd;
+        uint32_t flags;
+        unsigned long curr_time = get_fast_time();
+
+        while(sel.next(fd, flags)) {
+            if (not check_socket_ready(fd)) {
+                std::cerr << "Socket failed to connect\n";
+                return false;
+            }
+            stats.lat_hist.record(curr_time - start_times[fd]);
+            stats.connects++;
+            --waiting_to_connect;
+            sel.remove_current_ready();
+        }
+    }
+    return true;
+}
+
+// opens sock_count connections from cparams.threads threads, connect latency
+// and rate go to stats. Endpoints are used round robin
+bool connect_all(int sock_count,
+                 std::vector<int> & sockets,
+                 const Endpoints & endpoints,
+                 const ConnectParams & cparams,
+                 ConnectStats & stats)
+{
+    sockets.clear();
+
+    int threads = std::max(1, std::min(cparams.threads, sock_count));
+    std::vector<std::vector<int>> thread_sockets(threads);
+    std::vector<ConnectStats> thread_stats(threads);
+    std::vector<char> thread_ok(threads, 0);
+    std::vector<std::thread> connectors;
+
+    for(auto & tstats: thread_stats)
+        tstats.lat_hist = LatHistogram(stats.lat_hist.digits());
+
+    unsigned long start_time = get_fast_time();
+
+    for(int i = 0; i < threads; ++i) {
+        int first = (long)sock_count * i / threads;
+        int count = (long)sock_count * (i + 1) / threads - first;
+        connectors.emplace_back([&, i, first, count]() {
+            thread_ok[i] = connect_some(count, thread_sockets[i], endpoints, first, cparams, thread_stats[i]);
+        });
+    }
+
+    for(auto & connector: connectors)
+        connector.join();
+
+    stats.wall_ns = get_fast_time() - start_time;
+
+    bool ok = true;
+    for(int i = 0; i < threads; ++i) {
+        // failed ones are still passed out to be closed
+        sockets.insert(sockets.end(), thread_sockets[i].begin(), thread_sockets[i].end());
+        stats.connects += thread_stats[i].connects;
+        stats.deferred_connects += thread_stats[i].deferred_connects;
+        stats.lat_hist.merge(thread_stats[i].lat_hist);
+        ok = ok and thread_ok[i];
+    }
+    return ok;
+}
+
+// SYN of fastopen connect carried data and echo side accepted it
+bool syn_data_acked(int fd) {
+    tcp_info info;
+    socklen_t len = sizeof(info);
+    return 0 == getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) and
+           0 != (info.tcpi_options & TCPI_OPT_SYN_DATA);
+}
+
+// deferred fastopen connects are completed by the first request. Echo side
+// waits for all connections, so the test can't start before they are established.
+// Connections, which SYN data was accepted, are counted in stats.fastopen_connects
+bool wait_established(const std::vector<int> & sockets, int timeout_ms, ConnectStats & stats) {
+    unsigned long end_time = get_fast_time() + (unsigned long)timeout_ms * 1000 * 1000;
+    for(auto fd: sockets) {
+        for(;;) {
+            tcp_info info;
+            socklen_t len = sizeof(info);
+            if (0 > getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+                std::perror("getsockopt(TCP_INFO)");
+                return false;
+            }
+
+            if (TCP_ESTABLISHED == info.tcpi_state) {
+                if (info.tcpi_options & TCPI_OPT_SYN_DATA)
+                    stats.fastopen_connects++;
+                break;
+            }
+
+            if (get_fast_time() > end_time) {
+                std::cerr << "Fastopen connection failed to establish\n";
+                return false;
+            }
+            usleep(1000);
+        }
+    }
+    return true;
+}
+
+// udp 'connection' is a connected socket with own source port,
+// so echo side sees each of them as a separated flow
+bool connect_all_udp(int sock_count,
+                     std::vector<int> & sockets,
+                     const char * ip,
+                     const int port,
+                     const std::vector<sockaddr_in> & client_ip_addrs)
+{
+    struct sockaddr_in serv_addr;
+    if (not resolve_addr(ip, port, serv_addr))
+        return false;
+
+    sockets.clear();
+
+    auto curr_it = client_ip_addrs.begin();
+    auto end_it = client_ip_addrs.end();
+    bool need_bind = (curr_it != end_it);
+
+    for(int i = 0; i < sock_count; ++i) {
+        int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (sockfd < 0) {
+            std::perror("Socket creation:");
+            return false;
+        }
+
+        sockets.push_back(sockfd); // external code would close all ports from sockets
+
+        if (need_bind) {
+            if (curr_it == end_it)
+                curr_it = client_ip_addrs.begin();
+            if ( 0 > bind(sockfd, (struct sockaddr *)&*curr_it, sizeof(*curr_it))) {
+                std::perror("Client bind:");
+                return false;
+            }
+            ++curr_it;
+        }
+
+        if (0 > connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr))) {
+            std::perror("Connecting:");
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef EPOLL_CALL_STATS
+std::atomic<unsigned long int> socket_count_from_wait;
+std::atomic<unsigned int> epoll_wait_calls;
+#endif
+
+// tcp may split reply at any byte, so read progress lives in conn.partial_bytes.
+// Returns 1 if reply is complete, 0 if socket drained before that, -1 on error
+int recv_reply(int fd, ConnState & conn, std::vector<char> & buffer, int message_len) {
+    while(conn.partial_bytes < message_len) {
+        size_t chunk = std::min(buffer.size(), (size_t)(message_len - conn.partial_bytes));
+        int bc = recv(fd, &buffer[0], chunk, MSG_DONTWAIT);
+        if (0 > bc and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+            return 0;
+        } else if (0 > bc) {
+            if (ECONNRESET != errno)
+                std::perror("recv(fd, &buffer[0], chunk, MSG_DONTWAIT)");
+            return -1;
+        } else if (0 == bc) {
+            perror("recv 0 bytes");
+            return -1;
+        }
+        conn.partial_bytes += bc;
+    }
+    conn.partial_bytes = 0;
+    return 1;
+}
+
+// udp has no retransmits, so request or reply may be lost and its flow would stall
+// forever. Requests of flows without replies in this time are resent. Each udp request
+// starts with per flow sequence number, echoed back, so late replies of resent requests
+// are recognized and dropped
+const unsigned long UDP_REPLY_TIMEOUT_NS = 200 * 1000 * 1000;
+
+inline void put_seq(char * request, unsigned long seq) {std::memcpy(request, &seq, sizeof(seq));}
+
+inline unsigned long get_seq(const char * reply) {
+    unsigned long seq;
+    std::memcpy(&seq, reply, sizeof(seq));
+    return seq;
+}
+
+// full socket buffer drops the request, as network would, so it's resent on timeout
+bool send_udp_request(int fd, std::string & request, unsigned long seq) {
+    put_seq(&request[0], seq);
+    if (0 > send(fd, request.c_str(), request.size(), MSG_DONTWAIT) and EAGAIN != errno and EWOULDBLOCK != errno) {
+        std::perror("send(fd, request, ...)");
+        return false;
+    }
+    return true;
+}
+
+// reads udp replies till the one for the last request of conn. Returns 1 if it came,
+// 0 if socket drained before that, -1 on error. Late replies of resent requests are dropped
+int recv_udp_reply(int fd, const ConnState & conn, std::vector<char> & buffer, int message_len) {
+    for(;;) {
+        long bc = recv(fd, &buffer[0], buffer.size(), MSG_DONTWAIT | MSG_TRUNC);
+        if (0 > bc and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+            return 0;
+        } else if (0 > bc) {
+            std::perror("recv(fd, &buffer[0], buff_sz, MSG_TRUNC)");
+            return -1;
+        } else if (message_len != bc) {
+            std::cerr << "partial message\n";
+            return -1;
+        }
+
+        if (0 != conn.in_flight and get_seq(&buffer[0]) + 1 == conn.mcount)
+            return 1;
+    }
+}
+
+// requests of own flows, which got no reply in UDP_REPLY_TIMEOUT_NS, are sent again with the
+// same sequence numbers. Last in_flight requests of flow are the ones, waiting for replies
+bool resend_lost_udp(const std::vector<int> & fds, ConnTable & conns, std::string & request,
+                     unsigned long curr_time, TestResult * result)
+{
+    for(auto fd: fds) {
+        auto & conn = conns[fd];
+        if (0 == conn.in_flight or curr_time - conn.last_send_ns < UDP_REPLY_TIMEOUT_NS)
+            continue;
+
+        for(unsigned long seq = conn.mcount - conn.in_flight; seq < conn.mcount; ++seq) {
+            if (not send_udp_request(fd, request, seq))
+                return false;
+            result->udp_lost++;
+        }
+    }
+    return true;
+}
+
+const int UDP_FIN_RETRIES = 10;
+
+// 1 - echo side confirmed fin with empty datagram, 0 - not yet, -1 - error.
+// Replies of requests, still in flight, are skipped
+int udp_fin_confirmed(int fd) {
+    char byte;
+    for(;;) {
+        long bc = recv(fd, &byte, sizeof(byte), MSG_DONTWAIT | MSG_TRUNC);
+        if (0 == bc)
+            return 1;
+        if (0 > bc)
+            return (EAGAIN == errno or EWOULDBLOCK == errno) ? 0 : -1;
+    }
+}
+
+// there no close for udp, empty datagram tells echo side that flow is done, echo
+// side answers with empty one. Either may be lost, so fin is resent to flows,
+// which didn't confirm it in UDP_REPLY_TIMEOUT_NS. Returns false, if some didn't
+bool finish_udp_flows(const std::vector<int> & sockets) {
+    std::vector<pollfd> pending;
+    for(auto sock: sockets)
+        pending.push_back(pollfd{sock, POLLIN, 0});
+
+    size_t failed = 0;
+    for(int attempt = 0; attempt < UDP_FIN_RETRIES and not pending.empty(); ++attempt) {
+        for(const auto & pfd: pending)
+            send(pfd.fd, nullptr, 0, MSG_DONTWAIT);
+
+        unsigned long deadline = get_fast_time() + UDP_REPLY_TIMEOUT_NS;
+        for(unsigned long now = get_fast_time(); now < deadline and not pending.empty(); now = get_fast_time()) {
+            if (0 > poll(&pending[0], pending.size(), (deadline - now) / 1000000 + 1)) {
+                std::perror("poll(udp sockets) failed");
+                return false;
+            }
+
+            // finished flows are removed, order of the rest doesn't matter
+            for(size_t idx = pending.size(); idx > 0; --idx) {
+                pollfd & pfd = pending[idx - 1];
+                if (0 == pfd.revents)
+                    continue;
+                pfd.revents = 0;
+
+                int confirmed = udp_fin_confirmed(pfd.fd);
+                if (0 == confirmed)
+                    continue;
+                if (0 > confirmed)
+                    ++failed;
+                pfd = pending.back();
+                pending.pop_back();
+            }
+        }
+    }
+
+    failed += pending.size();
+    if (0 != failed)
+        std::cerr << failed << " udp flows didn't confirm fin\n";
+    return 0 == failed;
+}
+
+// sends conn.unsent_bytes of requests. All requests are the same, so any prefix
+// of message (one or more requests) may be send. Returns false on error, non zero
+// conn.unsent_bytes after return means socket is full and EPOLLOUT resumes it.
+// zc_stats - send with MSG_ZEROCOPY, message must stay alive till completion
+bool flush_requests(int fd, ConnState & conn, const std::string & message,
+                    ZeroCopyStats * zc_stats=nullptr) {
+    while(0 != conn.unsent_bytes) {
+        size_t chunk = std::min((size_t)conn.unsent_bytes, message.size());
+        long bc;
+        if (nullptr != zc_stats) {
+            unsigned long zc_sends = zc_stats->sends;
+            bc = send_zerocopy(fd, message.c_str(), chunk, *zc_stats);
+            if (zc_sends != zc_stats->sends and conn.zc_pending < USHRT_MAX)
+                conn.zc_pending++;
+        } else {
+            bc = send(fd, message.c_str(), chunk, MSG_DONTWAIT);
+        }
+
+        if (0 > bc) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno)
+                return true;
+            std::perror("send(fd, message, chunk, ...)");
+            return false;
+        }
+        conn.unsent_bytes -= bc;
+    }
+    return true;
+}
+
+// user + system time of all process threads
+unsigned long get_cpu_time() {
+    rusage usage;
+    if (0 != getrusage(RUSAGE_SELF, &usage)) {
+        std::perror("getrusage(RUSAGE_SELF, ...)");
+        return 0;
+    }
+    return ((unsigned long)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * BILLION +
+           ((unsigned long)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+inline void add_latency(TestResult * result, unsigned long lat_ns) {
+    result->lat_hist.record(lat_ns);
+}
+
+// time out of epoll_wait/io_uring_enter since construction goes to usage->busy_ns
+class BusyTimer {
+protected:
+    WorkerUsage * usage;
+    unsigned long start;
+    unsigned long last_wake;
+
+public:
+    BusyTimer(WorkerUsage * _usage): usage(_usage) {
+        start = last_wake = get_fast_time();
+        usage->busy_ns = 0;
+        usage->run_ns = 0;
+    }
+
+    ~BusyTimer() {
+        before_wait();
+    }
+
+    // returns time, spent since previous wake up
+    unsigned long before_wait() {
+        unsigned long now = get_fast_time();
+        unsigned long busy = now - last_wake;
+        usage->busy_ns += busy;
+        usage->run_ns = now - start;
+        last_wake = now;
+        return busy;
+    }
+
+    void after_wait() {
+        last_wake = get_fast_time();
+    }
+};
+
+// lock-free single producer/single consumer fd queue.
+// Producer and consumer indexes live on different cache lines
+class HandOffQueue {
+protected:
+    static const size_t CAPACITY = 256;
+    std::atomic<size_t> head;   // consumer position
+    char pad0[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;   // producer position
+    char pad1[64 - sizeof(std::atomic<size_t>)];
+    int fds[CAPACITY];
+
+public:
+    HandOffQueue(): head(0), tail(0) {}
+
+    size_t free_space() const {
+        return CAPACITY - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+    }
+
+    bool push(int fd) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        if (pos - head.load(std::memory_order_acquire) == CAPACITY)
+            return false;
+        fds[pos % CAPACITY] = fd;
+        tail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(int & fd) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        if (pos == tail.load(std::memory_order_acquire))
+            return false;
+        fd = fds[pos % CAPACITY];
+        head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// per worker data, used for connection rebalancing
+struct WorkerShare {
+    // worker, waiting for connections from this one, -1 - none. As every worker
+    // asks only one other at a time, inbox always has single producer
+    std::atomic<int> steal_request;
+    // busy fraction over last REBALANCE_INTERVAL_NS
+    std::atomic<int> load_permille;
+    char pad[64 - 2 * sizeof(std::atomic<int>)];
+    HandOffQueue inbox;
+
+    WorkerShare(): steal_request(-1), load_permille(0) {}
+};
+
+const unsigned long REBALANCE_INTERVAL_NS = 10 * 1000 * 1000;
+// worker asks for connections only if it's that idle
+const int REBALANCE_IDLE_PERMILLE = 700;
+// and victim is that much busier
+const int REBALANCE_MIN_GAP_PERMILLE = 100;
+const size_t REBALANCE_MAX_BATCH = 64;
+
+// work stealing for closed loop epoll workers. Idle worker asks the busiest one
+// for connections, which removes them from own epoll set and hands over via
+// receiver inbox. Connection state stays in shared ConnTable, only owner changes
+class ConnBalancer {
+protected:
+    int id;
+    std::vector<WorkerShare> * shares;
+    EPollRSelector * sel;
+    ConnTable * conns;
+    int events;
+    std::vector<int> owned;
+    int asked;
+    unsigned long interval_start;
+    unsigned long interval_busy;
+
+    WorkerShare & my() {return (*shares)[id];}
+
+    // fds in wait queue are kept, as their think time timers can't move
+    bool give(int receiver) {
+        int my_load = my().load_permille.load(std::memory_order_relaxed);
+        int receiver_load = (*shares)[receiver].load_permille.load(std::memory_order_relaxed);
+        if (my_load <= receiver_load or owned.size() < 2)
+            return true;
+
+        // move half of load difference
+        size_t count = owned.size() * (my_load - receiver_load) / (2 * my_load);
+        count = std::min(count, std::min(REBALANCE_MAX_BATCH, (*shares)[receiver].inbox.free_space()));
+
+        for(size_t idx = owned.size(); idx > 0 and count > 0; --idx) {
+            int fd = owned[idx - 1];
+            if ((*conns)[fd].flags & CONN_WAITING)
+                continue;
+
+            if (not sel->remove_fd(fd))
+                return false;
+
+            (*conns)[fd].worker = receiver;
+            (*shares)[receiver].inbox.push(fd);
+            owned[idx - 1] = owned.back();
+            owned.pop_back();
+            ++usage->conns_out;
+            --count;
+        }
+        return true;
+    }
+
+public:
+    WorkerUsage * usage;
+
+    ConnBalancer(int _id, std::vector<WorkerShare> * _shares, EPollRSelector * _sel,
+                 ConnTable * _conns, int _events, const std::vector<int> & fds, WorkerUsage * _usage):
+        id(_id), shares(_shares), sel(_sel), conns(_conns), events(_events), owned(fds),
+        asked(-1), interval_start(get_fast_time()), interval_busy(0), usage(_usage)
+    {
+        usage->conns_in = 0;
+        usage->conns_out = 0;
+    }
+
+    ~ConnBalancer() {
+        usage->conns = owned.size();
+    }
+
+    const std::vector<int> & owned_fds() const {return owned;}
+
+    // called once per worker loop, busy_ns - time spent out of epoll_wait since previous call
+    bool step(unsigned long busy_ns) {
+        int receiver = my().steal_request.load(std::memory_order_acquire);
+        if (0 <= receiver) {
+            if (not give(receiver))
+                return false;
+            my().steal_request.store(-1, std::memory_order_release);
+        }
+
+        int fd;
+        while(my().inbox.pop(fd)) {
+            // edge triggered epoll reports data, which came during hand off, on add
+            if (not sel->add_fd(fd, events))
+                return false;
+            owned.push_back(fd);
+            ++usage->conns_in;
+        }
+
+        if (0 <= asked and (*shares)[asked].steal_request.load(std::memory_order_acquire) != id)
+            asked = -1;
+
+        interval_busy += busy_ns;
+        unsigned long now = get_fast_time();
+        if (now - interval_start < REBALANCE_INTERVAL_NS)
+            return true;
+
+        int load = (int)(interval_busy * 1000 / (now - interval_start));
+        my().load_permille.store(load, std::memory_order_relaxed);
+        interval_start = now;
+        interval_busy = 0;
+
+        if (0 <= asked or load >= REBALANCE_IDLE_PERMILLE)
+            return true;
+
+        int victim = -1;
+        int victim_load = load + REBALANCE_MIN_GAP_PERMILLE;
+        for(int i = 0; i < (int)shares->size(); ++i) {
+            int other_load = (*shares)[i].load_permille.load(std::memory_order_relaxed);
+            if (i != id and other_load > victim_load) {
+                victim = i;
+                victim_load = other_load;
+            }
+        }
+
+        int no_request = -1;
+        if (0 <= victim and (*shares)[victim].steal_request.compare_exchange_strong(no_request, id))
+            asked = victim;
+        return true;
+    }
+};
+
+// what churning workers need to open replacement connections
+struct ChurnTarget {
+    Endpoints endpoints;
+    ConnectParams connect;
+    unsigned long after_msgs;
+    // time between reconnects of one worker, 0 - no rate
+    unsigned long interval_ns;
+};
+
+// closes and reopens connections of one worker: after every after_msgs messages
+// of a connection and/or once per interval_ns. Replacement gets connected first and
+// then takes fd of the old connection with dup2, so fd indexed state and fd lists
+// stay valid. Echo side gets new connection before old one is closed, so it
+// never sees all connections gone till the test end. Deferred (fastopen) connect
+// sends no SYN till the first request, so it replaces old fd only after that
+class ConnChurner {
+protected:
+    const ChurnTarget & target;
+    EPollRSelector * sel;
+    int events;
+    size_t addr_idx;
+    unsigned long next_time;
+    // connecting socket -> (replaced fd, connect start time)
+    std::unordered_map<int, std::pair<int, unsigned long>> connecting;
+    // replaced fd -> deferred connect socket, waiting for the first request
+    std::unordered_map<int, int> deferred;
+    ConnectStats * stats;
+
+    bool replace(int new_fd, int old_fd) {
+        // old socket is closed by dup2, remove it explicitly to not depend on when it's released
+        if (not sel->remove_fd(old_fd) or 0 > dup2(new_fd, old_fd)) {
+            std::perror("replacing connection");
+            close(new_fd);
+            return false;
+        }
+        close(new_fd);
+
+        stats->connects++;
+        return sel->add_fd(old_fd, events);
+    }
+
+public:
+    ConnChurner(const ChurnTarget & _target, EPollRSelector * _sel, int _events,
+                int worker_id, ConnectStats * _stats):
+        target(_target), sel(_sel), events(_events), addr_idx(worker_id),
+        next_time(0), stats(_stats)
+    {}
+
+    ~ConnChurner() {
+        for(const auto & item: connecting)
+            close(item.first);
+        for(const auto & item: deferred)
+            close(item.second);
+    }
+
+    // connection just got a reply, should it be replaced
+    bool due(const ConnState & conn, unsigned long curr_time) {
+        if (0 != target.after_msgs and 0 == conn.mcount % target.after_msgs)
+            return true;
+
+        if (0 == target.interval_ns)
+            return false;
+
+        if (0 == next_time) {
+            next_time = curr_time + target.interval_ns;
+            return false;
+        }
+
+        if (curr_time < next_time)
+            return false;
+
+        // reconnects, missed due to stalls, are dropped, not burst
+        next_time += target.interval_ns;
+        if (next_time < curr_time)
+            next_time = curr_time + target.interval_ns;
+        return true;
+    }
+
+    bool owns(int fd) const {
+        return not connecting.empty() and 0 != connecting.count(fd);
+    }
+
+    // starts replacement of fd, which shouldn't have requests in flight. Returns -1 on error,
+    // 1 if next request of fd goes to deferred (fastopen) connect socket, 0 - wait for complete
+    int start(int fd, unsigned long curr_time) {
+        bool connected = false;
+        int new_fd = start_connect(target.endpoints.dest(addr_idx), target.endpoints.client(addr_idx),
+                                   target.connect, connected);
+        ++addr_idx;
+        if (0 > new_fd)
+            return -1;
+
+        if (connected) {
+            stats->deferred_connects++;
+            deferred[fd] = new_fd;
+            return 1;
+        }
+
+        if (not sel->add_fd(new_fd, EPOLLOUT | EPOLLET)) {
+            close(new_fd);
+            return -1;
+        }
+        connecting[new_fd] = std::make_pair(fd, curr_time);
+        return 0;
+    }
+
+    // socket to send next request of fd to
+    int send_fd(int fd) const {
+        if (deferred.empty())
+            return fd;
+        auto item = deferred.find(fd);
+        return deferred.end() == item ? fd : item->second;
+    }
+
+    // first request went out with SYN of deferred connect, now it can replace fd
+    bool sent_deferred(int fd) {
+        auto item = deferred.find(fd);
+        int new_fd = item->second;
+        deferred.erase(item);
+        return replace(new_fd, fd);
+    }
+
+    // connecting socket became writable. Returns replaced fd, ready for request, or -1
+    int complete(int new_fd, unsigned long curr_time) {
+        auto item = connecting.find(new_fd);
+        int old_fd = item->second.first;
+        unsigned long start_time = item->second.second;
+        connecting.erase(item);
+
+        if (not check_socket_ready(new_fd) or not sel->remove_fd(new_fd)) {
+            close(new_fd);
+            return -1;
+        }
+        if (not replace(new_fd, old_fd))
+            return -1;
+        stats->lat_hist.record(curr_time - start_time);
+        return old_fd;
+    }
+};
+
+// message - constant request, sockets must be registered for EPOLLIN | EPOLLOUT.
+// With zerocopy it's send with MSG_ZEROCOPY, so must outlive all completions.
+// shares - if not null, connections (fds - initial ones) are rebalanced with other workers.
+// udp requests get own copy of message with sequence number and are resent, if lost
+void worker_thread(EPollRSelector * sel,
+                   ConnTable * conns,
+                   bool udp,
+                   int message_len,
+                   int sock_count,
+                   unsigned long timeout_ns_min,
+                   unsigned long timeout_ns_max,
+                   const std::string * message,
+                   bool zerocopy,
+                   int worker_id,
+                   const std::vector<int> * fds,
+                   std::vector<WorkerShare> * shares,
+                   const ChurnTarget * churn,
+                   int events,
+                   IntervalSlot * slot,
+                   Sync * sync,
+                   TestResult * result)
+{
+    result->mcount = 0;
+    std::memset(&result->zc, 0, sizeof(result->zc));
+    ZeroCopyStats * zc_stats = zerocopy ? &result->zc : nullptr;
+
+    std::mt19937 rand_gen;
+    std::uniform_int_distribution<unsigned long> rand_timeout(timeout_ns_min, timeout_ns_max);
+
+    bool has_timeout = (0 != timeout_ns_min) or (0 != timeout_ns_max);
+
+    // replies are only counted, so big messages are read in chunks into the same buffer
+    std::vector<char> buffer;
+    buffer.resize(std::min(message_len, MAX_RECV_CHUNK));
+
+    std::vector<int> ready_fds;
+    ready_fds.reserve(sock_count);
+
+    std::string udp_request(*message);
+
+    TimerWheel wait_queue(get_fast_time());
+
+    std::unique_ptr<ConnBalancer> balancer;
+    if (nullptr != shares)
+        balancer.reset(new ConnBalancer(worker_id, shares, sel, conns, events, *fds, &result->usage));
+
+    std::unique_ptr<ConnChurner> churner;
+    if (nullptr != churn)
+        churner.reset(new ConnChurner(*churn, sel, events, worker_id, &result->churn));
+
+    sync->active_count++;
+    DecOnExit exitor(&sync->active_count);
+
+    unsigned long own_start = sync->arrive_and_wait();
+    result->usage.start_lag_ns = own_start - std::min(own_start, sync->start_time());
+
+    BusyTimer busy_timer(&result->usage);
+    unsigned long next_loss_check = get_fast_time() + UDP_REPLY_TIMEOUT_NS;
+
+    for(;;) {
+        ready_fds.clear();
+        unsigned long curr_time;
+
+        unsigned long busy_ns = busy_timer.before_wait();
+        if (balancer and not balancer->step(busy_ns))
+            return;
+
+        // if there a ready sockets, waiting for timeout
+        // need to not sleep too long in epoll
+        if (not wait_queue.empty()) {
+            curr_time = get_fast_time();
+            long int poll_timeout = wait_queue.next_timeout(curr_time);
+
+            if (not sel->wait(poll_timeout))
+                return;
+            busy_timer.after_wait();
+
+            // fill ready_fds with sockets
+            // with expired timeouts
+            curr_time = get_fast_time();
+            wait_queue.expire(curr_time, ready_fds);
+        } else {
+            if (not sel->wait(100 * 1000 * 1000))
+                return;
+            busy_timer.after_wait();
+            curr_time = get_fast_time();
+        }
+
+        // stop is checked once per round, not per connection
+        slot->publish(result->mcount);
+        if (sync->stopped())
+            return;
+
+        if (udp and curr_time >= next_loss_check) {
+            next_loss_check = curr_time + UDP_REPLY_TIMEOUT_NS;
+            if (not resend_lost_udp(balancer ? balancer->owned_fds() : *fds, *conns, udp_request,
+                                    curr_time, result))
+                return;
+        }
+
+        // go throught all polled fds, calculated latency
+        // and move some to wait_queue
+
+        int fd;
+        uint32_t events;
+        while(sel->next(fd, events)) {
+            // replacement connection is ready, old one is closed
+            if (churner and churner->owns(fd)) {
+                int old_fd = churner->complete(fd, curr_time);
+                if (0 > old_fd)
+                    return;
+                ready_fds.push_back(old_fd);
+                continue;
+            }
+
+            auto & conn = (*conns)[fd];
+
+            // zerocopy completions are reported as EPOLLERR
+            if (events & EPOLLERR) {
+                long completed = read_zerocopy_completions(fd, result->zc);
+                if (0 > completed) {
+                    std::perror("socket error");
+                    return;
+                }
+                conn.zc_pending -= std::min<long>(completed, conn.zc_pending);
+            }
+
+            // socket buffer got free space - continue with the rest of request
+            if ((events & EPOLLOUT) and not flush_requests(fd, conn, *message, zc_stats))
+                return;
+
+            if (not (events & EPOLLIN))
+                continue;
+
+            int done = udp ? recv_udp_reply(fd, conn, buffer, message_len) :
+                             recv_reply(fd, conn, buffer, message_len);
+            if (0 > done)
+                return;
+            if (0 == done)
+                continue;
+
+            result->mcount++;
+
+            // reply came, so handshake of deferred reconnect is done
+            if (conn.flags & CONN_DEFERRED) {
+                conn.flags &= ~CONN_DEFERRED;
+                if (syn_data_acked(fd))
+                    result->churn.fastopen_connects++;
+            }
+
+            // previous write time for curr socket
+            auto ltime = conn.last_send_ns;
+
+            // if have previous write time for curr socket
+            if (0 != ltime)
+                add_latency(result, curr_time - ltime);
+            conn.in_flight = 0;
+
+            // next request goes to the new connection
+            if (churner and churner->due(conn, curr_time)) {
+                int started = churner->start(fd, curr_time);
+                if (0 > started)
+                    return;
+                if (1 == started) {
+                    conn.flags |= CONN_DEFERRED;
+                    ready_fds.push_back(fd);
+                }
+                continue;
+            }
+
+            // if has timeout
+            if (has_timeout) {
+                unsigned long timeout_ns = 0;
+                if (timeout_ns_max != timeout_ns_min) {
+                    timeout_ns = rand_timeout(rand_gen);
+                } else {
+                    timeout_ns = timeout_ns_max;
+                }
+
+                // if socket isn't ready for new ping yet
+                // put it into wait_queue
+                if (ltime + timeout_ns > curr_time) {
+                    wait_queue.add(fd, ltime + timeout_ns);
+                    conn.flags |= CONN_WAITING;
+                    continue;
+                }
+            }
+
+            ready_fds.push_back(fd);
+        }
+
+        for(auto fd: ready_fds) {
+            auto & conn = (*conns)[fd];
+            conn.last_send_ns = get_fast_time();
+            if (udp) {
+                if (not send_udp_request(fd, udp_request, conn.mcount))
+                    return;
+            } else {
+                conn.unsent_bytes += message_len;
+                int send_fd = churner ? churner->send_fd(fd) : fd;
+                if (not flush_requests(send_fd, conn, *message, zc_stats))
+                    return;
+                // tail, if any, is sent on EPOLLOUT of fd, which is the new socket now
+                if (send_fd != fd and not churner->sent_deferred(fd))
+                    return;
+            }
+
+            conn.mcount++;
+            conn.in_flight = 1;
+            conn.flags &= ~CONN_WAITING;
+        }
+    }
+}
+
+// reads all replies, available in socket, as required by edge triggered epoll
+class ReplyReader {
+protected:
+    int message_len;
+    bool udp;
+    std::vector<char> buffer;
+    std::vector<iovec> iovs;
+    std::vector<mmsghdr> msgs;
+
+public:
+    // sequence numbers of udp replies, got by the last drain
+    std::vector<unsigned long> seqs;
+
+    ReplyReader(int _message_len, int batch, bool _udp):
+        message_len(_message_len), udp(_udp), iovs(batch), msgs(batch)
+    {
+        // tcp replies are only counted, so one chunk is enough
+        if (not udp) {
+            buffer.resize(std::min((size_t)message_len * batch, (size_t)MAX_RECV_CHUNK));
+            return;
+        }
+
+        buffer.resize((size_t)message_len * batch);
+        for(int i = 0; i < batch; ++i) {
+            iovs[i].iov_base = &buffer[(size_t)i * message_len];
+            iovs[i].iov_len = message_len;
+        }
+    }
+
+    // returns amount of full messages or -1 on error.
+    // tail of partially received tcp message is accounted in partial
+    int drain(int fd, int & partial) {
+        int replies = 0;
+        seqs.clear();
+        for(;;) {
+            int bc;
+            if (udp) {
+                for(size_t i = 0; i < msgs.size(); ++i) {
+                    std::memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                bc = recvmmsg(fd, &msgs[0], msgs.size(), MSG_DONTWAIT, nullptr);
+            } else {
+                bc = recv(fd, &buffer[0], buffer.size(), MSG_DONTWAIT);
+            }
+
+            if (0 > bc and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+                return replies;
+            } else if (0 > bc) {
+                if (ECONNRESET != errno)
+                    std::perror("recv(fd, &buffer[0], buff_sz, 0)");
+                return -1;
+            } else if (0 == bc) {
+                perror("recv 0 bytes");
+                return -1;
+            }
+
+            if (udp) {
+                for(int i = 0; i < bc; ++i) {
+                    if (message_len != (int)msgs[i].msg_len) {
+                        std::cerr << "partial message\n";
+                        return -1;
+                    }
+                    seqs.push_back(get_seq(&buffer[(size_t)i * message_len]));
+                }
+                replies += bc;
+            } else {
+                partial += bc;
+                replies += partial / message_len;
+                partial %= message_len;
+            }
+        }
+    }
+};
+
+// position of fd in the own fds list of a worker. Workers get contiguous
+// fd ranges, so index only covers [min fd, max fd] of the own ones
+class FdIndex {
+protected:
+    int first_fd;
+    std::vector<int> positions;
+
+public:
+    explicit FdIndex(const std::vector<int> & fds): first_fd(0) {
+        if (fds.empty())
+            return;
+        auto range = std::minmax_element(fds.begin(), fds.end());
+        first_fd = *range.first;
+        positions.assign(*range.second - first_fd + 1, -1);
+        for(size_t pos = 0; pos < fds.size(); ++pos)
+            positions[fds[pos] - first_fd] = (int)pos;
+    }
+
+    int operator[](int fd) const {return positions[fd - first_fd];}
+};
+
+// send times of messages in flight, oldest first, as a fixed ring per own
+// connection. Allocated once before test, nothing is allocated on send/recv
+class SendTimes {
+protected:
+    struct Ring {
+        unsigned head;
+        unsigned count;
+    };
+
+    FdIndex index;
+    unsigned capacity;
+    std::vector<Ring> rings;
+    std::vector<unsigned long> times;
+
+public:
+    SendTimes(const std::vector<int> & fds, unsigned _capacity):
+        index(fds), capacity(_capacity), rings(fds.size(), Ring{0, 0}),
+        times(fds.size() * _capacity)
+    {}
+
+    // false, if connection already has capacity messages in flight
+    bool push(int fd, unsigned long time) {
+        int pos = index[fd];
+        Ring & ring = rings[pos];
+        if (ring.count == capacity)
+            return false;
+        times[(size_t)pos * capacity + (ring.head + ring.count) % capacity] = time;
+        ++ring.count;
+        return true;
+    }
+
+    bool pop(int fd, unsigned long & time) {
+        int pos = index[fd];
+        Ring & ring = rings[pos];
+        if (0 == ring.count)
+            return false;
+        time = times[(size_t)pos * capacity + ring.head];
+        ring.head = (ring.head + 1) % capacity;
+        --ring.count;
+        return true;
+    }
+
+    unsigned size(int fd) const {return rings[index[fd]].count;}
+};
+
+// keeps depth messages in flight on every socket. All replies,
+// available in socket, are read at once, and same amount of new requests
+// is send with one send (sendmmsg for udp). Tail, not accepted by socket,
+// is send on EPOLLOUT. udp replies are matched to requests by sequence,
+// requests, skipped by replies, are lost and get replaced by new ones
+void worker_thread_pipeline(EPollRSelector * sel,
+                            ConnTable * conns,
+                            const std::vector<int> * fds,
+                            int message_len,
+                            int depth,
+                            bool udp,
+                            IntervalSlot * slot,
+                            Sync * sync,
+                            TestResult * result)
+{
+    // first depth messages are send by run_test before start, their
+    // replies keep queue order, but aren't measured
+    SendTimes send_times(*fds, depth);
+    for(auto fd: *fds)
+        for(int i = 0; i < depth; ++i)
+            send_times.push(fd, 0);
+    result->mcount = 0;
+
+    ReplyReader reader(message_len, depth, udp);
+    std::string message((size_t)message_len, 'X');
+    std::string requests((size_t)message_len * depth, 'X');
+    std::vector<iovec> iovs(depth);
+    std::vector<mmsghdr> msgs(depth);
+
+    // udp requests differ by sequence number, so each has own place in requests
+    for(int i = 0; i < depth; ++i) {
+        iovs[i].iov_base = &requests[(size_t)i * message_len];
+        iovs[i].iov_len = message_len;
+    }
+
+    sync->active_count++;
+    DecOnExit exitor(&sync->active_count);
+
+    unsigned long own_start = sync->arrive_and_wait();
+    result->usage.start_lag_ns = own_start - std::min(own_start, sync->start_time());
+
+    BusyTimer busy_timer(&result->usage);
+    unsigned long next_loss_check = get_fast_time() + UDP_REPLY_TIMEOUT_NS;
+
+    for(;;) {
+        busy_timer.before_wait();
+        if (not sel->wait(100 * 1000 * 1000))
+            return;
+        busy_timer.after_wait();
+
+        slot->publish(result->mcount);
+        if (sync->stopped())
+            return;
+
+        unsigned long curr_time = get_fast_time();
+
+        if (udp and curr_time >= next_loss_check) {
+            next_loss_check = curr_time + UDP_REPLY_TIMEOUT_NS;
+            if (not resend_lost_udp(*fds, *conns, message, curr_time, result))
+                return;
+        }
+
+        int fd;
+        uint32_t events;
+        while(sel->next(fd, events)) {
+            auto & conn = (*conns)[fd];
+            if ((events & EPOLLOUT) and not flush_requests(fd, conn, requests))
+                return;
+
+            int replies = reader.drain(fd, conn.partial_bytes);
+            if (0 > replies)
+                return;
+
+            // one per reply, for udp - also one per lost request
+            int new_requests = 0;
+            unsigned long send_time = 0;
+            if (udp) {
+                replies = 0;
+                for(auto seq: reader.seqs) {
+                    unsigned long oldest = conn.mcount - send_times.size(fd);
+                    // late reply of resent request
+                    if (seq < oldest or seq >= conn.mcount)
+                        continue;
+
+                    // datagrams of one flow keep order, so requests before this one are lost
+                    result->udp_lost += seq - oldest;
+                    for(; oldest <= seq; ++oldest, ++new_requests)
+                        send_times.pop(fd, send_time);
+                    if (0 != send_time)
+                        add_latency(result, curr_time - send_time);
+                    ++replies;
+                }
+            } else {
+                for(int i = 0; i < replies and send_times.pop(fd, send_time); ++i)
+                    if (0 != send_time)
+                        add_latency(result, curr_time - send_time);
+                new_requests = replies;
+            }
+
+            result->mcount += replies;
+            if (0 == new_requests)
+                continue;
+
+            if (udp) {
+                for(int i = 0; i < new_requests; ++i) {
+                    put_seq(&requests[(size_t)i * message_len], conn.mcount + i);
+                    std::memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                // not sent ones are resent on timeout
+                if (0 > sendmmsg(fd, &msgs[0], new_requests, MSG_DONTWAIT) and
+                        EAGAIN != errno and EWOULDBLOCK != errno) {
+                    std::perror("sendmmsg(fd, msgs, new_requests, MSG_DONTWAIT)");
+                    return;
+                }
+            } else {
+                conn.unsent_bytes += new_requests * message_len;
+                if (not flush_requests(fd, conn, requests))
+                    return;
+            }
+
+            send_time = get_fast_time();
+            for(int i = 0; i < new_requests; ++i)
+                send_times.push(fd, send_time);
+
+            conn.last_send_ns = send_time;
+            conn.mcount += new_requests;
+            conn.in_flight = std::min<unsigned>(send_times.size(fd), USHRT_MAX);
+        }
+    }
+}
+
+// max requests, send by one worker between two epoll_wait
+const int MAX_SEND_BURST = 1024;
+
+// open loop: requests are send by schedule, not waiting for replies.
+// Latency is measured from intended send time, so echo side stall
+// can't hide itself by delaying next requests (coordinated omission).
+// tcp keeps order and loses nothing, so n-th reply of connection is for its
+// n-th request. udp may lose or reorder, so request carries own number and
+// reply is matched by it, lost ones are just not counted
+void worker_thread_rate(EPollRSelector * sel,
+                        ConnTable * conns,
+                        const std::vector<int> * fds,
+                        int message_len,
+                        double rate,
+                        bool udp,
+                        IntervalSlot * slot,
+                        Sync * sync,
+                        TestResult * result)
+{
+    // requests go to own connections round robin, so n-th request of connection
+    // is request number n * fds->size() + position of connection in fds, and
+    // its intended send time is known without any per-message state
+    FdIndex positions(*fds);
+    const unsigned long conn_count = fds->size();
+    result->mcount = 0;
+
+    ReplyReader reader(message_len, 64, udp);
+    std::string message((size_t)message_len, 'X');
+    const double interval_ns = BILLION / rate;
+
+    sync->active_count++;
+    DecOnExit exitor(&sync->active_count);
 
-    std::vector<char> buffer;
-    buffer.resize(message_len);
+    unsigned long own_start = sync->arrive_and_wait();
+    result->usage.start_lag_ns = own_start - std::min(own_start, sync->start_time());
 
-    sync->active_count++;
+    BusyTimer busy_timer(&result->usage);
 
-    // inhouse barrier implementation
-    sync->run_lola_run.lock();
-    sync->run_lola_run.unlock();
+    const unsigned long start_time = get_fast_time();
+    unsigned long sent = 0;
+    unsigned long next_send = start_time;
 
     for(;;) {
-        if (not sel->wait(100 * 1000 * 1000))
+        unsigned long curr_time = get_fast_time();
+        long int wait_ns = (next_send > curr_time) ? next_send - curr_time : 0;
+
+        busy_timer.before_wait();
+        if (not sel->wait(wait_ns))
             return;
+        busy_timer.after_wait();
 
-        if (sync->done.load())
+        slot->publish(result->mcount);
+        if (sync->stopped())
             return;
 
+        curr_time = get_fast_time();
+
         int fd;
-        result->mcount += sel->ready_count();
-        while(sel->next(fd)) {
-            if (not ping(fd, &buffer[0], message_len))
+        uint32_t events;
+        while(sel->next(fd, events)) {
+            auto & conn = (*conns)[fd];
+            if ((events & EPOLLOUT) and not flush_requests(fd, conn, message))
+                return;
+
+            int replies = reader.drain(fd, conn.partial_bytes);
+            if (0 > replies)
                 return;
+
+            unsigned long pos = positions[fd];
+            unsigned long conn_sent = sent / conn_count + (pos < sent % conn_count ? 1 : 0);
+            auto intended_time = [&](unsigned long idx) {
+                return start_time + (unsigned long)((idx * conn_count + pos) * interval_ns);
+            };
+
+            if (udp) {
+                for(auto idx: reader.seqs)
+                    if (idx < conn_sent)
+                        add_latency(result, curr_time - intended_time(idx));
+            } else {
+                for(unsigned long idx = conn.mcount; idx < conn.mcount + replies and idx < conn_sent; ++idx)
+                    add_latency(result, curr_time - intended_time(idx));
+            }
+
+            result->mcount += replies;
+            conn.mcount += replies;
+            conn.in_flight = std::min<unsigned long>(conn_sent - std::min(conn_sent, conn.mcount), USHRT_MAX);
+        }
+
+        // send all requests, which time has come, even if we are late.
+        // If echo side can't keep up, tcp requests are queued in conn.unsent_bytes
+        for(int burst = 0; next_send <= curr_time and burst < MAX_SEND_BURST; ++burst) {
+            int fd = (*fds)[sent % fds->size()];
+            auto & conn = (*conns)[fd];
+
+            if (udp) {
+                // request number of connection
+                put_seq(&message[0], sent / conn_count);
+                if (message_len != write(fd, message.c_str(), message_len)) {
+                    if (EAGAIN == errno or EWOULDBLOCK == errno)
+                        std::cerr << "Send buffer is full, echo side can't handle requested rate\n";
+                    else
+                        std::perror("write(fd, message, ...)");
+                    return;
+                }
+            } else {
+                conn.unsent_bytes += message_len;
+                if (not flush_requests(fd, conn, message))
+                    return;
+            }
+
+            conn.last_send_ns = next_send;
+            if (conn.in_flight < USHRT_MAX)
+                conn.in_flight++;
+            ++sent;
+            next_send = start_time + (unsigned long)(sent * interval_ns);
         }
     }
 }
 
-void worker_thread(EPollRSelector * sel,
-                   int message_len,
-                   int sock_count,
-                   unsigned long timeout_ns_min,
-                   unsigned long timeout_ns_max,
-                   Sync * sync,
-                   TestResult * result)
+const unsigned short URING_BGID = 0;
+
+// same as worker_thread, but all recv/send goes via io_uring
+// and completions are reaped in batches. Think time is
+// implemented with kernel timeouts, linked to send.
+void worker_thread_uring(URing * ring,
+                         ConnTable * conns,
+                         int message_len,
+                         unsigned long timeout_ns_min,
+                         unsigned long timeout_ns_max,
+                         IntervalSlot * slot,
+                         Sync * sync,
+                         TestResult * result)
 {
-    std::unordered_map<int, unsigned long> last_time_for_socket;
+    // kernel reads timeout from here, when delay sqe is submitted
+    std::vector<__kernel_timespec> delays(conns->size());
     result->mcount = 0;
 
     std::mt19937 rand_gen;
@@ -370,124 +2776,142 @@ void worker_thread(EPollRSelector * sel,
 
     bool has_timeout = (0 != timeout_ns_min) or (0 != timeout_ns_max);
 
-    std::vector<char> buffer;
-    buffer.resize(message_len);
-
-    std::vector<int> ready_fds;
-    ready_fds.reserve(sock_count);
+    std::string message((size_t)message_len, 'X');
 
-    std::priority_queue<FdTimout> wait_queue;
+    // sockets with send queued, but not yet submitted
+    std::vector<int> sent_fds;
 
     sync->active_count++;
     DecOnExit exitor(&sync->active_count);
 
-    // inhouse barrier implementation
-    sync->run_lola_run.lock();
-    sync->run_lola_run.unlock();
-
-    for(;;) {
-        ready_fds.clear();
-        unsigned long curr_time;
-
-        // if there a ready sockets, waiting for timeout
-        // need to not sleep too long in epoll
-        if (wait_queue.size() > 0) {
-            curr_time = get_fast_time();
-            long int poll_timeout = wait_queue.top().ready_time - curr_time;
+    unsigned long own_start = sync->arrive_and_wait();
+    result->usage.start_lag_ns = own_start - std::min(own_start, sync->start_time());
 
-            if (poll_timeout < 0)
-                poll_timeout = 0;
+    BusyTimer busy_timer(&result->usage);
 
-            if (not sel->wait(poll_timeout))
-                return;
+    io_uring_cqe cqe;
+    for(;;) {
+        // io_uring_enter would send all queued messages
+        unsigned long send_time = get_fast_time();
+        for(auto fd: sent_fds)
+            (*conns)[fd].last_send_ns = send_time;
+        sent_fds.clear();
+
+        busy_timer.before_wait();
+        if (not ring->submit(1, 100 * 1000 * 1000))
+            return;
+        busy_timer.after_wait();
 
-            // fill ready_fds with sockets
-            // with expired timeouts
-            curr_time = get_fast_time();
-            while(wait_queue.size() > 0) {
-                auto & item = wait_queue.top();
-                // if timeout expires - remove from timeout_wait_queue
-                // and put to ready_fds
-                if (item.ready_time <= curr_time) {
-                    ready_fds.push_back(item.fd);
-                    wait_queue.pop();
-                } else
-                    break;
-            }
-        } else {
-            if (not sel->wait(100 * 1000 * 1000))
-                return;
-            curr_time = get_fast_time();
-        }
+        slot->publish(result->mcount);
+        if (sync->stopped())
+            return;
 
+        unsigned long curr_time = get_fast_time();
 
-        if (sync->done.load())
-            return;
+        while(ring->next(cqe)) {
+            int fd = uring_tag_fd(cqe.user_data);
 
-        // go throught all polled fds, calculated latency
-        // and move some to wait_queue
+            if (cqe.user_data & URING_SEND_TAG) {
+                int size = (int)uring_send_size(cqe.user_data);
+                if (0 > cqe.res and -EAGAIN != cqe.res) {
+                    std::cerr << "send failed: " << std::strerror(-cqe.res) << "\n";
+                    return;
+                }
 
-        result->mcount += sel->ready_count();
+                // short send - resubmit the rest of request
+                if (cqe.res < size) {
+                    unsigned rest = size - std::max(cqe.res, 0);
+                    io_uring_sqe * sqe = ring->get_sqe();
+                    if (nullptr == sqe)
+                        return;
+                    uring_prep_rw(sqe, IORING_OP_SEND, fd, message.c_str(), rest,
+                                  uring_send_tag(fd, rest));
+                }
+                continue;
+            }
 
-        int fd;
-        while(sel->next(fd)) {
-            auto item = last_time_for_socket.emplace(fd, 0);
+            auto & conn = (*conns)[fd];
 
-            // previous write time for curr socket
-            auto ltime = item.first->second;
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+                ring->recycle_buf((unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
 
-            // if have previous write time for curr socket
-            if (not item.second) {
+            if (-ENOBUFS == cqe.res) {
+                // multishot recv get terminated, rearm below
+            } else if (0 > cqe.res) {
+                if (-ECONNRESET != cqe.res)
+                    std::cerr << "recv failed: " << std::strerror(-cqe.res) << "\n";
+                return;
+            } else if (0 == cqe.res) {
+                std::cerr << "recv 0 bytes\n";
+                return;
+            } else if ((conn.partial_bytes += cqe.res) < message_len) {
+                // reply came in parts, wait for the rest
+            } else {
+                conn.partial_bytes = 0;
+                result->mcount++;
 
-                #ifdef LOG2_LAT
-                int tout_l2 = (int)log2_64(curr_time - ltime);
-                #else
-                int tout_l2 = std::lround(std::log2((float)(curr_time - ltime)) * 10);
-                #endif
+                auto ltime = conn.last_send_ns;
 
-                result->lat_map.emplace(tout_l2, 0).first->second++;
-            }
+                if (0 != ltime)
+                    add_latency(result, curr_time - ltime);
 
-            // if has timeout
-            if (has_timeout) {
                 unsigned long timeout_ns = 0;
-                if (timeout_ns_max != timeout_ns_min) {
-                    timeout_ns = rand_timeout(rand_gen);
-                } else {
-                    timeout_ns = timeout_ns_max;
+                if (has_timeout) {
+                    if (timeout_ns_max != timeout_ns_min) {
+                        timeout_ns = rand_timeout(rand_gen);
+                    } else {
+                        timeout_ns = timeout_ns_max;
+                    }
                 }
 
-                // if socket isn't ready for new ping yet
-                // put it into wait_queue
                 if (ltime + timeout_ns > curr_time) {
-                    wait_queue.emplace(fd, ltime + timeout_ns);
-                    continue;
+                    io_uring_sqe * sqe = ring->get_sqe();
+                    if (nullptr == sqe)
+                        return;
+                    uring_prep_delay(sqe, &delays[fd], ltime + timeout_ns - curr_time);
+                    conn.last_send_ns = ltime + timeout_ns;
+                } else {
+                    sent_fds.push_back(fd);
                 }
-            }
-
-            ready_fds.push_back(fd);
-            if (sync->done.load())
-                return;
-        }
-
-        for(auto fd: ready_fds) {
-            if (sync->done.load())
-                return;
 
-            if (not ping(fd, &buffer[0], message_len))
-                return;
+                io_uring_sqe * sqe = ring->get_sqe();
+                if (nullptr == sqe)
+                    return;
+                uring_prep_rw(sqe, IORING_OP_SEND, fd, message.c_str(), message_len,
+                              uring_send_tag(fd, message_len));
+                conn.mcount++;
+            }
 
-            last_time_for_socket[fd] = get_fast_time();
-            result->mess_count_for_sock.emplace(fd, 0).first->second++;
+            if (not (cqe.flags & IORING_CQE_F_MORE)) {
+                io_uring_sqe * sqe = ring->get_sqe();
+                if (nullptr == sqe)
+                    return;
+                uring_prep_recv_multishot(sqe, fd, URING_BGID, fd);
+            }
         }
     }
 }
 
-bool run_test(const TestParams & params, TestResult & res, int worker_threads,
-              const char ** first_ip, const char ** last_ip)
+// active share of connections, spread evenly over connection order, so active
+// ones go from all client addresses to all destinations
+void select_active(const std::vector<int> & fds, double active_frac, std::vector<int> & active) {
+    active.clear();
+    size_t active_count = std::max((size_t)1, (size_t)(fds.size() * active_frac + 0.5));
+    for(size_t i = 0; i < fds.size(); ++i)
+        if ((i + 1) * active_count / fds.size() != i * active_count / fds.size())
+            active.push_back(fds[i]);
+}
+
+// on_interval - if not null, gets stats every params.interval_ms while test runs
+// wait_start - if not null, called once connections are ready, returns CLOCK_REALTIME
+//              to start the test at, 0 - at once
+bool run_test(const TestParams & params, TestResult & res,
+              const char ** first_ip, const char ** last_ip,
+              std::function<void(const IntervalStats &)> * on_interval=nullptr,
+              std::function<bool(unsigned long &)> * wait_start=nullptr)
 {
     FDList sockets;
-    std::vector<sockaddr_in> client_ip_addrs;
+    Endpoints endpoints;
 
     struct sockaddr_in localaddr;
     localaddr.sin_family = AF_INET;
@@ -495,121 +2919,521 @@ bool run_test(const TestParams & params, TestResult & res, int worker_threads,
 
     for(; first_ip != last_ip; ++first_ip) {
         localaddr.sin_addr.s_addr = inet_addr(*first_ip);
-        client_ip_addrs.push_back(localaddr);
+        endpoints.clients.push_back(localaddr);
     }
 
-    if (not connect_all(params.num_conn, sockets.fds, params.ip, params.port, client_ip_addrs))
+    // socket per connection, the rest is for pipes, epoll and io_uring fds
+    if (not raise_nofile_limit((unsigned long)params.num_conn + RESERVED_FDS))
         return false;
 
-    std::vector<EPollRSelector> selectors;
-    selectors.reserve(worker_threads); // avoid move, as EPollRSelector would close fd
+    // bound client port is reserved for all destinations, so they only help without it
+    ConnectParams cparams = params.connect;
+    if (not params.udp) {
+        if (not resolve_dests(params, endpoints.dests))
+            return false;
+        if (endpoints.dests.size() > 1)
+            cparams.bind_no_port = true;
 
-    worker_threads = std::min(params.num_conn, worker_threads);
-    int max_sock_count_per_worker = params.num_conn / worker_threads + 1;
+        unsigned long capacity = endpoints.capacity(cparams.bind_no_port);
+        if (0 != capacity and capacity < (unsigned long)params.num_conn) {
+            std::cerr << "Only ~" << capacity << " connections fit into ephemeral port ranges. ";
+            std::cerr << "Add client ips, destinations or widen net.ipv4.ip_local_port_range\n";
+        }
+    }
 
-    for(int i = 0; i < worker_threads ; ++i) {
-        selectors.emplace_back(max_sock_count_per_worker);
-        if (not selectors.rbegin()->ok())
+    sample_memory(res.mem_before);
+    res.mem_open = res.mem_before;
+    res.start_realtime_ns = 0;
+    res.connect.connects = 0;
+    res.connect.deferred_connects = 0;
+    res.connect.fastopen_connects = 0;
+    res.connect.wall_ns = 0;
+    res.connect.lat_hist = LatHistogram(params.lat_digits);
+    res.churn.connects = 0;
+    res.churn.deferred_connects = 0;
+    res.churn.fastopen_connects = 0;
+    res.churn.wall_ns = 0;
+    res.churn.lat_hist = LatHistogram(params.lat_digits);
+
+    if (params.udp) {
+        if (not connect_all_udp(params.num_conn, sockets.fds, params.ip, params.port, endpoints.clients))
             return false;
+    } else if (not connect_all(params.num_conn, sockets.fds, endpoints, cparams, res.connect))
+        return false;
+
+    // nothing was sent, echo side would get EOF as sockets get closed
+    if (params.connect_only) {
+        res.mcount = 0;
+        res.avg_lat_ns = 0;
+        res.percentiles.fill(0);
+        res.lat_percentiles.fill(0);
+        res.lat_hist = LatHistogram(params.lat_digits);
+        res.cpu_ns = 0;
+        res.wait = params.wait;
+        res.wakeups = 0;
+        res.spurious_wakeups = 0;
+        std::memset(&res.zc, 0, sizeof(res.zc));
+        res.worker_cpus.clear();
+        res.usage = WorkerUsage();
+        res.worker_usage.clear();
+        res.conn_mcount.assign(params.num_conn, 0);
+        res.udp_lost = 0;
+        sample_memory(res.mem_open);
+        return true;
     }
 
+    // only these get messages, workers never see idle ones
+    std::vector<int> active_fds;
+    select_active(sockets.fds, params.active_frac, active_fds);
+
+    std::vector<EPollRSelector> selectors;
+    selectors.reserve(params.workers); // avoid move, as EPollRSelector would close fd
+    std::vector<std::unique_ptr<URing>> rings;
+
+    int worker_threads = std::min((int)active_fds.size(), params.workers);
+    int max_sock_count_per_worker = active_fds.size() / worker_threads + 1;
+    bool use_uring = (WorkerEngine::EPOLL != params.engine);
+    // EPOLLOUT resumes requests, which didn't fit into socket buffer
+    const int sock_events = params.udp ? EPOLLIN | EPOLLET : EPOLLIN | EPOLLOUT | EPOLLET;
+
+    ConnTable conns;
+    if (not conns.resize(*std::max_element(active_fds.begin(), active_fds.end()) + 1))
+        return false;
+
+    // open loop workers send requests to own sockets by themselves
+    std::vector<std::vector<int>> worker_fds(worker_threads);
+
+    // contiguous ranges, so neighbour states in conns belongs to the same worker
     int idx = 0;
-    for(auto fd: sockets.fds) {
-        auto & sel = selectors[idx % worker_threads];
-        if (not sel.add_fd(fd))
+    for(auto fd: active_fds) {
+        int worker = (long)idx * worker_threads / active_fds.size();
+        worker_fds[worker].push_back(fd);
+        conns[fd].flags = CONN_ACTIVE;
+        conns[fd].worker = worker;
+
+        if (params.zerocopy and not enable_zerocopy(fd))
             return false;
         ++idx;
     }
 
-    std::vector<TestResult> tresults;
-    tresults.resize(worker_threads);
+    // empty - worker isn't pinned
+    std::vector<std::vector<int>> worker_cpus(worker_threads);
+    if (not params.cpus.empty())
+        for(int i = 0; i < worker_threads ; ++i)
+            worker_cpus[i] = params.cpus[i % params.cpus.size()];
+
+    {
+        // kernel allocates epoll and io_uring state on node of calling cpu,
+        // so they are created while this thread runs on worker cpus
+        AffinityGuard affinity_guard;
+
+        for(int i = 0; i < worker_threads ; ++i) {
+            if (not worker_cpus[i].empty() and not pin_current_thread(worker_cpus[i]))
+                return false;
+
+            if (use_uring) {
+                rings.emplace_back(new URing(4096, WorkerEngine::URING_SQPOLL == params.engine));
+                if (not rings.back()->ok())
+                    return false;
+
+                // only one message in flight per socket, big replies are received in chunks
+                if (not rings.back()->setup_buf_ring(URING_BGID,
+                                                     max_sock_count_per_worker,
+                                                     std::min(params.message_len, MAX_RECV_CHUNK)))
+                    return false;
+
+                for(auto fd: worker_fds[i]) {
+                    io_uring_sqe * sqe = rings.back()->get_sqe();
+                    if (nullptr == sqe)
+                        return false;
+                    uring_prep_recv_multishot(sqe, fd, URING_BGID, fd);
+                }
+
+                if (not rings.back()->submit())
+                    return false;
+            } else {
+                selectors.emplace_back(max_sock_count_per_worker, params.wait);
+                if (not selectors.rbegin()->ok() or not selectors.rbegin()->set_busy_poll(params.busy_poll))
+                    return false;
+
+                for(auto fd: worker_fds[i])
+                    if (not selectors.rbegin()->add_fd(fd, sock_events))
+                        return false;
+            }
+
+            // connection states of worker range follow it to its node
+            int node = worker_cpus[i].empty() ? -1 : cpu_numa_node(worker_cpus[i][0]);
+            if (0 <= node and not worker_fds[i].empty()) {
+                auto range = std::minmax_element(worker_fds[i].begin(), worker_fds[i].end());
+                bind_memory_to_node(&conns[*range.first],
+                                    (*range.second - *range.first + 1) * sizeof(ConnState),
+                                    node);
+            }
+        }
+    }
+
+    AlignedArray<TestResult> tresults;
+    if (not tresults.resize(worker_threads))
+        return false;
+    for(auto & tres: tresults) {
+        tres.lat_hist = LatHistogram(params.lat_digits);
+        tres.usage = WorkerUsage();
+        tres.churn.connects = 0;
+        tres.churn.deferred_connects = 0;
+        tres.churn.fastopen_connects = 0;
+        tres.churn.lat_hist = LatHistogram(params.lat_digits);
+        tres.udp_lost = 0;
+    }
+
+    AlignedArray<IntervalSlot> slots;
+    if (not slots.resize(worker_threads))
+        return false;
+    for(int i = 0; i < worker_threads; ++i)
+        slots[i].lat_hist = &tresults[i].lat_hist;
+
+    std::vector<WorkerShare> shares(params.rebalance ? worker_threads : 0);
+
+    bool churning = (0 != params.churn_msgs or 0 != params.churn_rate);
+    ChurnTarget churn;
+    if (churning) {
+        churn.endpoints = endpoints;
+        churn.connect = cparams;
+        churn.after_msgs = params.churn_msgs;
+        // rate is split between workers
+        churn.interval_ns = 0;
+        if (0 != params.churn_rate)
+            churn.interval_ns = std::max(1UL, (unsigned long)BILLION * worker_threads / params.churn_rate);
+    }
+
+    // closed loop request. Kernel reads zerocopy messages after send returns,
+    // run_test awaits completions before exit. On heap, as short string would
+    // keep data inside the object
+    std::unique_ptr<std::string> request(new std::string((size_t)params.message_len, 'X'));
+    ZeroCopyBufferKeeper<std::unique_ptr<std::string>> keep_request(res.zc, request);
 
     std::vector<std::thread> workers;
     Sync sync;
 
-    sync.done = false;
-    sync.active_count = 0;
-    sync.run_lola_run.lock();
+    std::vector<int> last_cpus(worker_threads, -1);
 
     for(int i = 0; i < worker_threads ; ++i)
-        workers.emplace_back(worker_thread,
-                             &selectors[i],
-                             params.message_len,
-                             max_sock_count_per_worker,
-                             params.min_timeout,
-                             params.max_timeout,
-                             &sync,
-                             &tresults[i]);
+        if (use_uring)
+            workers.emplace_back(pinned(worker_thread_uring, worker_cpus[i], &last_cpus[i]),
+                                 rings[i].get(),
+                                 &conns,
+                                 params.message_len,
+                                 params.min_timeout,
+                                 params.max_timeout,
+                                 &slots[i],
+                                 &sync,
+                                 &tresults[i]);
+        else if (0 != params.rate)
+            workers.emplace_back(pinned(worker_thread_rate, worker_cpus[i], &last_cpus[i]),
+                                 &selectors[i],
+                                 &conns,
+                                 &worker_fds[i],
+                                 params.message_len,
+                                 (double)params.rate / worker_threads,
+                                 params.udp,
+                                 &slots[i],
+                                 &sync,
+                                 &tresults[i]);
+        else if (params.depth > 1)
+            workers.emplace_back(pinned(worker_thread_pipeline, worker_cpus[i], &last_cpus[i]),
+                                 &selectors[i],
+                                 &conns,
+                                 &worker_fds[i],
+                                 params.message_len,
+                                 params.depth,
+                                 params.udp,
+                                 &slots[i],
+                                 &sync,
+                                 &tresults[i]);
+        else
+            workers.emplace_back(pinned(worker_thread, worker_cpus[i], &last_cpus[i]),
+                                 &selectors[i],
+                                 &conns,
+                                 params.udp,
+                                 params.message_len,
+                                 max_sock_count_per_worker,
+                                 params.min_timeout,
+                                 params.max_timeout,
+                                 request.get(),
+                                 params.zerocopy,
+                                 i,
+                                 &worker_fds[i],
+                                 params.rebalance ? &shares : nullptr,
+                                 churning ? &churn : nullptr,
+                                 sock_events,
+                                 &slots[i],
+                                 &sync,
+                                 &tresults[i]);
 
     bool failed = false;
+    unsigned long cpu_start = 0;
+    unsigned long run_start = 0;
     std::string message((size_t)params.message_len, 'X');
 
-    for(auto sock: sockets.fds) {
-        if (params.message_len != write(sock, message.c_str(), message.length())) {
-            std::perror("write(sock, message, ...)");
+    // tcp gets all first messages in one write, udp needs a datagram per message
+    if (not params.udp)
+        message.resize((size_t)params.message_len * params.depth, 'X');
+
+    // open loop workers don't need first message to start
+    for(auto sock: active_fds) {
+        if (0 != params.rate)
+            break;
+
+        // first messages are counted, so --churn-msgs N reconnects after N replies,
+        // but not measured, their replies are read after start barrier
+        conns[sock].mcount = params.depth;
+        conns[sock].in_flight = params.depth;
+
+        if (params.udp) {
+            for(int i = 0; i < params.depth and not failed; ++i) {
+                put_seq(&message[0], i);
+                if ((int)message.length() != write(sock, message.c_str(), message.length())) {
+                    std::perror("write(sock, message, ...)");
+                    failed = true;
+                }
+            }
+            if (failed)
+                break;
+            continue;
+        }
+
+        // tail, which doesn't fit into socket buffer, is send by worker
+        auto & conn = conns[sock];
+        conn.unsent_bytes = message.length();
+        if (not flush_requests(sock, conn, message)) {
             failed = true;
             break;
         }
+
+        if (use_uring and 0 != conn.unsent_bytes) {
+            // ring isn't used by worker till barrier is released
+            io_uring_sqe * sqe = rings[conn.worker]->get_sqe();
+            if (nullptr == sqe) {
+                failed = true;
+                break;
+            }
+            uring_prep_rw(sqe, IORING_OP_SEND, sock, message.c_str(), conn.unsent_bytes,
+                          uring_send_tag(sock, conn.unsent_bytes));
+            conn.unsent_bytes = 0;
+        }
+    }
+
+    if (not failed and params.connect.fastopen) {
+        unsigned long start_time = get_fast_time();
+        failed = not wait_established(active_fds, params.connect.timeout_ms, res.connect);
+        res.connect.wall_ns += get_fast_time() - start_time;
     }
 
+    unsigned long lead_ns = START_LEAD_NS;
     if (not failed) {
-        while (sync.active_count.load() != worker_threads)
-                usleep(100 * 1000); // 100ms sleep
+        sync.wait_arrived(worker_threads);
+
+        unsigned long start_realtime = 0;
+        if (nullptr != wait_start and not (*wait_start)(start_realtime))
+            failed = true;
+
+        // sleep till the last START_LEAD_NS before common start, workers spin over it
+        unsigned long now = get_realtime();
+        if (not failed and start_realtime > now + START_LEAD_NS) {
+            usleep((start_realtime - now - START_LEAD_NS) / 1000);
+            now = get_realtime();
+        }
+        if (start_realtime > now)
+            lead_ns = start_realtime - now;
+        else if (0 != start_realtime)
+            lead_ns = 0;
+    }
 
-        sync.run_lola_run.unlock();
+    if (not failed) {
+        cpu_start = get_cpu_time();
+        res.start_realtime_ns = get_realtime() + lead_ns;
+        run_start = sync.release(lead_ns);
 
         // run threads for params.runtime seconds
-        int sleeps = params.runtime * 10;
-        for(;sleeps > 0; --sleeps) {
-            usleep(100 * 1000); // 100ms sleep
-            if (sync.active_count.load() == 0)
+        unsigned long run_end = run_start + (unsigned long)params.runtime * BILLION;
+        unsigned long interval_ns = (nullptr == on_interval) ? 0 : (unsigned long)params.interval_ms * MICRO;
+        unsigned long next_interval = run_start + interval_ns;
+        IntervalCollector collector(slots, params.lat_digits, run_start);
+        IntervalStats stats;
+
+        for(;;) {
+            unsigned long curr_time = get_fast_time();
+            if (0 != interval_ns and (curr_time >= next_interval or curr_time >= run_end)) {
+                collector.collect(curr_time, stats);
+                (*on_interval)(stats);
+                next_interval += interval_ns;
+            }
+
+            if (curr_time >= run_end or sync.active_count.load() == 0) {
+                sample_memory(res.mem_open);
                 break;
+            }
+
+            unsigned long wake_time = run_end;
+            if (0 != interval_ns)
+                wake_time = std::min(wake_time, next_interval);
+            usleep(std::min(wake_time - curr_time, 100UL * MICRO) / 1000); // 100ms max
         }
     }
 
-    sync.done.store(true);
+    sync.stop();
+    // after failure workers are still in barrier, they would exit on stop
+    if (failed)
+        sync.release(0);
+
     for(auto & worker: workers)
         worker.join();
 
-    res.mcount = 0;
+    res.worker_cpus = last_cpus;
 
+    // reconnects rate is per test run time
+    res.churn.wall_ns = (0 == run_start) ? 0 : get_fast_time() - run_start;
     for(const auto & ires: tresults) {
-        res.mcount += ires.mcount;
-        for(const auto & lat_ref: ires.lat_map)
-            res.lat_map.emplace(lat_ref.first, 0).first->second += lat_ref.second;
+        res.churn.connects += ires.churn.connects;
+        res.churn.deferred_connects += ires.churn.deferred_connects;
+        res.churn.fastopen_connects += ires.churn.fastopen_connects;
+        res.churn.lat_hist.merge(ires.churn.lat_hist);
+    }
+
+    res.worker_usage.clear();
+    for(int i = 0; i < worker_threads ; ++i) {
+        WorkerUsage usage = tresults[i].usage;
+        usage.mcount = tresults[i].mcount;
+        if (not params.rebalance)
+            usage.conns = worker_fds[i].size();
+        res.worker_usage.push_back(usage);
+    }
+    res.cpu_ns = (0 == cpu_start) ? 0 : get_cpu_time() - cpu_start;
+
+    std::memset(&res.zc, 0, sizeof(res.zc));
+    for(const auto & ires: tresults) {
+        res.zc.sends += ires.zc.sends;
+        res.zc.completed += ires.zc.completed;
+        res.zc.copied += ires.zc.copied;
+        res.zc.fallbacks += ires.zc.fallbacks;
+    }
+
+    // kernel may still read request, keep_request leaks it if completions don't come
+    if (params.zerocopy) {
+        std::vector<int> pending_fds;
+        for(auto fd: active_fds)
+            if (0 != conns[fd].zc_pending)
+                pending_fds.push_back(fd);
+
+        wait_zerocopy_completions(pending_fds, res.zc, BILLION);
     }
 
-    std::vector<unsigned long> mps;
-    mps.reserve(params.num_conn);
+    res.wait = params.wait;
+    res.wakeups = 0;
+    res.spurious_wakeups = 0;
+    for(const auto & sel: selectors) {
+        res.wakeups += sel.wakeups();
+        res.spurious_wakeups += sel.spurious_wakeups();
+    }
+
+    if (params.udp)
+        finish_udp_flows(sockets.fds);
+
+    res.mcount = 0;
+    res.udp_lost = 0;
+    res.lat_hist = LatHistogram(params.lat_digits);
 
     for(const auto & ires: tresults) {
-        for(const auto & item: ires.mess_count_for_sock)
-            mps.push_back(item.second);
+        res.mcount += ires.mcount;
+        res.udp_lost += ires.udp_lost;
+        res.lat_hist.merge(ires.lat_hist);
     }
 
+    res.conn_mcount.clear();
+    res.conn_mcount.reserve(active_fds.size());
+    for(auto fd: active_fds)
+        res.conn_mcount.push_back(conns[fd].mcount);
+
+    std::vector<unsigned long> mps(res.conn_mcount);
     std::sort(begin(mps), end(mps));
 
     for(int i = 0 ; i < (int)res.percentiles.size() ; ++i) {
-        int idx = params.num_conn * (i + 1) / (res.percentiles.size() + 1);
-        res.percentiles[i] = mps[idx];
+        size_t idx = mps.size() * (i + 1) / (res.percentiles.size() + 1);
+        res.percentiles[i] = mps.empty() ? 0 : mps[idx];
     }
 
-    #ifdef LOG2_LAT
-    double base = 2.0;
-    #else
-    double base = std::pow(2L, 0.1L);
-    #endif
+    for(size_t i = 0; i < LAT_PERCENTILES.size(); ++i)
+        res.lat_percentiles[i] = res.lat_hist.value_at_percentile(LAT_PERCENTILES[i]);
+
+    res.avg_lat_ns = res.lat_hist.mean();
+    return not failed;
+}
+
+// reads till whole frame is in 'frame', which already keeps its first bytes
+bool recv_frame(int sock, std::string & frame, size_t max_size, int timeout_ms) {
+    size_t need = PROTO_HEADER_SIZE;
+    for(;;) {
+        if (frame.size() >= PROTO_HEADER_SIZE) {
+            need = PROTO_HEADER_SIZE + FrameReader::get_raw(&frame[8], 4);
+            if (need > max_size) {
+                std::cerr << "Frame too large\n";
+                return false;
+            }
+        }
+
+        if (frame.size() >= need)
+            break;
+
+        pollfd pfd = {sock, POLLIN, 0};
+        if (0 >= poll(&pfd, 1, timeout_ms)) {
+            std::cerr << "Client communication timeout\n";
+            return false;
+        }
 
-    long count = 0;
-    double lat_ns_sum = 0;
+        size_t old_size = frame.size();
+        frame.resize(need);
+        ssize_t bc = recv(sock, &frame[old_size], need - old_size, 0);
+        if (bc <= 0) {
+            if (bc < 0)
+                perror("recv failed");
+            return false;
+        }
+        frame.resize(old_size + bc);
+    }
 
-    for(const auto & lat_ref: res.lat_map) {
-        lat_ns_sum += lat_ref.second * std::pow(base, lat_ref.first);
-        count += lat_ref.second;
+    if (frame.size() != need) {
+        std::cerr << "Unexpected data after frame\n";
+        return false;
     }
+    return true;
+}
 
-    res.avg_lat_ns = (long) (lat_ns_sum / count);
-    return not failed;
+bool send_all(int sock, const std::string & data) {
+    for(size_t sent = 0; sent < data.size();) {
+        ssize_t bc = write(sock, &data[sent], data.size() - sent);
+        if (bc < 0) {
+            if (EINTR == errno)
+                continue;
+            perror("write failed");
+            return false;
+        }
+        sent += bc;
+    }
+    return true;
+}
+
+// growth from connect till test end. Kernel values are for whole host, so with
+// local echo side they include its sockets as well
+void print_memory(const TestResult & res, int num_conn) {
+    auto growth = [](unsigned long before, unsigned long after) {
+        return after > before ? after - before : 0;
+    };
+
+    unsigned long rss = growth(res.mem_before.rss, res.mem_open.rss);
+    unsigned long kernel = growth(res.mem_before.sock_mem, res.mem_open.sock_mem) +
+                           growth(res.mem_before.slab, res.mem_open.slab);
+    std::cout << "    memory: rss +" << rss / 1024 << " KiB, " << rss / std::max(num_conn, 1) << " B per conn";
+    std::cout << ", kernel +" << kernel / 1024 << " KiB, " << kernel / std::max(num_conn, 1) << " B per conn";
+    std::cout << ", sockets +" << growth(res.mem_before.sockets, res.mem_open.sockets) << "\n";
 }
 
 void process_client(int sock, const char ** first_ip, const char ** last_ip, int max_wait_time_seconds=5) {
@@ -635,38 +3459,136 @@ void process_client(int sock, const char ** first_ip, const char ** last_ip, int
         return;
     }
 
-    if (data_len == sizeof(buff)) {
-        std::cerr << "Message to large\n";
+    // MESSAGE FORMAT
+    // CLIENT_IP - CLIENT_PORT - NUM_CONNECTIONS - RUNTIME - TIMEOUT - MESS_SIZE [KEY=VAL ...]
+    // supported options: engine=epoll|uring|uring_sqpoll proto=tcp|udp depth=N lat_digits=N
+    //                    rate=MSG_PER_SEC (open loop) spin_us=N busy_poll_us=N
+    //                    wait=auto|pwait2|timerfd|ms zerocopy=0|1
+    //                    workers=N cpus=CPU_LIST[:CPU_LIST...] rebalance=0|1
+    //                    mode=echo|connect connect_threads=N connect_window=N
+    //                    connect_timeout_ms=N fastopen=0|1 bind_no_port=0|1
+    //                    dest_ips=IP[,IP...] dest_ports=N active_frac=SHARE
+    //                    churn_msgs=N churn_rate=RECONNECTS_PER_SEC
+    //                    interval_ms=N sync_start=0|1 (binary protocol only)
+    // or FRAME_SPEC of BINARY CONTROL PROTOCOL, result is sent back in the same format
+    TestParams params;
+    bool binary = (data_len >= (int)sizeof(PROTO_MAGIC) and
+                   0 == std::memcmp(buff, PROTO_MAGIC, sizeof(PROTO_MAGIC)));
+    if (binary) {
+        std::string frame(buff, data_len);
+        if (not recv_frame(sock, frame, MAX_SPEC_FRAME, max_wait_time_seconds * 1000) or
+                not load_from_frame(frame, params))
+            return;
+
+        std::cout << "Get test spec frame: " << params.ip << ":" << params.port << ", ";
+        std::cout << params.num_conn << " connections\n";
+    } else {
+        if (data_len == sizeof(buff)) {
+            std::cerr << "Message to large\n";
+            return;
+        }
+        buff[data_len] = 0;
+
+        std::cout << "Get test spec '" << buff << "'\n";
+        if (not load_from_str(buff, params))
+            return;
+    }
+
+    // text result has no room for interval stats, text spec - for start handshake
+    if ((0 != params.interval_ms or params.sync_start) and not binary) {
+        std::cerr << "Interval stats and coordinated start need binary control protocol\n";
         return;
     }
-    buff[data_len] = 0;
 
-    std::cout << "Get test spec '" << buff << "'\n";
+    // broken stream doesn't stop the test
+    bool stream_ok = true;
+    std::function<void(const IntervalStats &)> on_interval = [&](const IntervalStats & stats) {
+        if (stream_ok)
+            stream_ok = send_all(sock, serialize_interval(stats));
+    };
+
+    // coordinator waits for the slowest loader to connect, so no timeout here.
+    // If it fails, control connection gets closed and recv_frame fails
+    std::function<bool(unsigned long &)> wait_start = [&](unsigned long & start_realtime) {
+        std::string frame;
+        if (not send_all(sock, FrameWriter(FRAME_READY).finish()) or
+                not recv_frame(sock, frame, MAX_SPEC_FRAME, -1) or
+                not load_start_frame(frame, start_realtime))
+            return false;
 
-    // MESSAGE FORMAT
-    // CLIENT_IP - CLIENT_PORT - NUM_CONNECTIONS - RUNTIME - TIMEOUT - MESS_SIZE
-    TestParams params;
-    if (not load_from_str(buff, params))
-        return;
+        unsigned long now = get_realtime();
+        if (start_realtime < now)
+            std::cerr << "Coordinated start is late by " << (now - start_realtime) / 1000 << " us\n";
+        return true;
+    };
 
-    const int worker_thread = 3;
     TestResult res;
-    if (not run_test(params, res, worker_thread, first_ip, last_ip))
+    if (not run_test(params, res, first_ip, last_ip,
+                     0 != params.interval_ms ? &on_interval : nullptr,
+                     params.sync_start ? &wait_start : nullptr))
         return;
 
     std::cout << "Test finished. Results : " << "\n";
+    if (0 != res.connect.connects) {
+        std::cout << "    connects = " << res.connect.connects << " in ";
+        std::cout << res.connect.wall_ns / MICRO << " ms, ";
+        std::cout << res.connect.connects * BILLION / std::max(res.connect.wall_ns, 1UL) << " per sec";
+        if (params.connect.fastopen)
+            std::cout << ", deferred " << res.connect.deferred_connects << " (fastopen " <<
+                res.connect.fastopen_connects << ")";
+        std::cout << "\n";
+        for(double perc: LAT_PERCENTILES)
+            std::cout << "    " << perc << "% connect lat = " <<
+                res.connect.lat_hist.value_at_percentile(perc) / 1000 << " us\n";
+    }
+    if (params.connect_only) {
+        print_memory(res, params.num_conn);
+        send_all(sock, binary ? serialize_to_frame(res) : serialize_to_str(res));
+        return;
+    }
     std::cout << "    mess_count = " << res.mcount << "\n";
     std::cout << "    average_mps = " << res.mcount / params.runtime << "\n";
     std::cout << "    average_lat = " << (int)(res.avg_lat_ns / 1000) << " us\n";
+    for(size_t i = 0; i < LAT_PERCENTILES.size(); ++i)
+        std::cout << "    " << LAT_PERCENTILES[i] << "% lat = " << res.lat_percentiles[i] / 1000 << " us\n";
     std::cout << "    5% mess perc = " << res.percentiles[0] << "\n";
     std::cout << "    95% mess perc = " << res.percentiles[res.percentiles.size() - 1] << "\n";
-
-    std::string responce = serialize_to_str(res);
-    if( write(sock, &responce[0], responce.size()) != (int)responce.size()) {
-        perror("write failed");
-        return;
+    if (0 != res.mcount)
+        std::cout << "    cpu per mess = " << res.cpu_ns / res.mcount << " ns\n";
+    if (params.udp)
+        std::cout << "    udp lost = " << res.udp_lost << "\n";
+    if (0 != res.churn.connects) {
+        std::cout << "    reconnects = " << res.churn.connects << ", ";
+        std::cout << res.churn.connects * BILLION / std::max(res.churn.wall_ns, 1UL) << " per sec";
+        if (params.connect.fastopen)
+            std::cout << ", deferred " << res.churn.deferred_connects << " (fastopen " <<
+                res.churn.fastopen_connects << ")";
+        std::cout << "\n";
+        for(double perc: LAT_PERCENTILES)
+            std::cout << "    " << perc << "% reconnect lat = " <<
+                res.churn.lat_hist.value_at_percentile(perc) / 1000 << " us\n";
+    }
+    std::cout << "    " << precise_wait_name(res.wait) << " wakeups = " << res.wakeups;
+    std::cout << ", spurious = " << res.spurious_wakeups << "\n";
+    for(size_t i = 0; i < res.worker_cpus.size(); ++i) {
+        std::cout << "    worker " << i << " pinned to ";
+        if (params.cpus.empty())
+            std::cout << "any cpu";
+        else
+            std::cout << "cpus " << format_cpu_list(params.cpus[i % params.cpus.size()]);
+        std::cout << ", finished on cpu " << res.worker_cpus[i];
+        std::cout << " node " << cpu_numa_node(res.worker_cpus[i]) << "\n";
     }
-    return;
+    for(size_t i = 0; i < res.worker_usage.size(); ++i) {
+        const auto & usage = res.worker_usage[i];
+        std::cout << "    worker " << i << " busy " << usage.busy_ns * 100 / std::max(usage.run_ns, 1UL);
+        std::cout << "%, messages " << usage.mcount << ", conns " << usage.conns;
+        std::cout << " (+" << usage.conns_in << " -" << usage.conns_out << ")";
+        std::cout << ", started +" << usage.start_lag_ns / 1000 << " us\n";
+    }
+    print_memory(res, params.num_conn);
+
+    send_all(sock, binary ? serialize_to_frame(res) : serialize_to_str(res));
 }
 
 void *get_in_addr(struct sockaddr *sa) {
@@ -740,16 +3662,187 @@ int main_loop_thread(int port, bool single_shot, const char ** first_ip, const c
     return 0;
 }
 
+// loader coordination microbenchmark, run as 'server_cpp --bench-sync'.
+// Runs start/stop coordination and stat blocks, as they were before Sync (legacy),
+// side by side with current ones. Both use the same worker count, worker i is
+// pinned to i-th allowed cpu round robin. Workers spin on own message counter:
+// legacy - locked mutex barrier, main thread polls arrived count every 100ms,
+// blocks packed in std::vector, seq_cst stop check per update. Current - Sync
+// with common start time, aligned blocks, relaxed stop check per batch
+const int BENCH_BATCH = 64;
+const unsigned long BENCH_RUN_NS = 200UL * MICRO;
+
+// TestResult before alignment, kept only to bench the old layout
+struct LegacyTestResult {
+    unsigned long mcount;
+    unsigned long avg_lat_ns;
+    std::array<unsigned long, 19> percentiles;
+    std::array<unsigned long, LAT_PERCENTILES.size()> lat_percentiles;
+    LatHistogram lat_hist;
+    unsigned long cpu_ns;
+    PreciseWait wait;
+    unsigned long wakeups;
+    unsigned long spurious_wakeups;
+    ZeroCopyStats zc;
+    std::vector<int> worker_cpus;
+    WorkerUsage usage;
+    std::vector<WorkerUsage> worker_usage;
+    ConnectStats connect;
+    ConnectStats churn;
+    std::vector<unsigned long> conn_mcount;
+};
+
+// start/stop sync before Sync
+struct LegacySync {
+    std::atomic_bool done;
+    std::mutex run_lola_run;
+    std::atomic_int active_count;
+};
+
+struct BenchRun {
+    double updates_per_sec;
+    unsigned long start_skew_ns;    // latest worker start - earliest one
+    unsigned long stop_ns;          // from stop till all workers are joined
+};
+
+void bench_pin(const std::vector<int> & cpus, int worker) {
+    if (not cpus.empty())
+        pin_current_thread({cpus[worker % cpus.size()]});
+}
+
+BenchRun bench_result(const std::vector<unsigned long> & starts, unsigned long updates,
+                      unsigned long run_start, unsigned long stop_time, unsigned long stop_ns) {
+    auto range = std::minmax_element(starts.begin(), starts.end());
+    BenchRun run;
+    run.updates_per_sec = (double)updates * BILLION / (stop_time - run_start);
+    run.start_skew_ns = *range.second - *range.first;
+    run.stop_ns = stop_ns;
+    return run;
+}
+
+BenchRun bench_legacy_run(int workers, const std::vector<int> & cpus) {
+    LegacySync sync;
+    sync.done = false;
+    sync.active_count = 0;
+    sync.run_lola_run.lock();
+
+    std::vector<LegacyTestResult> blocks(workers);
+    std::vector<unsigned long> starts(workers, 0);
+    std::vector<std::thread> threads;
+
+    for(int i = 0; i < workers; ++i)
+        threads.emplace_back([&, i]() {
+            bench_pin(cpus, i);
+            blocks[i].mcount = 0;
+            sync.active_count++;
+
+            // inhouse barrier implementation
+            sync.run_lola_run.lock();
+            sync.run_lola_run.unlock();
+            starts[i] = get_fast_time();
+
+            // volatile - store on every update, as real worker does
+            volatile unsigned long * counter = &blocks[i].mcount;
+            while(not sync.done.load())
+                ++*counter;
+        });
+
+    while (sync.active_count.load() != workers)
+        usleep(100 * 1000); // 100ms sleep
+
+    unsigned long run_start = get_fast_time();
+    sync.run_lola_run.unlock();
+    usleep(BENCH_RUN_NS / 1000);
+
+    unsigned long stop_time = get_fast_time();
+    sync.done.store(true);
+    for(auto & th: threads)
+        th.join();
+    unsigned long stop_ns = get_fast_time() - stop_time;
+
+    unsigned long updates = 0;
+    for(const auto & block: blocks)
+        updates += block.mcount;
+    return bench_result(starts, updates, run_start, stop_time, stop_ns);
+}
+
+BenchRun bench_sync_run(int workers, const std::vector<int> & cpus) {
+    Sync sync;
+    AlignedArray<TestResult> blocks;
+    std::vector<unsigned long> starts(workers, 0);
+    std::vector<std::thread> threads;
+
+    if (not blocks.resize(workers))
+        return BenchRun{0, 0, 0};
+
+    for(int i = 0; i < workers; ++i)
+        threads.emplace_back([&, i]() {
+            bench_pin(cpus, i);
+            TestResult & block = blocks[i];
+            block.mcount = 0;
+            starts[i] = sync.arrive_and_wait();
+
+            volatile unsigned long * counter = &block.mcount;
+            while(not sync.stopped())
+                for(int j = 0; j < BENCH_BATCH; ++j)
+                    ++*counter;
+        });
+
+    sync.wait_arrived(workers);
+    unsigned long run_start = sync.release(START_LEAD_NS);
+    usleep((START_LEAD_NS + BENCH_RUN_NS) / 1000);
+
+    unsigned long stop_time = get_fast_time();
+    sync.stop();
+    for(auto & th: threads)
+        th.join();
+    unsigned long stop_ns = get_fast_time() - stop_time;
+
+    unsigned long updates = 0;
+    for(int i = 0; i < workers; ++i)
+        updates += blocks[i].mcount;
+    return bench_result(starts, updates, run_start, stop_time, stop_ns);
+}
+
+int bench_sync() {
+    std::vector<int> cpus;
+    if (not get_current_affinity(cpus))
+        cpus.clear();
+
+    std::cout << "Legacy - mutex barrier and packed blocks, sync - Sync and aligned blocks\n";
+    std::cout << "workers  Mupd/s legacy/sync  start skew us legacy/sync  stop us legacy/sync\n";
+    for(int workers: {3, 16, 64}) {
+        BenchRun legacy = bench_legacy_run(workers, cpus);
+        BenchRun current = bench_sync_run(workers, cpus);
+        std::cout << std::setw(7) << workers << std::fixed << std::setprecision(1);
+        std::cout << std::setw(12) << legacy.updates_per_sec / MICRO;
+        std::cout << std::setw(8) << current.updates_per_sec / MICRO;
+        std::cout << std::setw(19) << legacy.start_skew_ns / 1000;
+        std::cout << std::setw(8) << current.start_skew_ns / 1000;
+        std::cout << std::setw(13) << legacy.stop_ns / 1000;
+        std::cout << std::setw(8) << current.stop_ns / 1000 << "\n";
+    }
+    return 0;
+}
+
 int main(int argc, const char **argv) {
     bool single_shot = false;
+    int port = DEFAULT_PORT;
 
     const char ** first_ip = argv + 1;
     const char ** last_ip = argv + argc;
 
-    if (argc > 1) {
-        if (argv[1] == std::string("-s")) {
+    // [-s] [-p CONTROL_PORT] [CLIENT_IP...], several loaders on one host need own ports
+    for(; first_ip != last_ip; ++first_ip) {
+        if (*first_ip == std::string("-s")) {
             single_shot = true;
-            ++first_ip;
+        } else if (*first_ip == std::string("-p") and first_ip + 1 != last_ip) {
+            long num;
+            if (not parse_option_num("-p", *++first_ip, 1, 65535, num))
+                return 1;
+            port = num;
+        } else {
+            break;
         }
     }
 
@@ -758,5 +3851,8 @@ int main(int argc, const char **argv) {
         return 1;
 #endif
 
-    return main_loop_thread(DEFAULT_PORT, single_shot, first_ip, last_ip);
+    if (argc > 1 and argv[1] == std::string("--bench-sync"))
+        return bench_sync();
+
+    return main_loop_thread(port, single_shot, first_ip, last_ip);
 }